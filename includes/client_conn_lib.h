@@ -12,20 +12,54 @@
 
 /* Para incluir FILE */
 #include "../includes/picohttpparser.h"
+#include "../includes/timer_wheel_lib.h"
 #include <stdio.h>
+#include <sys/types.h>
+#include <time.h>
 
 /* Longitud maximo de respuesta con headers */
 #define RESPONSE_LEN 8192
 /* Maximo numero de headers */
 #define MAXNUMHEADERS 128
+/* Buffers de peticion libres que se guardan para reutilizarlos (los que sobran se liberan) */
+#define REQUESTBUFFERSCACHE 64
+/* Pila que necesita un hilo que atiende conexiones, sin contar las rutas de la peticion (ver
+ * client_stack_size): la cadena mas profunda medida con -fstack-usage (holder_execution_job,
+ * manage_client, process_status y el envio por io_uring) mas CLIENTSTACKLIBC para libc */
+#define CLIENTSTACKFRAME (8 * 1024 + CLIENTSTACKLIBC)
+/* Margen para las funciones de libc que se llaman al atender una peticion (syslog, stdio, posix_spawn) */
+#define CLIENTSTACKLIBC (16 * 1024)
+/* Peticiones seguidas que atiende un hilo de una conexion (modo epoll o park_idle) antes de
+ * dejarla como continuacion en su cola local */
+#define CONNREQUESTSPERTURN 16
 
 /* Estructura con informacion del socket del cliente
  * e informacion a liberar cuando se destruya */
 typedef struct ClientConnection {
   int connfd;
+  struct ThreadPool *pool; // pool (de su aceptador) que atiende la conexion
   void *freeVar;
   int closeVar;
   FILE *fcloseVar;
+
+  /* Estado necesario para retomar la conexion en el modo epoll */
+  int recvLen;              // bytes acumulados en el buffer de recepcion
+  int readyLen;             // bytes ya leidos por el event loop (io_uring) tras recvLen
+  char *pendingData;        // cabeceras que no se pudieron enviar todavia
+  size_t pendingLen;        // longitud total de pendingData
+  size_t pendingOffset;     // bytes de pendingData ya enviados
+  int pendingFile;          // archivo pendiente de enviar con sendfile (0 si no hay)
+  off_t pendingFileOffset;  // offset del archivo pendiente
+  size_t pendingFileLen;    // bytes del archivo que faltan por enviar
+  u_int8_t registered;      // el socket ya esta en el conjunto de epoll
+  u_int8_t scriptLane;      // la peticion en curso espera o se ejecuta en el pool de scripts
+  u_int8_t waiting;         // esperando el primer byte de una peticion (conexion nueva o keep-alive)
+  struct ClientConnection *idlePrev, *idleNext; // lista de conexiones en espera en el event loop
+
+  /* Timeouts de la conexion */
+  TimerNode timer;          // vencimiento de la fase actual (cabeceras, cuerpo, keep-alive o respuesta)
+  long long requestStart;   // instante (timer_now) del primer byte de la peticion en curso, 0 si no hay
+  long long requestStartUs; // el mismo instante en microsegundos (limiter_now), para medir la latencia
 } ClientConnection;
 
 /*
@@ -47,12 +81,24 @@ typedef struct RequestContent {
   size_t totalLen;
 } RequestContent;
 
+/* Memoria de las conexiones (ver connection_memory) */
+typedef struct ConnectionMemory {
+  long connections;         // conexiones abiertas
+  long connectionBytes;     // estructuras, buffers de recepcion y respuestas pendientes de las conexiones abiertas
+  long requestBuffers;      // buffers de peticion reservados (en uso o guardados para reutilizarlos)
+  long requestBuffersInUse; // buffers de peticion que esta usando algun hilo
+  long requestBufferBytes;  // tamaño de cada buffer de peticion
+} ConnectionMemory;
+
 /********
  * FUNCIÓN: void *manage_client(void *cliConnVoid)
  * ARGS_IN: void *cliConnVoid - puntero a ClientConnection, con informacion de la conexion
  * DESCRIPCIÓN: Funcion que recibe, parsea y procesa una request,
  *              creando posteriormente la respuesta adecuada.
  *              Esta funcion se ejecuta en un thread independiente.
+ *              En modo epoll se llama cada vez que el socket esta listo y, cuando
+ *              no quedan datos, devuelve la conexion al event loop en vez de cerrarla.
+ *              En modo fibers se ejecuta en una fibra durante toda la vida de la conexion.
  * ARGS_OUT: void * - No retorna ningun valor de utilidad. NULL
  ********/
 void *manage_client(void *cli_conn_arg);
@@ -65,3 +111,78 @@ void *manage_client(void *cli_conn_arg);
  *              en cualquier punto del programa.
  ********/
 void free_thread_resources(void *arg);
+
+/********
+ * FUNCIÓN: void connection_timed_out(TimerNode *timer)
+ * ARGS_IN: TimerNode *timer - Timer de la conexion que ha vencido
+ * DESCRIPCIÓN: Funcion de vencimiento de la rueda de timers. Hace shutdown del socket: el hilo
+ *              bloqueado en recv/send (o el event loop) ve el cierre y libera la conexion
+ ********/
+void connection_timed_out(TimerNode *timer);
+
+/********
+ * FUNCIÓN: void start_connection_timeouts(ClientConnection *cliConn)
+ * ARGS_IN: ClientConnection *cliConn - Conexion recien aceptada
+ * DESCRIPCIÓN: Asocia el timer a la conexion y empieza a contar header_timeout, de modo
+ *              que tambien vence una conexion que nunca llega a enviar nada. Desde ahora la
+ *              conexion cuenta como abierta hasta free_thread_resources
+ ********/
+void start_connection_timeouts(ClientConnection *cliConn);
+
+/********
+ * FUNCIÓN: void set_script_pool(struct ThreadPool *pool)
+ * ARGS_IN: struct ThreadPool *pool - Pool que ejecuta los scripts (NULL para ejecutarlos en el
+ *                                    pool de cada conexion)
+ * DESCRIPCIÓN: Separa las peticiones de script (GET con argumentos y POST) de las de archivos
+ *              estaticos: tras parsearlas pasan a este pool, de tamaño fijo, y al responder la
+ *              conexion vuelve a su pool. Los scripts lentos no ocupan los hilos de los estaticos
+ ********/
+void set_script_pool(struct ThreadPool *pool);
+
+/********
+ * FUNCIÓN: void drain_clients()
+ * DESCRIPCIÓN: Empieza el cierre ordenado de las conexiones: las respuestas llevan
+ *              "Connection: close" y cada conexion se cierra al terminar su peticion en curso.
+ *              Las que esperan la siguiente peticion (con timeout armado) se cierran ya
+ ********/
+void drain_clients();
+
+/********
+ * FUNCIÓN: int clients_draining()
+ * DESCRIPCIÓN: Indica si se ha llamado a drain_clients
+ * ARGS_OUT: int - 1 si las conexiones se estan cerrando, 0 si no
+ ********/
+int clients_draining();
+
+/********
+ * FUNCIÓN: void *connection_alloc(size_t size)
+ * ARGS_IN: size_t size - Bytes a reservar
+ * DESCRIPCIÓN: Reserva (a 0) memoria de una conexion y la suma a la memoria de las conexiones
+ * ARGS_OUT: void * - La memoria reservada, NULL en caso de error
+ ********/
+void *connection_alloc(size_t size);
+
+/********
+ * FUNCIÓN: void connection_free(void *ptr, size_t size)
+ * ARGS_IN: void *ptr - Memoria reservada con connection_alloc (puede ser NULL)
+ *          size_t size - Bytes con los que se reservo
+ * DESCRIPCIÓN: Libera memoria de una conexion y la resta de la memoria de las conexiones
+ ********/
+void connection_free(void *ptr, size_t size);
+
+/********
+ * FUNCIÓN: void connection_memory(ConnectionMemory *memory)
+ * ARGS_IN: ConnectionMemory *memory - (output) Memoria de las conexiones en este momento
+ * DESCRIPCIÓN: Informa de la memoria que ocupan las conexiones abiertas y los buffers de peticion.
+ *              La pila de los hilos no se cuenta: es thread_stack_size por hilo
+ ********/
+void connection_memory(ConnectionMemory *memory);
+
+/********
+ * FUNCIÓN: size_t client_stack_size()
+ * DESCRIPCIÓN: Pila que necesita como minimo un hilo que ejecuta manage_client: CLIENTSTACKFRAME
+ *              mas la url y el archivo de la peticion, que estan en la pila y cuya longitud
+ *              depende de recv_buffer_length, base_file y root_path
+ * ARGS_OUT: size_t - Bytes de pila
+ ********/
+size_t client_stack_size();
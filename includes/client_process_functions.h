@@ -15,61 +15,90 @@
 #include "../includes/http_codes.h"
 #include "../includes/server.h"
 
+/* Longitud maxima del cuerpo de la respuesta de status_path */
+#define STATUSBODYLEN 4096
+
 /********
- * FUNCIÓN: int process_OPTIONS(RequestContent *request, char *sendBuffer, int sockfd)
+ * FUNCIÓN: int process_OPTIONS(RequestContent *request, char *sendBuffer, ClientConnection *cliConn)
  * ARGS_IN: RequestContent *request - Request con la inforacion a usar para responder
- *          int sockfd - Socket por el que enviar los datos
  *          char *sendBuffer - Buffer con memoria reservada a completar y enviar
+ *          ClientConnection *cliConn - Conexion por la que enviar los datos
  * DESCRIPCIÓN: Función encargada de procesar una request de tipo OPTIONS y enviar la
  *              respuesta
  * ARGS_OUT: int - Devuelve -1 en caso de error, 0 en el resto de casos
  ********/
-int process_OPTIONS(RequestContent *request, char *sendBuffer, int sockfd);
+int process_OPTIONS(RequestContent *request, char *sendBuffer, ClientConnection *cliConn);
 
 /********
- * FUNCIÓN: int process_HEAD(RequestContent *request, char *sendBuffer, int sockfd)
+ * FUNCIÓN: int process_HEAD(RequestContent *request, char *sendBuffer, ClientConnection *cliConn)
  * ARGS_IN: RequestContent *request - Request con la inforacion a usar para responder
- *          int sockfd - Socket por el que enviar los datos
  *          char *sendBuffer - Buffer con memoria reservada a completar y enviar
+ *          ClientConnection *cliConn - Conexion por la que enviar los datos
  * DESCRIPCIÓN: Función encargada de procesar una request de tipo HEAD y enviar la
  *              respuesta
  * ARGS_OUT: int - Devuelve -1 en caso de error, 0 en el resto de casos
  ********/
-int process_HEAD(RequestContent *request, char *sendBuffer, int sockfd);
+int process_HEAD(RequestContent *request, char *sendBuffer, ClientConnection *cliConn);
 
 /********
- * FUNCIÓN: int process_GET(RequestContent *request, char *sendBuffer, int sockfd, FILE **toClose)
+ * FUNCIÓN: int process_GET(RequestContent *request, char *sendBuffer, ClientConnection *cliConn)
  * ARGS_IN: RequestContent *request - Request con la inforacion a usar para responder
- *          int sockfd - Socket por el que enviar los datos
  *          char *sendBuffer - Buffer con memoria reservada a completar y enviar
- *          FILE **toClose - Sirve para liberar los recursos en caso de salida brupta,
- *                           como por ejemplo al recibir(SIGINT)
+ *          ClientConnection *cliConn - Conexion por la que enviar los datos. Su campo
+ *                                      fcloseVar sirve para liberar los recursos en caso
+ *                                      de salida brupta, como por ejemplo al recibir(SIGINT)
  * DESCRIPCIÓN: Función encargada de procesar una request de tipo GET y enviar la
  *              respuesta, que es un archivo o una respuesta creada por el script ejecutado
  * ARGS_OUT: int - Devuelve -1 en caso de error, 0 en el resto de casos
  ********/
-int process_GET(RequestContent *request, char *sendBuffer, int sockfd, FILE **toClose);
+int process_GET(RequestContent *request, char *sendBuffer, ClientConnection *cliConn);
 
 /********
- * FUNCIÓN: int process_POST(RequestContent *request, char *sendBuffer, int sockfd, FILE **toClose)
+ * FUNCIÓN: int process_POST(RequestContent *request, char *sendBuffer, ClientConnection *cliConn)
  * ARGS_IN: RequestContent *request - Request con la inforacion a usar para responder
- *          int sockfd - Socket por el que enviar los datos
  *          char *sendBuffer - Buffer con memoria reservada a completar y enviar
- *          FILE **toClose - Sirve para liberar los recursos en caso de salida brupta,
- *                           como por ejemplo al recibir(SIGINT)
+ *          ClientConnection *cliConn - Conexion por la que enviar los datos. Su campo
+ *                                      fcloseVar sirve para liberar los recursos en caso
+ *                                      de salida brupta, como por ejemplo al recibir(SIGINT)
  * DESCRIPCIÓN: Función encargada de procesar una request de tipo POST y enviar la
  *              respuesta. Maneja argumentos tanto en la url como en el cuerpo
  * ARGS_OUT: int - Devuelve -1 en caso de error, 0 en el resto de casos
  ********/
-int process_POST(RequestContent *request, char *sendBuffer, int sockfd, FILE **toClose);
+int process_POST(RequestContent *request, char *sendBuffer, ClientConnection *cliConn);
+
+/********
+ * FUNCIÓN: int process_status(RequestContent *request, char *sendBuffer, ClientConnection *cliConn)
+ * ARGS_IN: RequestContent *request - Request con la inforacion a usar para responder
+ *          char *sendBuffer - Buffer con memoria reservada a completar y enviar
+ *          ClientConnection *cliConn - Conexion por la que enviar los datos
+ * DESCRIPCIÓN: Responde a un GET de status_path con el estado del servidor en texto plano,
+ *              una linea "nombre: valor" por dato (limite de conexiones actual, ocupadas y
+ *              estadisticas de todos los pools juntos). Los histogramas son una lista de
+ *              POOLSTATSBUCKETS contadores, el i de tiempos de [2^(i-1), 2^i) microsegundos.
+ *              Tambien la pila de cada hilo y la memoria de las conexiones: connection_bytes
+ *              suma sus estructuras, buffers de recepcion, respuestas pendientes y los buffers
+ *              de peticion, y connection_bytes_avg es esa suma por conexion abierta. fibers son
+ *              las fibras vivas (modo fibers)
+ * ARGS_OUT: int - Devuelve -1 en caso de error, 0 en el resto de casos
+ ********/
+int process_status(RequestContent *request, char *sendBuffer, ClientConnection *cliConn);
 
 /********
- * FUNCIÓN: int process_error(RequestContent *request, char *sendBuffer, int sockfd, HTTPResponseCode responseCode)
+ * FUNCIÓN: int process_error(RequestContent *request, char *sendBuffer, ClientConnection *cliConn, HTTPResponseCode responseCode)
  * ARGS_IN: RequestContent *request - Request con la inforacion a usar para responder
- *          int sockfd - Socket por el que enviar los datos
  *          char *sendBuffer - Buffer con memoria reservada a completar y enviar
+ *          ClientConnection *cliConn - Conexion por la que enviar los datos
  *          HTTPResponseCode responseCode - Codigo http de respuesta a enviar
  * DESCRIPCIÓN: Función encargada enviar una respuesta dado un código de error.
  * ARGS_OUT: int - Devuelve -1 en caso de error, 0 en el resto de casos
  ********/
-int process_error(RequestContent *request, char *sendBuffer, int sockfd, HTTPResponseCode responseCode);
+int process_error(RequestContent *request, char *sendBuffer, ClientConnection *cliConn, HTTPResponseCode responseCode);
+
+/********
+ * FUNCIÓN: int flush_pending_data(ClientConnection *cliConn)
+ * ARGS_IN: ClientConnection *cliConn - Conexion con datos pendientes de enviar
+ * DESCRIPCIÓN: Continua el envio de una respuesta que no cabia en el socket no bloqueante
+ * ARGS_OUT: int - Devuelve 0 si se ha enviado todo, 1 si el socket se ha vuelto a llenar
+ *                 y -1 en caso de error
+ ********/
+int flush_pending_data(ClientConnection *cliConn);
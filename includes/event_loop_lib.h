@@ -0,0 +1,56 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                               *
+ *  event_loop_lib.h - Archivo .h para event_loop_lib.c          *
+ *                                                               *
+ *  Autores:                                                     *
+ *    - Bhavuk Sikka    (bhavuk.sikka@estudiante.uam.es)         *
+ *    - Samuel de Lucas (samuel.lucas@estudiante.uam.es)         *
+ *                                                               *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#pragma once
+
+#include "../includes/client_conn_lib.h"
+
+/* Numero maximo de eventos devueltos en cada llamada a epoll_wait */
+#define EVENTLOOPMAXEVENTS 256
+/* Buffers de recepcion (de recv_buffer_length bytes) compartidos por todas las conexiones
+ * con el backend io_uring */
+#define EVENTLOOPBUFFERS 256
+/* Grupo de buffers registrado en el ring */
+#define EVENTLOOPBUFFERGROUP 1
+
+/********
+ * FUNCIÓN: int initialize_event_loop()
+ * DESCRIPCIÓN: Crea el conjunto de epoll (o el ring de io_uring) y el hilo que espera
+ *              eventos en él. Cada conexion que se vuelve legible o escribible se entrega
+ *              al pool de hilos con add_job. Con io_uring el propio ring hace el recv
+ *              sobre buffers compartidos y la conexion llega al pool con los datos ya leidos
+ * ARGS_OUT: int - Devuelve 0 en caso de exito, -1 en caso de error
+ ********/
+int initialize_event_loop();
+
+/********
+ * FUNCIÓN: int event_loop_watch(ClientConnection *cliConn, int writable)
+ * ARGS_IN: ClientConnection *cliConn - Conexion a vigilar
+ *          int writable - 0 para esperar datos del cliente, 1 para esperar a poder escribir
+ * DESCRIPCIÓN: Arma la conexion en el event loop (edge-triggered y oneshot).
+ *              Tras llamar a esta función el hilo no debe volver a tocar cliConn,
+ *              pues otro hilo puede estar atendiendola ya
+ * ARGS_OUT: int - Devuelve 0 en caso de exito, -1 en caso de error
+ ********/
+int event_loop_watch(ClientConnection *cliConn, int writable);
+
+/********
+ * FUNCIÓN: void stop_event_loop()
+ * DESCRIPCIÓN: Detiene el hilo del event loop. Despues de esta llamada
+ *              no se entregan mas trabajos al pool
+ ********/
+void stop_event_loop();
+
+/********
+ * FUNCIÓN: void terminate_event_loop()
+ * DESCRIPCIÓN: Cierra las conexiones que seguian en espera y libera el conjunto de epoll o el ring.
+ *              Se debe llamar despues de terminate_pool
+ ********/
+void terminate_event_loop();
@@ -0,0 +1,127 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                               *
+ *  fiber_lib.h - Archivo .h para fiber_lib.c                    *
+ *                                                               *
+ *  Autores:                                                     *
+ *    - Bhavuk Sikka    (bhavuk.sikka@estudiante.uam.es)         *
+ *    - Samuel de Lucas (samuel.lucas@estudiante.uam.es)         *
+ *                                                               *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* Eventos de epoll que recoge un planificador en cada espera */
+#define FIBEREVENTS 64
+/* Pilas de fibras terminadas que cada planificador guarda para reutilizarlas (las demas se liberan) */
+#define FIBERSTACKCACHE 64
+
+/********
+ * FUNCIÓN: int initialize_fibers(int numThreads, int pinned, size_t stackSize, void (*cleanup_fun)(void *))
+ * ARGS_IN: int numThreads - Hilos planificadores (0 = uno por CPU)
+ *          int pinned - Si es 1 se crea un planificador fijado a cada CPU permitida (numThreads no se usa)
+ *          size_t stackSize - Bytes de pila de cada fibra (sin contar la pagina de guarda)
+ *          void (*cleanup_fun)(void *) - Funcion que se llama, al terminar, con un puntero al
+ *                                        argumento de cada fibra que no ha acabado (como en el pool)
+ * DESCRIPCIÓN: Crea los planificadores de fibras (M:N): cada uno es un hilo con su epoll que
+ *              ejecuta fibras hasta que se bloquean en una de las funciones fiber_* y entonces
+ *              pasa a otra. Una fibra se queda siempre en el planificador en el que empieza
+ * ARGS_OUT: int - Devuelve 0 en caso de exito, -1 en caso de error
+ ********/
+int initialize_fibers(int numThreads, int pinned, size_t stackSize, void (*cleanup_fun)(void *));
+
+/********
+ * FUNCIÓN: int fiber_spawn(void *(*fun)(void *), void *arg, int cpu)
+ * ARGS_IN: void *(*fun)(void *) - Funcion que ejecuta la fibra
+ *          void *arg - Argumento de la funcion
+ *          int cpu - CPU cuyo planificador ejecuta la fibra (-1, o si no hay planificador fijado
+ *                    a esa CPU, se reparten entre todos)
+ * DESCRIPCIÓN: Crea una fibra con su propia pila (mmap, con pagina de guarda). Se puede llamar
+ *              desde cualquier hilo
+ * ARGS_OUT: int - Devuelve 0 en caso de exito, -1 en caso de error
+ ********/
+int fiber_spawn(void *(*fun)(void *), void *arg, int cpu);
+
+/********
+ * FUNCIÓN: int in_fiber()
+ * DESCRIPCIÓN: Indica si el codigo se esta ejecutando en una fibra
+ * ARGS_OUT: int - 1 si se ejecuta en una fibra, 0 si no
+ ********/
+int in_fiber();
+
+/********
+ * FUNCIÓN: void fiber_yield()
+ * DESCRIPCIÓN: Cede el planificador a las demas fibras listas; la fibra sigue despues de ellas.
+ *              Fuera de una fibra no hace nada
+ ********/
+void fiber_yield();
+
+/********
+ * FUNCIÓN: int fiber_wait(int fd, int events)
+ * ARGS_IN: int fd - Descriptor a esperar
+ *          int events - POLLIN y/o POLLOUT
+ * DESCRIPCIÓN: Espera a que el descriptor este listo. En una fibra la aparca en el epoll de su
+ *              planificador, que mientras tanto ejecuta otras. Fuera de una fibra usa poll
+ * ARGS_OUT: int - Devuelve 0 cuando el descriptor esta listo (o cerrado), -1 en caso de error
+ ********/
+int fiber_wait(int fd, int events);
+
+/********
+ * FUNCIÓN: ssize_t fiber_recv(int fd, void *buffer, size_t len)
+ * ARGS_IN: int fd - Socket
+ *          void *buffer - Buffer de recepcion
+ *          size_t len - Bytes maximos a recibir
+ * DESCRIPCIÓN: recv que, sin datos, espera con fiber_wait en vez de bloquear el hilo
+ * ARGS_OUT: ssize_t - Bytes recibidos, 0 si el cliente ha cerrado, -1 en caso de error
+ ********/
+ssize_t fiber_recv(int fd, void *buffer, size_t len);
+
+/********
+ * FUNCIÓN: ssize_t fiber_send(int fd, const void *buffer, size_t len, int flags)
+ * ARGS_IN: int fd - Socket
+ *          const void *buffer - Datos a enviar
+ *          size_t len - Bytes a enviar
+ *          int flags - Flags de send (MSG_MORE)
+ * DESCRIPCIÓN: Envia todo el buffer como un send bloqueante, pero con el socket lleno espera
+ *              con fiber_wait en vez de bloquear el hilo
+ * ARGS_OUT: ssize_t - Bytes enviados (len), -1 en caso de error
+ ********/
+ssize_t fiber_send(int fd, const void *buffer, size_t len, int flags);
+
+/********
+ * FUNCIÓN: ssize_t fiber_sendfile(int outfd, int infd, off_t *offset, size_t count)
+ * ARGS_IN: int outfd - Socket
+ *          int infd - Archivo a enviar
+ *          off_t *offset - Offset del archivo desde el que se envia (se actualiza)
+ *          size_t count - Bytes a enviar
+ * DESCRIPCIÓN: Envia count bytes del archivo con sendfile. Con el socket lleno espera con
+ *              fiber_wait en vez de bloquear el hilo
+ * ARGS_OUT: ssize_t - Bytes enviados (menos de count si el archivo es mas corto), -1 en caso de error
+ ********/
+ssize_t fiber_sendfile(int outfd, int infd, off_t *offset, size_t count);
+
+/********
+ * FUNCIÓN: pid_t fiber_waitpid(pid_t pid, int *status)
+ * ARGS_IN: pid_t pid - Proceso hijo
+ *          int *status - (output, opcional) Estado de salida del hijo
+ * DESCRIPCIÓN: waitpid que, en una fibra, espera la salida del hijo en el epoll del
+ *              planificador (pidfd) en vez de bloquear el hilo
+ * ARGS_OUT: pid_t - pid del hijo, -1 en caso de error
+ ********/
+pid_t fiber_waitpid(pid_t pid, int *status);
+
+/********
+ * FUNCIÓN: long fibers_alive()
+ * DESCRIPCIÓN: Fibras creadas que aun no han terminado
+ * ARGS_OUT: long - Numero de fibras
+ ********/
+long fibers_alive();
+
+/********
+ * FUNCIÓN: void terminate_fibers()
+ * DESCRIPCIÓN: Detiene los planificadores y libera las fibras que no han terminado, llamando
+ *              antes a la funcion de limpieza con su argumento
+ ********/
+void terminate_fibers();
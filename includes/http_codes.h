@@ -27,6 +27,7 @@ typedef enum HTTPResponseCode {
   /* Server error codes */
   INTERNAL_SERVER_ERROR = 500,
   NOT_IMPLEMENTED = 501,
+  SERVICE_UNAVAILABLE = 503,
   HTTP_VER_NOT_SUPP = 505
 
 } HTTPResponseCode;
@@ -0,0 +1,97 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                               *
+ *  limiter_lib.h - Archivo .h para limiter_lib.c                *
+ *                                                               *
+ *  Autores:                                                     *
+ *    - Bhavuk Sikka    (bhavuk.sikka@estudiante.uam.es)         *
+ *    - Samuel de Lucas (samuel.lucas@estudiante.uam.es)         *
+ *                                                               *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#pragma once
+
+/* Una ventana de latencias se cierra con LIMITERWINDOWSAMPLES muestras, o pasado
+ * LIMITERWINDOWMS si tiene al menos LIMITERMINSAMPLES */
+#define LIMITERWINDOWSAMPLES 100
+#define LIMITERMINSAMPLES 10
+#define LIMITERWINDOWMS 1000
+/* Latencia que se tolera sobre la latencia de referencia antes de bajar el limite */
+#define LIMITERTOLERANCE 1.5
+/* Peso de cada ventana en la latencia de referencia y en el nuevo limite */
+#define LIMITERLONGWEIGHT 0.05
+#define LIMITERSMOOTHING 0.2
+
+/********
+ * FUNCIÓN: int initialize_limiter(long maxLimit, long minLimit, int adaptive)
+ * ARGS_IN: long maxLimit - Numero maximo de conexiones a la vez (max_clients)
+ *          long minLimit - Limite minimo al que puede bajar el limite adaptativo
+ *          int adaptive - Si es 0 el limite es siempre maxLimit
+ * DESCRIPCIÓN: Inicializa el limite de conexiones simultaneas. En modo adaptativo el limite
+ *              empieza en maxLimit y se ajusta con la latencia de las peticiones: baja cuando
+ *              la latencia reciente supera la de referencia y sube mientras se mantiene
+ * ARGS_OUT: int - Devuelve 0 en caso de exito, -1 en caso de error
+ ********/
+int initialize_limiter(long maxLimit, long minLimit, int adaptive);
+
+/********
+ * FUNCIÓN: int limiter_acquire()
+ * DESCRIPCIÓN: Espera a que haya una plaza libre y la ocupa
+ * ARGS_OUT: int - Devuelve 0 en caso de exito, -1 si una señal interrumpe la espera (errno EINTR)
+ ********/
+int limiter_acquire();
+
+/********
+ * FUNCIÓN: int limiter_try_acquire()
+ * DESCRIPCIÓN: Ocupa una plaza si hay alguna libre, sin esperar
+ * ARGS_OUT: int - Devuelve 0 si se ha ocupado la plaza, -1 si no hay ninguna libre
+ ********/
+int limiter_try_acquire();
+
+/********
+ * FUNCIÓN: void limiter_release()
+ * DESCRIPCIÓN: Libera la plaza de una conexion que se ha cerrado. Si el limite ha bajado
+ *              por debajo de las conexiones abiertas, la plaza desaparece en vez de liberarse
+ ********/
+void limiter_release();
+
+/********
+ * FUNCIÓN: void limiter_wake()
+ * DESCRIPCIÓN: Despierta a un hilo bloqueado en limiter_acquire sin liberar ninguna plaza.
+ *              Solo se usa al terminar el servidor
+ ********/
+void limiter_wake();
+
+/********
+ * FUNCIÓN: void limiter_sample(long long latency)
+ * ARGS_IN: long long latency - Microsegundos desde el inicio de una peticion hasta su respuesta
+ * DESCRIPCIÓN: Añade la latencia de una peticion a la ventana actual y, al cerrarse la
+ *              ventana, recalcula el limite. No hace nada si el limite no es adaptativo
+ ********/
+void limiter_sample(long long latency);
+
+/********
+ * FUNCIÓN: long limiter_limit()
+ * DESCRIPCIÓN: Limite actual de conexiones simultaneas
+ * ARGS_OUT: long - El limite
+ ********/
+long limiter_limit();
+
+/********
+ * FUNCIÓN: long limiter_in_use()
+ * DESCRIPCIÓN: Conexiones que ocupan una plaza en este momento
+ * ARGS_OUT: long - Numero de conexiones
+ ********/
+long limiter_in_use();
+
+/********
+ * FUNCIÓN: long long limiter_now()
+ * DESCRIPCIÓN: Reloj monotono con el que se miden las latencias
+ * ARGS_OUT: long long - Microsegundos desde un instante arbitrario
+ ********/
+long long limiter_now();
+
+/********
+ * FUNCIÓN: void terminate_limiter()
+ * DESCRIPCIÓN: Libera los recursos del limite
+ ********/
+void terminate_limiter();
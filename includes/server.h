@@ -10,7 +10,20 @@
 
 #pragma once
 
-#include <semaphore.h>
+#include "../includes/confuse.h"
+
+/* Modos de funcionamiento del servidor */
+typedef enum ServerMode {
+  MODE_THREADS = 0, // cada conexion ocupa un hilo del pool durante toda su vida
+  MODE_EPOLL,       // reactor con epoll: los hilos solo atienden sockets listos
+  MODE_FIBERS       // cada conexion es una fibra: codigo bloqueante sobre unos pocos hilos con epoll
+} ServerMode;
+
+/* Backends de entrada/salida */
+typedef enum IOBackend {
+  IO_BLOCKING = 0, // una llamada al sistema por operacion (accept, recv, write, sendfile)
+  IO_URING         // io_uring: multishot accept, recv con buffers del kernel y send + splice enlazados
+} IOBackend;
 
 /* path de los ejecutables de python y php para los scripts */
 typedef struct ExecutableScripts {
@@ -31,11 +44,46 @@ typedef struct ConfigParameters {
   long int timeout;   // timeout para las conexiones con el cliente en segundos
   char *tmpDirectory; // path temporal para el output de los scripts
   ExecutableScripts exe_scripts; // path de los ejecutables de python y php
+  char *serverMode;   // modo leido del archivo de configuracion ("threads", "epoll" o "fibers")
+  ServerMode mode;    // modo de funcionamiento ya interpretado
+  cfg_bool_t reusePort;     // abrir varios listeners con SO_REUSEPORT, cada uno con su hilo
+  long int acceptorThreads; // numero de listeners/aceptadores con reusePort (0 = numero de CPUs)
+  char *ioBackendName;  // backend leido del archivo de configuracion ("blocking" o "uring")
+  IOBackend ioBackend;  // backend en uso, tras comprobar que el kernel lo soporta
+  long int listenBacklog; // longitud de la cola de conexiones pendientes (limitada a somaxconn)
+  long int deferAccept;   // segundos de TCP_DEFER_ACCEPT (0 = desactivado)
+  long int fastOpen;      // longitud de la cola de TCP_FASTOPEN (0 = desactivado)
+  char **listenAddresses;  // lista listen: direcciones en las que escuchar (vacia = listen_port)
+  long int numListenAddresses;
+  long int unixSocketMode; // permisos de los sockets "unix:" de la lista listen
+  cfg_bool_t cpuAffinity;  // atender cada conexion en un hilo fijado a la CPU que procesa sus paquetes
+  long int busyPoll;       // microsegundos de SO_BUSY_POLL de los sockets aceptados (0 = desactivado)
+  long int busyPollSpin;   // microsegundos que se reintenta recv sin bloquear antes de bloquearse (0 = no)
+  long int headerTimeout;    // segundos para recibir las cabeceras de una peticion (0 = sin limite)
+  long int bodyTimeout;      // segundos maximos entre dos lecturas del cuerpo (0 = sin limite)
+  long int keepAliveTimeout; // segundos que una conexion keep-alive espera la siguiente peticion (0 = sin limite)
+  long int requestTimeout;   // segundos totales de una peticion, de su primer byte a la respuesta (0 = sin limite)
+  cfg_bool_t overloadReject;   // con max_clients conexiones, responder 503 en vez de dejar esperar al resto
+  long int overloadRetryAfter; // segundos de la cabecera Retry-After del 503
+  cfg_bool_t adaptiveLimit;    // ajustar el limite de conexiones (como mucho max_clients) con la latencia
+  long int adaptiveMinClients; // limite minimo de conexiones con adaptive_limit
+  char *statusPath;            // path que devuelve el estado del servidor ("" = desactivado)
+  cfg_bool_t parkIdle;         // modo threads: esperar la siguiente peticion keep-alive en el event loop
+  long int poolMinThreads;     // hilos que cada pool mantiene siempre
+  long int poolMaxThreads;     // hilos maximos de cada pool (0 = sin limite)
+  long int poolIdleTimeout;    // segundos sin trabajo tras los que se retira un lote de hilos (0 = nunca)
+  long int poolPrewarmThreads; // hilos que cada pool crea al arrancar (como minimo poolMinThreads)
+  long int poolSpareThreads;   // hilos libres por debajo de los cuales el pool crece en segundo plano
+  long int poolGrowThreads;    // hilos que se añaden cada vez que el pool crece
+  cfg_bool_t numaPools;        // atender cada conexion en un pool fijado al nodo NUMA que procesa sus paquetes
+  char *poolCpus;              // CPUs a las que se fijan los hilos de los pools de los aceptadores ("" = todas)
+  long int scriptThreads;      // hilos del pool que ejecuta los scripts (0 = en el pool de cada conexion)
+  long int scriptQueueLimit;   // peticiones de script en su pool por encima de las que se responde 503 (0 = sin limite)
+  long int drainTimeout;       // segundos que se espera a que terminen las peticiones en curso al cerrar (0 = no se espera)
+  long int threadStackSize;    // KB de pila de los hilos de los pools (0 = el tamaño por defecto del sistema)
+  long int fiberThreads;       // modo fibers: hilos planificadores de las fibras (0 = uno por CPU)
 } ConfigParameters;
 
 /* Global variable containing information from the config file
  * Relevant to most files */
 extern ConfigParameters configParams;
-
-/* Semáforo para limitar el numero máximo de clientes */
-extern sem_t numConnections;
@@ -10,19 +10,132 @@
 
 #pragma once
 
+#include "../includes/uring_lib.h"
+
+#include <sys/socket.h>
+
+/* Backlog por defecto de listen() (configurable con listen_backlog) */
 #define LISTENMAXCONNECTIONS 128
+/* Numero maximo de conexiones aceptadas y entregadas al pool de una vez */
+#define ACCEPTBATCH 64
+
+/* Variable de entorno con el canal por el que un proceso nuevo recibe los sockets del anterior */
+#define UPGRADEENV "HTTPSERVER_UPGRADE_FD"
+/* Sockets enviados en cada mensaje SCM_RIGHTS */
+#define UPGRADEFDSPERMSG 64
+/* Milisegundos que se espera a que el proceso nuevo confirme que escucha */
+#define UPGRADETIMEOUT 10000
+
+/* Numero maximo de direcciones en la lista listen */
+#define LISTENMAXADDRESSES 64
+
+/* Direccion de escucha ya resuelta */
+typedef struct ListenAddress {
+  struct sockaddr_storage addr;
+  socklen_t addrLen;
+  int v6only; // IPV6_V6ONLY: hay tambien una direccion IPv4 en el mismo puerto
+} ListenAddress;
+
+/********
+ * FUNCIÓN: int resolve_listen_addresses(ListenAddress **addresses)
+ * ARGS_IN: ListenAddress **addresses - (output) Direcciones en las que escuchar. Se libera con free
+ * DESCRIPCIÓN: Resuelve la lista listen de la configuracion. Si esta vacia se escucha en
+ *              todas las interfaces IPv4 en listen_port, como siempre. Los sockets IPv6
+ *              solo son de doble pila si no hay una direccion IPv4 en su mismo puerto
+ * ARGS_OUT: int - Devuelve el numero de direcciones, -1 en caso de error
+ ********/
+int resolve_listen_addresses(ListenAddress **addresses);
+
+/********
+ * FUNCIÓN: int initiate_server(ListenAddress *addresses, int numAddresses, int *inheritedfds, int numInherited,
+ *                              int *serverfds, int numAcceptors)
+ * ARGS_IN: ListenAddress *addresses - Direcciones en las que escuchar
+ *          int numAddresses - Numero de direcciones
+ *          int *inheritedfds - (opcional) Sockets de escucha heredados (ver inherit_listeners)
+ *          int numInherited - Numero de sockets heredados
+ *          int *serverfds - (output) Descriptores de los sockets del servidor, con espacio para
+ *                           numAcceptors * (numAddresses + numInherited). Los del aceptador i
+ *                           son serverfds[i * n] ... serverfds[(i + 1) * n - 1], con n el valor devuelto
+ *          int numAcceptors - Numero de aceptadores. Si es mayor que 1 cada uno abre sus
+ *                             propios sockets en todas las direcciones usando SO_REUSEPORT.
+ *                             Los sockets AF_UNIX no lo admiten: todos comparten el mismo (dup)
+ * DESCRIPCIÓN: Crea los sockets del servidor (socket(), bind() y listen()). Las direcciones que
+ *              ya tienen un socket heredado lo reutilizan; los heredados que no corresponden a
+ *              ninguna direccion se añaden como direcciones extra, compartidas por todos
+ * ARGS_OUT: int - Devuelve el numero de sockets de cada aceptador, -1 en caso de error
+ ********/
+int initiate_server(ListenAddress *addresses, int numAddresses, int *inheritedfds, int numInherited, int *serverfds,
+                    int numAcceptors);
+
+/********
+ * FUNCIÓN: int inherit_listeners(int **inheritedfds)
+ * ARGS_IN: int **inheritedfds - (output) Sockets de escucha heredados. Se libera con free
+ * DESCRIPCIÓN: Recoge los sockets de escucha que deja un proceso anterior. Pueden venir del
+ *              propio servidor durante una actualizacion (por el canal indicado en la variable
+ *              de entorno UPGRADEENV, mediante SCM_RIGHTS) o de un supervisor como systemd
+ *              (activacion por socket: LISTEN_PID y LISTEN_FDS, a partir del descriptor 3)
+ * ARGS_OUT: int - Devuelve el numero de sockets heredados, -1 en caso de error
+ ********/
+int inherit_listeners(int **inheritedfds);
+
+/********
+ * FUNCIÓN: void listeners_ready()
+ * DESCRIPCIÓN: Avisa al proceso anterior (si lo hay) de que ya escuchamos en sus sockets,
+ *              para que deje de aceptar conexiones
+ ********/
+void listeners_ready();
+
+/********
+ * FUNCIÓN: int hand_over_listeners(int *serverfds, int numServerfds, char *argv[])
+ * ARGS_IN: int *serverfds - Sockets de escucha a entregar
+ *          int numServerfds - Numero de sockets
+ *          char *argv[] - Argumentos con los que se ejecuta el nuevo binario
+ * DESCRIPCIÓN: Ejecuta de nuevo el binario del servidor y le pasa los sockets de escucha por
+ *              un socketpair con SCM_RIGHTS. Las conexiones que esperan en la cola de los
+ *              sockets no se pierden, pues los sockets pasan a ser compartidos
+ * ARGS_OUT: int - Devuelve 0 cuando el nuevo proceso ya escucha, -1 en caso de error
+ ********/
+int hand_over_listeners(int *serverfds, int numServerfds, char *argv[]);
+
+/********
+ * FUNCIÓN: int accept_connections(int *sockvals, int numSockvals, URing *ring, int *connfds, int maxConns, int wait)
+ * ARGS_IN: int *sockvals - Sockets del servidor por los que se aceptan las conexiones
+ *          int numSockvals - Numero de sockets
+ *          URing *ring - (opcional) Ring del aceptador para usar el multishot accept de io_uring
+ *          int *connfds - (output) Descriptores de los sockets de los clientes aceptados
+ *          int maxConns - Numero maximo de conexiones a aceptar
+ *          int wait - Si es 0 solo se aceptan las conexiones que ya esten en la cola de los sockets
+ * DESCRIPCIÓN: Vacia la cola de conexiones pendientes de los sockets a rafagas con accept4, sin
+ *              ninguna llamada extra por conexion: las opciones de socket se heredan del socket
+ *              de escucha y SOCK_NONBLOCK (modo epoll) y SOCK_CLOEXEC se aplican en el propio accept4
+ * ARGS_OUT: int - Devuelve el numero de conexiones aceptadas, -1 en caso de error
+ ********/
+int accept_connections(int *sockvals, int numSockvals, URing *ring, int *connfds, int maxConns, int wait);
+
+/********
+ * FUNCIÓN: int incoming_cpu(int sockval)
+ * ARGS_IN: int sockval - Socket de un cliente ya aceptado
+ * DESCRIPCIÓN: Consulta con SO_INCOMING_CPU la CPU que ha procesado los paquetes de la conexion
+ * ARGS_OUT: int - Devuelve la CPU, -1 si el kernel no la conoce
+ ********/
+int incoming_cpu(int sockval);
 
 /********
- * FUNCIÓN: int initiate_server()
- * DESCRIPCIÓN: Devuelve el descriptor del socket del servidor (o EXIT_FAILURE en caso de error)
- * ARGS_OUT: int - Devuelve el descriptor del servidor en caso de éxito y -1 en caso contrario
+ * FUNCIÓN: void steer_listeners(int *sockvals, int numSockvals, int cpu)
+ * ARGS_IN: int *sockvals - Sockets de escucha de un aceptador
+ *          int numSockvals - Numero de sockets
+ *          int cpu - CPU en la que se ejecuta el aceptador
+ * DESCRIPCIÓN: Marca los sockets con SO_INCOMING_CPU para que, dentro de un grupo SO_REUSEPORT,
+ *              el kernel entregue a este aceptador las conexiones procesadas en su CPU
  ********/
-int initiate_server();
+void steer_listeners(int *sockvals, int numSockvals, int cpu);
 
 /********
- * FUNCIÓN: int establece_manejador(int signal, void (*handler))
- * ARGS_IN: int sockval - Socket del servidor por el que se acepta una conexión
- * DESCRIPCIÓN: Aceptar una nueva conexión de un cliente.
- * ARGS_OUT: int - Devuelve el descriptor del socket del cliente, -1 en caso de error
+ * FUNCIÓN: void reject_connection(int connfd, const char *response, int responseLen)
+ * ARGS_IN: int connfd - Socket de un cliente recien aceptado
+ *          const char *response - Respuesta ya formateada
+ *          int responseLen - Longitud de la respuesta
+ * DESCRIPCIÓN: Rechaza la conexion sin pasar por el pool: envia la respuesta con una sola
+ *              escritura no bloqueante y cierra
  ********/
-int accept_connection(int);
+void reject_connection(int connfd, const char *response, int responseLen);
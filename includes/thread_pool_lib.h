@@ -1,30 +1,183 @@
 #pragma once
 
+#include <stddef.h>
+
 /* Numero de threads en cada lote */
 #define THREADBATCHCOUNT 10
+/* Capacidad de la cola de trabajos de cada pool (potencia de 2) */
+#define THREADPOOLQUEUESIZE 1024
+/* Numero maximo de lotes de un pool, y palabras del bitmap de hilos dormidos */
+#define THREADPOOLMAXBATCHES 1024
+#define THREADPOOLMASKWORDS ((THREADPOOLMAXBATCHES * THREADBATCHCOUNT + 63) / 64)
+/* Capacidad de la cola local de continuaciones de cada hilo (potencia de 2) */
+#define THREADLOCALQUEUESIZE 64
+/* Milisegundos entre dos busquedas de lotes sin trabajo para retirarlos */
+#define THREADPOOLREAPERINTERVAL 1000
+/* Intervalos de los histogramas de tiempos: el intervalo i cuenta los tiempos de [2^(i-1), 2^i)
+ * microsegundos (el 0, los de menos de 1us; el ultimo, todos los de 2^(i-1)us o mas) */
+#define POOLSTATSBUCKETS 24
+
+/* Pool de hilos. Su contenido solo se conoce en thread_pool_lib.c */
+typedef struct ThreadPool ThreadPool;
+
+/* Limites y crecimiento de un pool (ver configure_pool) */
+typedef struct PoolSettings {
+  int minThreads;     // hilos que el pool mantiene siempre
+  int maxThreads;     // hilos maximos (0 = THREADPOOLMAXBATCHES lotes). Con todos ocupados, los
+                      // nuevos trabajos esperan en la cola a que termine alguno
+  int idleTimeout;    // segundos sin trabajo tras los que se retira un lote (0 = nunca)
+  int prewarmThreads; // hilos que se crean al configurar el pool (como minimo minThreads)
+  int spareThreads;   // con menos hilos libres, el pool crece en segundo plano
+  int growThreads;    // hilos que se crean cada vez que el pool crece
+} PoolSettings;
+
+/* Estadisticas de uno o varios pools (ver pool_stats). Los tiempos son en microsegundos */
+typedef struct PoolStats {
+  /* Estado actual */
+  long threads;     // hilos
+  long busyThreads; // hilos ejecutando un trabajo
+  long idleThreads; // hilos sin trabajo
+  long batches;     // lotes
+  long queuedJobs;  // trabajos encolados que ningun hilo ha cogido aun
+  /* Acumulados desde que se creo el pool */
+  long jobsStarted;    // trabajos que ha cogido un hilo
+  long jobsCompleted;  // trabajos terminados
+  long jobsStolen;     // trabajos robados de la cola local de otro hilo
+  long batchesCreated; // lotes creados (incluido el primero)
+  long batchesRetired; // lotes retirados por no tener trabajo
+  long waitTime;       // suma de los tiempos en cola (desde que se encola hasta que un hilo lo coge)
+  long runTime;        // suma de los tiempos de ejecucion
+  long waitHistogram[POOLSTATSBUCKETS]; // trabajos por tiempo en cola
+  long runHistogram[POOLSTATSBUCKETS];  // trabajos por tiempo de ejecucion
+} PoolStats;
 
 /********
- * FUNCIÓN: int initialize_pool(void *(*client_fun)(void *), void (*cleanup_fun)(void *))
+ * FUNCIÓN: ThreadPool *initialize_pool(void *(*client_fun)(void *), void (*cleanup_fun)(void *))
  * ARGS_IN: void *(*client_fun)(void *) - Funcion que recibe un parametro void *.
  *                                        Esta es la funcion que se llamará al añadir un trabajo
  *          void *(*cleanup_fun)(void *) - Funcion que recibe un parametro void *.
  *                                         Esta es la funcion que se llamará al destruir un hilo
- * DESCRIPCIÓN: Inicializa la pool de hilos, estableciendo a su vez las funciones del cliente y limpieza
+ * DESCRIPCIÓN: Crea e inicializa un pool de hilos, estableciendo a su vez las funciones del cliente y limpieza
+ * ARGS_OUT: ThreadPool * - Devuelve el pool en caso de exito, NULL en caso de error
+ ********/
+ThreadPool *initialize_pool(void *(*client_fun)(void *), void (*cleanup_fun)(void *));
+
+/********
+ * FUNCIÓN: ThreadPool *initialize_pool_on_cpu(void *(*client_fun)(void *), void (*cleanup_fun)(void *), int cpu)
+ * ARGS_IN: void *(*client_fun)(void *) - Funcion que se llamará al añadir un trabajo
+ *          void *(*cleanup_fun)(void *) - Funcion que se llamará al destruir un hilo
+ *          int cpu - CPU a la que se fijan todos los hilos del pool (-1 para no fijarlos)
+ * DESCRIPCIÓN: Igual que initialize_pool, pero los hilos (tambien los de los lotes que se
+ *              creen despues) solo se ejecutan en la CPU indicada
+ * ARGS_OUT: ThreadPool * - Devuelve el pool en caso de exito, NULL en caso de error
+ ********/
+ThreadPool *initialize_pool_on_cpu(void *(*client_fun)(void *), void (*cleanup_fun)(void *), int cpu);
+
+/********
+ * FUNCIÓN: ThreadPool *initialize_pool_on_cpus(void *(*client_fun)(void *), void (*cleanup_fun)(void *), const char *cpuList)
+ * ARGS_IN: void *(*client_fun)(void *) - Funcion que se llamará al añadir un trabajo
+ *          void *(*cleanup_fun)(void *) - Funcion que se llamará al destruir un hilo
+ *          const char *cpuList - CPUs a las que se fijan todos los hilos del pool, con el formato
+ *                                de sysfs ("0-3,8"). NULL o "" para no fijarlos
+ * DESCRIPCIÓN: Igual que initialize_pool, pero los hilos solo se ejecutan en las CPUs indicadas
+ *              (por ejemplo, las de un nodo NUMA). El pool, sus colas y sus lotes se reservan
+ *              e inicializan desde esas CPUs, asi que su memoria queda en el nodo de los hilos
+ * ARGS_OUT: ThreadPool * - Devuelve el pool en caso de exito, NULL en caso de error
+ ********/
+ThreadPool *initialize_pool_on_cpus(void *(*client_fun)(void *), void (*cleanup_fun)(void *), const char *cpuList);
+
+/********
+ * FUNCIÓN: void set_pool_stack_size(size_t stackSize)
+ * ARGS_IN: size_t stackSize - Bytes de pila de cada hilo (0 para usar el tamaño por defecto del sistema)
+ * DESCRIPCIÓN: Fija el tamaño de pila de los hilos de los pools que se creen desde este momento
+ *              (tambien de los lotes que se añadan despues). Se llama antes de crear los pools
+ ********/
+void set_pool_stack_size(size_t stackSize);
+
+/********
+ * FUNCIÓN: int configure_pool(ThreadPool *pool, PoolSettings *settings)
+ * ARGS_IN: ThreadPool *pool - Pool a configurar
+ *          PoolSettings *settings - Limites y crecimiento del pool
+ * DESCRIPCIÓN: Fija los limites del pool, redondeados a lotes de THREADBATCHCOUNT hilos, crea
+ *              los hilos de prewarmThreads y arranca el hilo de mantenimiento. Desde entonces
+ *              los lotes se crean en segundo plano antes de que se agoten los hilos libres,
+ *              y se retiran (del ultimo al primero, liberando sus pilas) tras idleTimeout.
+ *              Se llama una sola vez, justo despues de crear el pool
  * ARGS_OUT: int - Devuelve 0 en caso de exito, -1 en caso de error
  ********/
-int initialize_pool(void *(*client_fun)(void *), void (*cleanup_fun)(void *));
+int configure_pool(ThreadPool *pool, PoolSettings *settings);
+
+/********
+ * FUNCIÓN: int pool_size(ThreadPool *pool)
+ * ARGS_IN: ThreadPool *pool - Pool
+ * DESCRIPCIÓN: Numero de hilos del pool en este momento
+ * ARGS_OUT: int - Numero de hilos
+ ********/
+int pool_size(ThreadPool *pool);
+
+/********
+ * FUNCIÓN: long pool_threads()
+ * DESCRIPCIÓN: Numero de hilos de todos los pools en este momento
+ * ARGS_OUT: long - Numero de hilos
+ ********/
+long pool_threads();
 
 /********
- * FUNCIÓN: int add_job(void *info)
- * ARGS_IN: void *info - Puntero a la informacion que se quiere delegar al trabajo
+ * FUNCIÓN: void pool_stats(ThreadPool *pool, PoolStats *stats)
+ * ARGS_IN: ThreadPool *pool - Pool
+ *          PoolStats *stats - (output) Estadisticas a las que se suman las del pool
+ * DESCRIPCIÓN: Suma a stats las estadisticas del pool (se pone a 0 antes para obtener solo
+ *              las de este pool). Cada hilo cuenta las suyas sin compartirlas con nadie, y
+ *              aqui se juntan con las de los lotes ya retirados, asi que contarlas no añade
+ *              contencion a los hilos
+ ********/
+void pool_stats(ThreadPool *pool, PoolStats *stats);
+
+/********
+ * FUNCIÓN: void pools_stats(PoolStats *stats)
+ * ARGS_IN: PoolStats *stats - (output) Estadisticas a las que se suman las de todos los pools
+ * DESCRIPCIÓN: Suma a stats las estadisticas de todos los pools que existen en este momento
+ ********/
+void pools_stats(PoolStats *stats);
+
+/********
+ * FUNCIÓN: int add_job(ThreadPool *pool, void *info)
+ * ARGS_IN: ThreadPool *pool - Pool en el que se ejecuta el trabajo
+ *          void *info - Puntero a la informacion que se quiere delegar al trabajo
  *                       asignado en initialize_pool
- * DESCRIPCIÓN: Inicia un trabajo
- * ARGS_OUT: int - Devuelve el id trabajo (valor no negativo), -1 en caso de error
+ * DESCRIPCIÓN: Inicia un trabajo en O(1): reserva un hilo libre (o crea un lote si no
+ *              hay), encola el trabajo y despierta a un hilo solo si hay alguno dormido
+ * ARGS_OUT: int - Devuelve 0 en caso de exito, -1 en caso de error (errno EAGAIN si la cola esta llena)
+ ********/
+int add_job(ThreadPool *pool, void *info);
+
+/********
+ * FUNCIÓN: int add_jobs(ThreadPool *pool, void **infos, int numInfos)
+ * ARGS_IN: ThreadPool *pool - Pool en el que se ejecutan los trabajos
+ *          void **infos - Informacion de cada trabajo a iniciar
+ *          int numInfos - Numero de trabajos
+ * DESCRIPCIÓN: Inicia varios trabajos de una vez, despertando con una sola llamada
+ *              a los hilos necesarios
+ * ARGS_OUT: int - Devuelve el numero de trabajos iniciados (menor que numInfos en caso de error,
+ *                 con errno EAGAIN si la cola esta llena)
+ ********/
+int add_jobs(ThreadPool *pool, void **infos, int numInfos);
+
+/********
+ * FUNCIÓN: int add_local_job(ThreadPool *pool, void *info)
+ * ARGS_IN: ThreadPool *pool - Pool en el que se ejecuta el trabajo
+ *          void *info - Informacion del trabajo
+ * DESCRIPCIÓN: Encola una continuacion del trabajo actual en la cola local del hilo que llama,
+ *              que la ejecutara en cuanto termine (con sus datos aun en cache) salvo que antes
+ *              la robe otro hilo libre. No despierta a ningun hilo, asi que el trabajo actual
+ *              debe terminar justo despues. Fuera de un hilo del pool equivale a add_job
+ * ARGS_OUT: int - Devuelve 0 en caso de exito, -1 en caso de error (errno EAGAIN si la cola esta llena)
  ********/
-int add_job(void *info);
+int add_local_job(ThreadPool *pool, void *info);
 
 /********
- * FUNCIÓN: void terminate_pool()
+ * FUNCIÓN: void terminate_pool(ThreadPool *pool)
+ * ARGS_IN: ThreadPool *pool - Pool a destruir
  * DESCRIPCIÓN: Destruye todos los trabajos activos y libera la memoria
  ********/
-void terminate_pool();
+void terminate_pool(ThreadPool *pool);
@@ -0,0 +1,75 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                               *
+ *  timer_wheel_lib.h - Archivo .h para timer_wheel_lib.c        *
+ *                                                               *
+ *  Autores:                                                     *
+ *    - Bhavuk Sikka    (bhavuk.sikka@estudiante.uam.es)         *
+ *    - Samuel de Lucas (samuel.lucas@estudiante.uam.es)         *
+ *                                                               *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#pragma once
+
+/* Resolucion de los timers en milisegundos */
+#define TIMERWHEELTICK 100
+/* Niveles de la rueda y bits de cada nivel (64 ranuras): el ultimo nivel
+ * cubre 64^4 ticks (unos 19 dias con ticks de 100ms) */
+#define TIMERWHEELLEVELS 4
+#define TIMERWHEELBITS 6
+#define TIMERWHEELSLOTS (1 << TIMERWHEELBITS)
+
+/* Timer de la rueda. Se guarda dentro de la estructura a la que pertenece,
+ * de modo que armarlo o cancelarlo no reserva memoria */
+typedef struct TimerNode {
+  struct TimerNode *prev, *next; // lista de su ranura (next es NULL si no esta armado)
+  unsigned long long expires;    // tick en el que vence
+  void *data;                    // informacion para la funcion de vencimiento
+} TimerNode;
+
+/********
+ * FUNCIÓN: int initialize_timer_wheel(void (*expire_fun)(TimerNode *))
+ * ARGS_IN: void (*expire_fun)(TimerNode *) - Funcion que se llama con cada timer que vence.
+ *                                            Se llama con la rueda bloqueada, asi que no puede
+ *                                            armar ni cancelar timers y debe ser rapida
+ * DESCRIPCIÓN: Crea el hilo que hace avanzar la rueda cada TIMERWHEELTICK milisegundos
+ * ARGS_OUT: int - Devuelve 0 en caso de exito, -1 en caso de error
+ ********/
+int initialize_timer_wheel(void (*expire_fun)(TimerNode *));
+
+/********
+ * FUNCIÓN: long long timer_now()
+ * DESCRIPCIÓN: Reloj monotono usado por la rueda
+ * ARGS_OUT: long long - Milisegundos desde un instante arbitrario
+ ********/
+long long timer_now();
+
+/********
+ * FUNCIÓN: void timer_arm(TimerNode *timer, long long ms)
+ * ARGS_IN: TimerNode *timer - Timer a armar (si ya lo estaba se rearma)
+ *          long long ms - Milisegundos hasta el vencimiento
+ * DESCRIPCIÓN: Arma el timer en O(1): se inserta en la ranura de su nivel
+ ********/
+void timer_arm(TimerNode *timer, long long ms);
+
+/********
+ * FUNCIÓN: void timer_cancel(TimerNode *timer)
+ * ARGS_IN: TimerNode *timer - Timer a cancelar
+ * DESCRIPCIÓN: Desarma el timer en O(1). Al volver, su funcion de vencimiento no se esta
+ *              ejecutando ni se ejecutara. No hace nada si no estaba armado
+ ********/
+void timer_cancel(TimerNode *timer);
+
+/********
+ * FUNCIÓN: void timer_expire_matching(int (*match)(TimerNode *))
+ * ARGS_IN: int (*match)(TimerNode *) - Devuelve 1 para los timers que deben vencer ya. Se llama
+ *                                      con la rueda bloqueada, como la funcion de vencimiento
+ * DESCRIPCIÓN: Vence en este momento los timers armados que cumplen match, recorriendo todas
+ *              las ranuras. Es O(timers armados), para usos puntuales como el cierre del servidor
+ ********/
+void timer_expire_matching(int (*match)(TimerNode *));
+
+/********
+ * FUNCIÓN: void terminate_timer_wheel()
+ * DESCRIPCIÓN: Detiene el hilo de la rueda. Los timers que sigan armados no vencen
+ ********/
+void terminate_timer_wheel();
@@ -0,0 +1,51 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                               *
+ *  topology_lib.h - Archivo .h para topology_lib.c              *
+ *                                                               *
+ *  Autores:                                                     *
+ *    - Bhavuk Sikka    (bhavuk.sikka@estudiante.uam.es)         *
+ *    - Samuel de Lucas (samuel.lucas@estudiante.uam.es)         *
+ *                                                               *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#pragma once
+
+/* cpu_set_t requiere definir _GNU_SOURCE antes de incluir cualquier cabecera del sistema */
+#include <sched.h>
+
+/* Longitud maxima de una lista de CPUs */
+#define CPULISTLEN 1024
+
+/********
+ * FUNCIÓN: int parse_cpu_list(const char *cpuList, cpu_set_t *cpus)
+ * ARGS_IN: const char *cpuList - Lista de CPUs con el formato de sysfs y taskset ("0-3,8,10-11")
+ *          cpu_set_t *cpus - Conjunto que se rellena con las CPUs de la lista
+ * DESCRIPCIÓN: Interpreta una lista de CPUs. Requiere _GNU_SOURCE para cpu_set_t
+ * ARGS_OUT: int - Devuelve el numero de CPUs de la lista, -1 si la lista no es valida
+ ********/
+int parse_cpu_list(const char *cpuList, cpu_set_t *cpus);
+
+/********
+ * FUNCIÓN: int numa_num_nodes()
+ * DESCRIPCIÓN: Numero de nodos NUMA de la maquina (el mayor identificador mas uno)
+ * ARGS_OUT: int - Numero de nodos, 1 si el sistema no expone la topologia
+ ********/
+int numa_num_nodes();
+
+/********
+ * FUNCIÓN: int format_cpu_list(const cpu_set_t *cpus, char *cpuList, int len)
+ * ARGS_IN: const cpu_set_t *cpus - Conjunto de CPUs
+ *          char *cpuList - Buffer en el que se escribe la lista, con el formato de parse_cpu_list
+ *          int len - Tamaño del buffer (CPULISTLEN basta)
+ * DESCRIPCIÓN: Escribe un conjunto de CPUs como lista, agrupando las consecutivas en rangos
+ * ARGS_OUT: int - Devuelve 0 en caso de exito, -1 si la lista no cabe en el buffer
+ ********/
+int format_cpu_list(const cpu_set_t *cpus, char *cpuList, int len);
+
+/********
+ * FUNCIÓN: int numa_cpu_node(int cpu)
+ * ARGS_IN: int cpu - CPU
+ * DESCRIPCIÓN: Nodo NUMA al que pertenece una CPU
+ * ARGS_OUT: int - El nodo, o -1 si no se conoce
+ ********/
+int numa_cpu_node(int cpu);
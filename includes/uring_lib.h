@@ -0,0 +1,157 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                               *
+ *  uring_lib.h - Archivo .h para uring_lib.c                    *
+ *                                                               *
+ *  Autores:                                                     *
+ *    - Bhavuk Sikka    (bhavuk.sikka@estudiante.uam.es)         *
+ *    - Samuel de Lucas (samuel.lucas@estudiante.uam.es)         *
+ *                                                               *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#pragma once
+
+#include <linux/io_uring.h>
+#include <stddef.h>
+
+/* Entradas de la cola de envio de los rings de cada hilo */
+#define URINGTHREADENTRIES 64
+/* user_data de las peticiones de cancelacion de los multishot accept */
+#define URINGCANCELDATA (~0ULL)
+/* Tamaño que se pide para la tuberia usada por splice */
+#define URINGPIPESIZE (1024 * 1024)
+
+/* Ring de io_uring mapeado en memoria. Se usa mediante llamadas al sistema
+ * directas, sin liburing */
+typedef struct URing {
+  int ringfd;
+  /* Cola de envio (SQ) */
+  unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+  unsigned sqEntries;
+  unsigned sqLocalTail; // entradas preparadas por nosotros
+  unsigned sqFlushed;   // entradas ya entregadas al kernel
+  struct io_uring_sqe *sqes;
+  /* Cola de completado (CQ) */
+  unsigned *cqHead, *cqTail, *cqMask;
+  struct io_uring_cqe *cqes;
+  /* Memoria mapeada */
+  void *sqPtr, *cqPtr;
+  size_t sqSize, cqSize, sqesSize;
+  /* Multishot accept activo en este ring (un bit por socket de escucha) */
+  unsigned long long acceptArmed;
+  /* Se ha pedido cancelar los multishot accept: no se vuelven a armar */
+  int acceptStopped;
+} URing;
+
+/********
+ * FUNCIÓN: int uring_probe()
+ * DESCRIPCIÓN: Comprueba en tiempo de ejecucion si el kernel soporta io_uring y todas
+ *              las operaciones que usa el servidor (accept, recv, send, splice, poll,
+ *              timeout y provide buffers)
+ * ARGS_OUT: int - Devuelve 1 si el backend io_uring se puede usar, 0 en caso contrario
+ ********/
+int uring_probe();
+
+/********
+ * FUNCIÓN: int uring_init(URing *ring, unsigned entries)
+ * ARGS_IN: URing *ring - (output) Ring a inicializar
+ *          unsigned entries - Numero de entradas de la cola de envio
+ * DESCRIPCIÓN: Crea un ring de io_uring y mapea sus colas
+ * ARGS_OUT: int - Devuelve 0 en caso de exito, -1 en caso de error
+ ********/
+int uring_init(URing *ring, unsigned entries);
+
+/********
+ * FUNCIÓN: void uring_free(URing *ring)
+ * ARGS_IN: URing *ring - Ring a liberar
+ * DESCRIPCIÓN: Desmapea las colas y cierra el ring
+ ********/
+void uring_free(URing *ring);
+
+/********
+ * FUNCIÓN: struct io_uring_sqe *uring_get_sqe(URing *ring)
+ * ARGS_IN: URing *ring - Ring del que obtener la entrada
+ * DESCRIPCIÓN: Reserva una entrada de la cola de envio, ya inicializada a 0
+ * ARGS_OUT: struct io_uring_sqe * - La entrada, o NULL si la cola esta llena
+ ********/
+struct io_uring_sqe *uring_get_sqe(URing *ring);
+
+/********
+ * FUNCIÓN: int uring_submit(URing *ring, unsigned waitNr)
+ * ARGS_IN: URing *ring - Ring cuyas entradas se envian
+ *          unsigned waitNr - Numero de completados a esperar (0 para no esperar)
+ * DESCRIPCIÓN: Entrega al kernel las entradas preparadas con una sola llamada a io_uring_enter
+ * ARGS_OUT: int - Devuelve el numero de entradas enviadas, -1 en caso de error (errno)
+ ********/
+int uring_submit(URing *ring, unsigned waitNr);
+
+/********
+ * FUNCIÓN: int uring_wait_events(URing *ring, unsigned waitNr)
+ * ARGS_IN: URing *ring - Ring en el que esperar
+ *          unsigned waitNr - Numero de completados a esperar
+ * DESCRIPCIÓN: Espera completados sin tocar la cola de envio, de modo que otros hilos
+ *              pueden seguir enviando entradas (protegidas por su propio mutex)
+ * ARGS_OUT: int - Devuelve 0 en caso de exito, -1 en caso de error o señal (errno)
+ ********/
+int uring_wait_events(URing *ring, unsigned waitNr);
+
+/********
+ * FUNCIÓN: struct io_uring_cqe *uring_peek_cqe(URing *ring)
+ * ARGS_IN: URing *ring - Ring a consultar
+ * DESCRIPCIÓN: Devuelve el siguiente completado sin hacer ninguna llamada al sistema
+ * ARGS_OUT: struct io_uring_cqe * - El completado, o NULL si no hay ninguno
+ ********/
+struct io_uring_cqe *uring_peek_cqe(URing *ring);
+
+/********
+ * FUNCIÓN: struct io_uring_cqe *uring_wait_cqe(URing *ring)
+ * ARGS_IN: URing *ring - Ring a consultar
+ * DESCRIPCIÓN: Devuelve el siguiente completado, esperando en el kernel si no hay ninguno
+ * ARGS_OUT: struct io_uring_cqe * - El completado, o NULL en caso de error o señal (errno)
+ ********/
+struct io_uring_cqe *uring_wait_cqe(URing *ring);
+
+/********
+ * FUNCIÓN: void uring_cqe_seen(URing *ring)
+ * ARGS_IN: URing *ring - Ring del que se ha consumido un completado
+ * DESCRIPCIÓN: Marca como consumido el completado devuelto por uring_peek_cqe/uring_wait_cqe
+ ********/
+void uring_cqe_seen(URing *ring);
+
+/********
+ * FUNCIÓN: int uring_accept(URing *ring, int *sockvals, int numSockvals, int flags, int wait, int *index)
+ * ARGS_IN: URing *ring - Ring del hilo aceptador
+ *          int *sockvals - Sockets de escucha (como mucho 64)
+ *          int numSockvals - Numero de sockets
+ *          int flags - Flags de los sockets aceptados (SOCK_NONBLOCK, SOCK_CLOEXEC)
+ *          int wait - Si es 0 no se espera: solo se recogen conexiones ya aceptadas
+ *          int *index - (output) Posicion en sockvals del socket por el que ha llegado la conexion
+ * DESCRIPCIÓN: Acepta una conexion usando multishot accept: una sola peticion al kernel
+ *              devuelve todas las conexiones que van llegando, que se recogen de la
+ *              cola de completado sin llamadas al sistema mientras haya pendientes
+ * ARGS_OUT: int - Devuelve el descriptor del socket del cliente, -1 en caso de error
+ *                 (errno EAGAIN si no habia conexiones y wait es 0)
+ ********/
+int uring_accept(URing *ring, int *sockvals, int numSockvals, int flags, int wait, int *index);
+
+/********
+ * FUNCIÓN: void uring_cancel_accept(URing *ring)
+ * ARGS_IN: URing *ring - Ring del hilo aceptador
+ * DESCRIPCIÓN: Cancela los multishot accept del ring. Las conexiones que el kernel ya habia
+ *              aceptado se siguen recogiendo con uring_accept hasta que acceptArmed es 0,
+ *              momento en el que uring_accept devuelve -1 con errno ECANCELED
+ ********/
+void uring_cancel_accept(URing *ring);
+
+/********
+ * FUNCIÓN: int uring_send_response(int sockfd, char *sendBuffer, int sendBufferLen, int filefd, long fileLen)
+ * ARGS_IN: int sockfd - Socket (bloqueante) por el que enviar los datos
+ *          char *sendBuffer - Cabeceras a enviar
+ *          int sendBufferLen - Longitud de las cabeceras
+ *          int filefd - (opcional) Descriptor del archivo a enviar
+ *          long fileLen - Bytes del archivo a enviar
+ * DESCRIPCIÓN: Envia la respuesta con una cadena enlazada send + splice(archivo -> tuberia)
+ *              + splice(tuberia -> socket) en el ring del hilo, con una sola llamada a
+ *              io_uring_enter en lugar de setsockopt/write/sendfile/setsockopt
+ * ARGS_OUT: int - Devuelve -1 en caso de error, 0 en el resto de casos
+ ********/
+int uring_send_response(int sockfd, char *sendBuffer, int sendBufferLen, int filefd, long fileLen);
@@ -0,0 +1,79 @@
+import socket
+import sys
+import threading
+import time
+
+# Uso: python3 bench.py [puerto] [conexiones] [segundos] [path]
+# Cada conexion es keep-alive y manda peticiones GET una detras de otra.
+# Sirve para comparar backends (io_backend) y modos (server_mode) del servidor.
+SIZERCV = 65536
+
+
+def read_response(clientSocket, pending):
+    # Lee una respuesta completa (cabeceras + Content-Length bytes)
+    while b"\r\n\r\n" not in pending:
+        data = clientSocket.recv(SIZERCV)
+        if not data:
+            raise ConnectionError("connection closed")
+        pending += data
+    headers, body = pending.split(b"\r\n\r\n", 1)
+    length = 0
+    for line in headers.split(b"\r\n"):
+        if line.lower().startswith(b"content-length:"):
+            length = int(line.split(b":", 1)[1])
+    while len(body) < length:
+        data = clientSocket.recv(SIZERCV)
+        if not data:
+            raise ConnectionError("connection closed")
+        body += data
+    return body[length:]
+
+
+def client(serverAddress, message, deadline, latencies, errors):
+    try:
+        clientSocket = socket.create_connection(serverAddress)
+        pending = b""
+        while time.monotonic() < deadline:
+            start = time.monotonic()
+            clientSocket.sendall(message)
+            pending = read_response(clientSocket, pending)
+            latencies.append(time.monotonic() - start)
+        clientSocket.close()
+    except (OSError, ConnectionError):
+        errors.append(1)
+
+
+def run_bench(serverPort, numConnections, seconds, path):
+    # Devuelve las latencias ordenadas de todas las peticiones y el numero de errores
+    message = ("GET %s HTTP/1.1\r\nHost: localhost\r\n\r\n" % path).encode()
+    deadline = time.monotonic() + seconds
+    results = [[] for _ in range(numConnections)]
+    errors = []
+    threads = [threading.Thread(target=client, args=(("127.0.0.1", serverPort), message, deadline, results[i], errors))
+               for i in range(numConnections)]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    return sorted(latency for result in results for latency in result), len(errors)
+
+
+def print_results(latencies, errors, seconds):
+    print("Requests:   ", len(latencies))
+    print("Errors:     ", errors)
+    print("Req/s:      %.0f" % (len(latencies) / seconds))
+    print("p50 (ms):   %.3f" % (latencies[len(latencies) // 2] * 1000))
+    print("p99 (ms):   %.3f" % (latencies[int(len(latencies) * 0.99)] * 1000))
+
+
+if __name__ == "__main__":
+    serverPort = int(sys.argv[1]) if len(sys.argv) > 1 else 34567
+    numConnections = int(sys.argv[2]) if len(sys.argv) > 2 else 32
+    seconds = float(sys.argv[3]) if len(sys.argv) > 3 else 10
+    path = sys.argv[4] if len(sys.argv) > 4 else "/index.html"
+
+    latencies, errors = run_bench(serverPort, numConnections, seconds, path)
+    if not latencies:
+        print("No responses received. Errors:", errors)
+        sys.exit(1)
+    print_results(latencies, errors, seconds)
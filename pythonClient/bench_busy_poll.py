@@ -0,0 +1,61 @@
+import os
+import re
+import signal
+import subprocess
+import sys
+import tempfile
+import time
+
+from bench import print_results, run_bench
+
+# Uso: python3 bench_busy_poll.py <binario del servidor> <directorio con server.conf> [conexiones] [segundos]
+# Arranca el servidor con el recv bloqueante de siempre y despues con busy poll
+# (busy_poll + busy_poll_spin) y compara la latencia (p50/p99) de ambos.
+# Con pocas conexiones keep-alive se ve el coste de dormir y despertar al hilo en cada peticion.
+MODES = [
+    ("blocking recv", ""),
+    ("busy poll", "busy_poll = 50\nbusy_poll_spin = 200\n"),
+]
+
+
+def server_config(workDir, extra):
+    # Copia server.conf con server_root absoluto, para poder arrancar el servidor desde otro directorio
+    with open(os.path.join(workDir, "server.conf")) as f:
+        config = f.read()
+    match = re.search(r'^server_root\s*=\s*"([^"]*)"', config, re.M)
+    root = match.group(1) if match else "./www"
+    config += '\nserver_root = "%s"\n%s' % (os.path.join(os.path.abspath(workDir), root), extra)
+    return config
+
+
+def port_of(config):
+    match = re.findall(r'^listen_port\s*=\s*(\d+)', config, re.M)
+    return int(match[-1]) if match else 34567
+
+
+if __name__ == "__main__":
+    if len(sys.argv) < 3:
+        print("Uso: python3 bench_busy_poll.py <servidor> <directorio con server.conf> [conexiones] [segundos]")
+        sys.exit(1)
+    server = os.path.abspath(sys.argv[1])
+    workDir = sys.argv[2]
+    numConnections = int(sys.argv[3]) if len(sys.argv) > 3 else 1
+    seconds = float(sys.argv[4]) if len(sys.argv) > 4 else 10
+
+    for name, extra in MODES:
+        config = server_config(workDir, extra)
+        with tempfile.TemporaryDirectory() as runDir:
+            with open(os.path.join(runDir, "server.conf"), "w") as f:
+                f.write(config)
+            process = subprocess.Popen([server], cwd=runDir, stdout=subprocess.DEVNULL)
+            time.sleep(0.5)
+            try:
+                latencies, errors = run_bench(port_of(config), numConnections, seconds, "/index.html")
+            finally:
+                process.send_signal(signal.SIGINT)
+                process.wait()
+        print("==", name)
+        if latencies:
+            print_results(latencies, errors, seconds)
+        else:
+            print("No responses received. Errors:", errors)
@@ -8,38 +8,586 @@
  *                                                               *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#define _GNU_SOURCE
 #include "../includes/server.h"
 #include "../includes/client_conn_lib.h"
 #include "../includes/confuse.h"
+#include "../includes/event_loop_lib.h"
+#include "../includes/fiber_lib.h"
+#include "../includes/limiter_lib.h"
 #include "../includes/signal_lib.h"
 #include "../includes/socket_lib.h"
 #include "../includes/thread_pool_lib.h"
+#include "../includes/timer_wheel_lib.h"
+#include "../includes/topology_lib.h"
+#include "../includes/uring_lib.h"
 
+#include <errno.h>
+#include <limits.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/syslog.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 /* Variable para saber si hemos recibido una señal SIGINT (Ctrl-C) */
 static volatile u_int8_t got_sigint = 0x00;
 /* Manejador para la señal SIGINT */
 static void signal_int_handler() { got_sigint = 0x01; }
+/* Variable para saber si hemos recibido una señal SIGUSR2 (actualizar el binario) */
+static volatile u_int8_t got_sigusr2 = 0x00;
+/* Manejador para la señal SIGUSR2 */
+static void signal_usr2_handler() { got_sigusr2 = 0x01; }
+/* Manejador vacio para SIGUSR1, que solo interrumpe las llamadas bloqueantes de los aceptadores.
+ * Los pools tambien lo instalan, pero en modo fibers no hay pools */
+static void signal_usr1_handler() {}
+/* Variable que indica a los aceptadores que dejen de aceptar (los sockets ya son del proceso nuevo) */
+static volatile u_int8_t stopAccepting = 0x00;
 
 /* Parametros de configuracion leidos por otros archivos e inicializado en el main */
 ConfigParameters configParams;
 
-/* Semaphore to limit the max number of connections */
-sem_t numConnections;
+/* Informacion de cada hilo aceptador: sus sockets de escucha y su parte del pool */
+typedef struct Acceptor {
+  pthread_t thread;
+  int *serverfds;   // un socket por cada direccion de escucha
+  int numServerfds;
+  ThreadPool *pool;
+  URing ring; // ring para el multishot accept (backend io_uring)
+  int cpu;    // CPU a la que se fija el hilo (-1 sin fijar)
+} Acceptor;
+
+/* Respuesta 503 preformateada con la que se rechazan las conexiones que superan max_clients
+ * (opcion overload_reject) */
+static char overloadResponse[256];
+static int overloadResponseLen = 0;
+
+/* Pools con los hilos fijados a cada CPU (opcion cpu_affinity), indexados por numero de CPU.
+ * Las CPUs en las que no puede ejecutarse el proceso no tienen pool */
+static ThreadPool **cpuPools = NULL;
+static int numCpuPools = 0;
+/* Pools con los hilos fijados a las CPUs de cada nodo NUMA (opcion numa_pools), indexados por
+ * nodo, y nodo de cada CPU (-1 si el proceso no puede ejecutarse en ella) */
+static ThreadPool **nodePools = NULL;
+static int numNodePools = 0;
+static int *cpuNodes = NULL;
+static int numCpuNodes = 0;
+/* Pool que ejecuta los scripts (opcion script_threads) */
+static ThreadPool *scriptPool = NULL;
 
 /* Funciones privadas para leer el config */
 int read_config(cfg_t **cfg);
 void free_config(cfg_t *cfg);
 void do_daemon(void);
 
+/********
+ * FUNCIÓN: static ThreadPool *connection_pool(Acceptor *acceptor, int connfd)
+ * ARGS_IN: Acceptor *acceptor - Aceptador que ha aceptado la conexion
+ *          int connfd - Socket del cliente
+ * DESCRIPCIÓN: Elige el pool que atiende la conexion. Con cpu_affinity es el pool fijado a la
+ *              CPU que procesa sus paquetes, de modo que los buffers del socket y el estado de
+ *              la conexion siguen en la cache de esa CPU. Con numa_pools es el pool del nodo
+ *              NUMA de esa CPU, de modo que siguen al menos en la memoria de su nodo
+ * ARGS_OUT: ThreadPool * - Devuelve el pool elegido
+ ********/
+static ThreadPool *connection_pool(Acceptor *acceptor, int connfd) {
+  if (!cpuPools && !nodePools)
+    return acceptor->pool;
+  int cpu = incoming_cpu(connfd);
+  if (cpuPools && cpu >= 0 && cpu < numCpuPools && cpuPools[cpu])
+    return cpuPools[cpu];
+  if (nodePools && cpu >= 0 && cpu < numCpuNodes && cpuNodes[cpu] >= 0 && nodePools[cpuNodes[cpu]])
+    return nodePools[cpuNodes[cpu]];
+  return acceptor->pool;
+}
+
+/********
+ * FUNCIÓN: static int dispatch_connections(Acceptor *acceptor, int *connfds, int numConns)
+ * ARGS_IN: Acceptor *acceptor - Aceptador que ha aceptado las conexiones
+ *          int *connfds - Sockets de los clientes, cada uno con su plaza del limite de conexiones
+ *          int numConns - Numero de conexiones
+ * DESCRIPCIÓN: Crea la ClientConnection de cada conexion y entrega de una vez al pool todas
+ *              las que van al mismo pool (o las pasa al event loop en modo epoll, o crea una
+ *              fibra para cada una en modo fibers). Si la cola del pool esta llena (pool en
+ *              pool_max_threads), las que no caben se rechazan con un 503 (overload_reject) o se cierran
+ * ARGS_OUT: int - Devuelve 0 en caso de exito, -1 si el pool no puede crear mas hilos
+ ********/
+static int dispatch_connections(Acceptor *acceptor, int *connfds, int numConns) {
+  struct ClientConnection *jobs[ACCEPTBATCH];
+  int numJobs = 0, ret = 0;
+
+  for (int i = 0; i < numConns; i++) {
+    struct ClientConnection *cliConn;
+    cliConn = (struct ClientConnection *)connection_alloc(sizeof(struct ClientConnection));
+    if (!cliConn) {
+      syslog(LOG_ERR, "Error allocating memory for connection");
+      close(connfds[i]);
+      limiter_release();
+      continue;
+    }
+    // printf("Iniciada nueva conexion\n");
+    cliConn->connfd = connfds[i];
+    cliConn->closeVar = connfds[i];
+    cliConn->pool = connection_pool(acceptor, connfds[i]);
+    start_connection_timeouts(cliConn);
+    if (configParams.mode == MODE_EPOLL) {
+      // El hilo del pool solo se ocupara de la conexion cuando lleguen datos
+      if (event_loop_watch(cliConn, 0) == -1) {
+        free_thread_resources(&cliConn);
+        limiter_release();
+      }
+      continue;
+    }
+    if (configParams.mode == MODE_FIBERS) {
+      // Con cpu_affinity la fibra va al planificador de la CPU que procesa sus paquetes
+      if (fiber_spawn(manage_client, cliConn, configParams.cpuAffinity ? incoming_cpu(connfds[i]) : -1) == -1) {
+        syslog(LOG_ERR, "Error creating fiber for connection");
+        free_thread_resources(&cliConn);
+        limiter_release();
+      }
+      continue;
+    }
+    jobs[numJobs++] = cliConn;
+  }
+
+  // Agrupa las conexiones por pool y entrega cada grupo con una sola llamada
+  while (numJobs > 0) {
+    ThreadPool *pool = jobs[0]->pool;
+    void *group[ACCEPTBATCH];
+    int numGroup = 0, rest = 0;
+    for (int i = 0; i < numJobs; i++) {
+      if (jobs[i]->pool == pool)
+        group[numGroup++] = jobs[i];
+      else
+        jobs[rest++] = jobs[i];
+    }
+    numJobs = rest;
+
+    int added = add_jobs(pool, group, numGroup);
+    if (added < numGroup) {
+      int full = errno == EAGAIN;
+      if (full)
+        syslog(LOG_WARNING, "Pool queue full. Rejecting %d connections", numGroup - added);
+      else
+        syslog(LOG_ERR, "Error adding a job");
+      for (int i = added; i < numGroup; i++) {
+        int connfd = ((struct ClientConnection *)group[i])->connfd;
+        // Se responde despues de liberarla: la rueda de timers ya no puede tocar el socket
+        if (full)
+          ((struct ClientConnection *)group[i])->closeVar = -1;
+        free_thread_resources(&group[i]);
+        limiter_release();
+        if (full && configParams.overloadReject)
+          reject_connection(connfd, overloadResponse, overloadResponseLen);
+        else if (full)
+          close(connfd);
+      }
+      // Con la cola llena el aceptador sigue: se libera en cuanto terminen conexiones
+      if (!full)
+        ret = -1;
+    }
+  }
+  return ret;
+}
+
+/********
+ * FUNCIÓN: static void configure_stack_size()
+ * DESCRIPCIÓN: Fija la pila de los hilos de los pools (thread_stack_size). Si no llega a la que
+ *              puede necesitar manage_client con esta configuracion (client_stack_size), se sube
+ *              a esa y se avisa. Deja en thread_stack_size los KB que se usan de verdad
+ ********/
+static void configure_stack_size() {
+  size_t stackSize = configParams.threadStackSize * 1024;
+
+  if (configParams.threadStackSize <= 0) {
+    // Pila por defecto del sistema (RLIMIT_STACK): solo se anota para el status
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_getstacksize(&attr, &stackSize);
+    pthread_attr_destroy(&attr);
+    configParams.threadStackSize = stackSize / 1024;
+    set_pool_stack_size(0);
+    return;
+  }
+
+  size_t needed = client_stack_size();
+  if (needed < (size_t)PTHREAD_STACK_MIN)
+    needed = PTHREAD_STACK_MIN;
+  if (stackSize < needed) {
+    syslog(LOG_WARNING, "thread_stack_size %ldKB is below the %zuKB a worker may need, using %zuKB", configParams.threadStackSize,
+           (needed + 1023) / 1024, (needed + 1023) / 1024);
+    stackSize = needed;
+  }
+  size_t pageSize = sysconf(_SC_PAGESIZE);
+  stackSize = (stackSize + pageSize - 1) / pageSize * pageSize;
+  configParams.threadStackSize = stackSize / 1024;
+  set_pool_stack_size(stackSize);
+}
+
+/********
+ * FUNCIÓN: static ThreadPool *create_pool(const char *cpuList)
+ * ARGS_IN: const char *cpuList - CPUs a las que se fijan los hilos del pool ("" para no fijarlos)
+ * DESCRIPCIÓN: Crea un pool que atiende conexiones, con los limites y el crecimiento de la configuracion
+ * ARGS_OUT: ThreadPool * - Devuelve el pool en caso de exito, NULL en caso de error
+ ********/
+static ThreadPool *create_pool(const char *cpuList) {
+  PoolSettings settings = {configParams.poolMinThreads,     configParams.poolMaxThreads,   configParams.poolIdleTimeout,
+                           configParams.poolPrewarmThreads, configParams.poolSpareThreads, configParams.poolGrowThreads};
+  ThreadPool *pool = initialize_pool_on_cpus(manage_client, free_thread_resources, cpuList);
+  if (pool && configure_pool(pool, &settings) == -1) {
+    terminate_pool(pool);
+    return NULL;
+  }
+  return pool;
+}
+
+/********
+ * FUNCIÓN: static int create_script_pool()
+ * DESCRIPCIÓN: Crea el pool de tamaño fijo (script_threads) en el que se ejecutan los scripts,
+ *              separado de los pools que atienden los archivos estaticos
+ * ARGS_OUT: int - Devuelve 0 en caso de exito, -1 en caso de error
+ ********/
+static int create_script_pool() {
+  // Tamaño fijo: ni crece ni retira hilos
+  PoolSettings settings = {configParams.scriptThreads, configParams.scriptThreads, 0, configParams.scriptThreads, 0, 0};
+  scriptPool = initialize_pool_on_cpus(manage_client, free_thread_resources, configParams.poolCpus);
+  if (!scriptPool)
+    return -1;
+  if (configure_pool(scriptPool, &settings) == -1) {
+    terminate_pool(scriptPool);
+    scriptPool = NULL;
+    return -1;
+  }
+  set_script_pool(scriptPool);
+  return 0;
+}
+
+/********
+ * FUNCIÓN: static void terminate_script_pool()
+ * DESCRIPCIÓN: Deja de pasar peticiones al pool de scripts y lo destruye. Se llama antes de
+ *              destruir los demas pools, a los que devuelve las conexiones
+ ********/
+static void terminate_script_pool() {
+  if (!scriptPool)
+    return;
+  set_script_pool(NULL);
+  terminate_pool(scriptPool);
+  scriptPool = NULL;
+}
+
+/********
+ * FUNCIÓN: static int create_cpu_pools()
+ * DESCRIPCIÓN: Crea un pool con los hilos fijados a cada CPU en la que puede ejecutarse el proceso
+ * ARGS_OUT: int - Devuelve 0 en caso de exito, -1 en caso de error
+ ********/
+static int create_cpu_pools() {
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+    return -1;
+
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &allowed))
+      numCpuPools = cpu + 1;
+  }
+  cpuPools = (ThreadPool **)calloc(numCpuPools, sizeof(ThreadPool *));
+  if (!cpuPools)
+    return -1;
+  for (int cpu = 0; cpu < numCpuPools; cpu++) {
+    if (!CPU_ISSET(cpu, &allowed))
+      continue;
+    char cpuList[16];
+    snprintf(cpuList, sizeof(cpuList), "%d", cpu);
+    cpuPools[cpu] = create_pool(cpuList);
+    if (!cpuPools[cpu])
+      return -1;
+  }
+  return 0;
+}
+
+/********
+ * FUNCIÓN: static void terminate_cpu_pools()
+ * DESCRIPCIÓN: Destruye los pools creados con create_cpu_pools
+ ********/
+static void terminate_cpu_pools() {
+  for (int cpu = 0; cpu < numCpuPools; cpu++) {
+    if (cpuPools[cpu])
+      terminate_pool(cpuPools[cpu]);
+  }
+  free(cpuPools);
+  cpuPools = NULL;
+  numCpuPools = 0;
+}
+
+/********
+ * FUNCIÓN: static int create_node_pools()
+ * DESCRIPCIÓN: Crea un pool con los hilos fijados a las CPUs de cada nodo NUMA en las que puede
+ *              ejecutarse el proceso, y apunta el nodo de cada CPU para elegir pool
+ * ARGS_OUT: int - Devuelve 0 en caso de exito, -1 en caso de error
+ ********/
+static int create_node_pools() {
+  cpu_set_t allowed;
+  char cpuList[CPULISTLEN];
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1)
+    return -1;
+
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &allowed))
+      numCpuNodes = cpu + 1;
+  }
+  numNodePools = numa_num_nodes();
+  cpuNodes = (int *)malloc(numCpuNodes * sizeof(int));
+  nodePools = (ThreadPool **)calloc(numNodePools, sizeof(ThreadPool *));
+  if (!cpuNodes || !nodePools)
+    return -1;
+  for (int cpu = 0; cpu < numCpuNodes; cpu++) {
+    cpuNodes[cpu] = CPU_ISSET(cpu, &allowed) ? numa_cpu_node(cpu) : -1;
+    if (cpuNodes[cpu] >= numNodePools)
+      cpuNodes[cpu] = -1;
+  }
+
+  for (int node = 0; node < numNodePools; node++) {
+    cpu_set_t nodeCpus;
+    CPU_ZERO(&nodeCpus);
+    for (int cpu = 0; cpu < numCpuNodes; cpu++) {
+      if (cpuNodes[cpu] == node)
+        CPU_SET(cpu, &nodeCpus);
+    }
+    if (CPU_COUNT(&nodeCpus) == 0)
+      continue;
+    if (format_cpu_list(&nodeCpus, cpuList, sizeof(cpuList)) == -1)
+      return -1;
+    nodePools[node] = create_pool(cpuList);
+    if (!nodePools[node])
+      return -1;
+    syslog(LOG_INFO, "NUMA node %d pool on CPUs %s", node, cpuList);
+  }
+  return 0;
+}
+
+/********
+ * FUNCIÓN: static void terminate_node_pools()
+ * DESCRIPCIÓN: Destruye los pools creados con create_node_pools
+ ********/
+static void terminate_node_pools() {
+  for (int node = 0; nodePools && node < numNodePools; node++) {
+    if (nodePools[node])
+      terminate_pool(nodePools[node]);
+  }
+  free(nodePools);
+  free(cpuNodes);
+  nodePools = NULL;
+  cpuNodes = NULL;
+  numNodePools = numCpuNodes = 0;
+}
+
+/********
+ * FUNCIÓN: static void assign_acceptor_cpus(Acceptor *acceptors, int numAcceptors)
+ * ARGS_IN: Acceptor *acceptors - Aceptadores
+ *          int numAcceptors - Numero de aceptadores
+ * DESCRIPCIÓN: Con varios aceptadores (SO_REUSEPORT), reparte las CPUs permitidas entre ellos y
+ *              marca sus sockets con SO_INCOMING_CPU, para que cada uno acepte las conexiones
+ *              procesadas en su CPU. Con un solo aceptador no se fija
+ ********/
+static void assign_acceptor_cpus(Acceptor *acceptors, int numAcceptors) {
+  cpu_set_t allowed;
+  int cpu = -1;
+
+  for (int i = 0; i < numAcceptors; i++)
+    acceptors[i].cpu = -1;
+  if (numAcceptors < 2 || sched_getaffinity(0, sizeof(allowed), &allowed) == -1 || CPU_COUNT(&allowed) == 0)
+    return;
+  for (int i = 0; i < numAcceptors; i++) {
+    do {
+      cpu = (cpu + 1) % CPU_SETSIZE;
+    } while (!CPU_ISSET(cpu, &allowed));
+    acceptors[i].cpu = cpu;
+    steer_listeners(acceptors[i].serverfds, acceptors[i].numServerfds, cpu);
+  }
+}
+
+/********
+ * FUNCIÓN: static int admit_connections(int *connfds, int numConns)
+ * ARGS_IN: int *connfds - Sockets de clientes ya aceptados
+ *          int numConns - Numero de conexiones
+ * DESCRIPCIÓN: Coge una plaza del limite de conexiones para cada conexion mientras queden. Las que
+ *              se quedan sin plaza se rechazan con un 503 (overload_reject) o se cierran
+ * ARGS_OUT: int - Devuelve el numero de conexiones admitidas, que quedan al principio de connfds
+ ********/
+static int admit_connections(int *connfds, int numConns) {
+  int permits = 0;
+  while (permits < numConns && limiter_try_acquire() == 0)
+    permits++;
+  for (int i = permits; i < numConns; i++) {
+    if (configParams.overloadReject)
+      reject_connection(connfds[i], overloadResponse, overloadResponseLen);
+    else
+      close(connfds[i]);
+  }
+  return permits;
+}
+
+/********
+ * FUNCIÓN: static void stop_uring_acceptor(Acceptor *acceptor)
+ * ARGS_IN: Acceptor *acceptor - Aceptador con backend io_uring
+ * DESCRIPCIÓN: Cancela los multishot accept del aceptador y atiende las conexiones que
+ *              el kernel ya habia aceptado, para no perderlas al entregar los sockets
+ ********/
+static void stop_uring_acceptor(Acceptor *acceptor) {
+  int connfds[ACCEPTBATCH];
+
+  uring_cancel_accept(&acceptor->ring);
+  while (acceptor->ring.acceptArmed) {
+    int numConns = accept_connections(acceptor->serverfds, acceptor->numServerfds, &acceptor->ring, connfds, ACCEPTBATCH, 1);
+    int permits = numConns > 0 ? admit_connections(connfds, numConns) : 0;
+    if (permits > 0)
+      dispatch_connections(acceptor, connfds, permits);
+  }
+}
+
+/********
+ * FUNCIÓN: static void *accept_loop(void *args)
+ * ARGS_IN: void *args - Puntero al Acceptor con el socket y el pool a usar
+ * DESCRIPCIÓN: Acepta conexiones de los sockets del aceptador y las entrega a su pool
+ *              hasta que se recibe SIGINT o se entregan los sockets a un proceso nuevo.
+ *              Tras esperar la primera conexion, vacia a rafagas la cola de los sockets
+ *              (tantas como permita el limite de conexiones) y entrega todas al pool de una vez.
+ *              Con overload_reject no se espera a tener plaza: se acepta siempre y las
+ *              conexiones que no caben se rechazan al momento con un 503
+ * ARGS_OUT: void * - No devuelve informacion util. NULL
+ ********/
+static void *accept_loop(void *args) {
+  Acceptor *acceptor = (Acceptor *)args;
+  URing *ring = configParams.ioBackend == IO_URING ? &acceptor->ring : NULL;
+  int connfds[ACCEPTBATCH];
+
+  while (got_sigint == 0x00 && stopAccepting == 0x00) {
+    if (configParams.overloadReject) {
+      int numConns = accept_connections(acceptor->serverfds, acceptor->numServerfds, ring, connfds, ACCEPTBATCH, 1);
+      if (got_sigint == 0x01) {
+        for (int i = 0; i < numConns; i++)
+          close(connfds[i]);
+        break;
+      }
+      if (numConns <= 0)
+        continue;
+      numConns = admit_connections(connfds, numConns);
+      if (numConns > 0 && dispatch_connections(acceptor, connfds, numConns) == -1)
+        break;
+      continue;
+    }
+
+    if (limiter_acquire() == -1) {
+      if (errno == EINTR)
+        continue;
+      break;
+    }
+    int numConns = accept_connections(acceptor->serverfds, acceptor->numServerfds, ring, connfds, 1, 1);
+    if (got_sigint == 0x01) {
+      if (numConns > 0)
+        close(connfds[0]);
+      // La plaza se devuelve: el cierre ordenado espera a que no quede ninguna ocupada
+      limiter_release();
+      break;
+    }
+    if (numConns <= 0) {
+      limiter_release();
+      continue;
+    }
+
+    // Solo se cogen mas plazas una vez llega una conexion, para no dejar sin ellas a otros aceptadores
+    int permits = 1;
+    while (permits < ACCEPTBATCH && limiter_try_acquire() == 0)
+      permits++;
+    if (permits > 1) {
+      int more = accept_connections(acceptor->serverfds, acceptor->numServerfds, ring, connfds + 1, permits - 1, 0);
+      numConns += more > 0 ? more : 0;
+    }
+    for (int i = numConns; i < permits; i++)
+      limiter_release();
+
+    if (dispatch_connections(acceptor, connfds, numConns) == -1)
+      break;
+  }
+
+  if (ring && stopAccepting == 0x01)
+    stop_uring_acceptor(acceptor);
+  return NULL;
+}
+
+/********
+ * FUNCIÓN: static void join_acceptor(Acceptor *acceptor)
+ * ARGS_IN: Acceptor *acceptor - Aceptador a esperar
+ * DESCRIPCIÓN: Despierta al aceptador (bloqueado en poll, accept o limiter_acquire) con SIGUSR1
+ *              hasta que termina. Se repite porque la señal puede llegar justo antes de
+ *              que se bloquee
+ ********/
+static void join_acceptor(Acceptor *acceptor) {
+  struct timespec deadline;
+  do {
+    pthread_kill(acceptor->thread, SIGUSR1);
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += 100 * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+  } while (pthread_timedjoin_np(acceptor->thread, NULL, &deadline) == ETIMEDOUT);
+}
+
+/********
+ * FUNCIÓN: static void drain_connections()
+ * DESCRIPCIÓN: Cierre ordenado, una vez que no se aceptan conexiones (al terminar o tras
+ *              entregar los sockets de escucha a un proceso nuevo): cierra las conexiones
+ *              keep-alive que esperan, deja terminar las peticiones en curso (que responden
+ *              con "Connection: close") y espera como mucho drain_timeout segundos a que
+ *              se cierren todas. Un SIGINT corta la espera
+ ********/
+static void drain_connections() {
+  time_t deadline = time(NULL) + configParams.drainTimeout;
+  struct timespec step = {0, 100 * 1000000};
+  sigset_t intMask;
+
+  if (configParams.drainTimeout <= 0 || limiter_in_use() == 0)
+    return;
+  syslog(LOG_INFO, "Draining %ld open connections", limiter_in_use());
+  drain_clients();
+
+  // SIGINT esta bloqueado en este hilo: se recoge aqui sin manejador
+  sigemptyset(&intMask);
+  sigaddset(&intMask, SIGINT);
+  while (limiter_in_use() > 0 && time(NULL) < deadline) {
+    if (sigtimedwait(&intMask, NULL, &step) == SIGINT) {
+      syslog(LOG_INFO, "Got SIGINT. Stop draining");
+      break;
+    }
+  }
+  if (limiter_in_use() > 0)
+    syslog(LOG_WARNING, "%ld connections still open after draining", limiter_in_use());
+}
+
+/********
+ * FUNCIÓN: static void terminate_acceptors(Acceptor *acceptors, int numAcceptors)
+ * ARGS_IN: Acceptor *acceptors - Aceptadores a liberar
+ *          int numAcceptors - Numero de aceptadores
+ * DESCRIPCIÓN: Cierra los sockets de escucha y destruye el pool de cada aceptador
+ ********/
+static void terminate_acceptors(Acceptor *acceptors, int numAcceptors) {
+  for (int i = 0; i < numAcceptors; i++) {
+    if (acceptors[i].pool)
+      terminate_pool(acceptors[i].pool);
+    uring_free(&acceptors[i].ring);
+    for (int j = 0; j < acceptors[i].numServerfds; j++)
+      close(acceptors[i].serverfds[j]);
+  }
+  free(acceptors);
+}
+
 /********
  * FUNCIÓN: int main(int argc, char *argv[])
  * ARGS_IN: int argc - numero de argumentos pasados por parametros
@@ -49,7 +597,8 @@ void do_daemon(void);
  * ARGS_OUT: int - devuelve 0 en caso de éxito y -1 en caso contrario
  ********/
 int main(int argc, char *argv[]) {
-  int serverfd, connfd;
+  int numAcceptors = 1;
+  Acceptor *acceptors;
   syslog(LOG_INFO, "Initiating new server.");
 
   if (argc > 1) {
@@ -63,55 +612,234 @@ int main(int argc, char *argv[]) {
   if (read_config(&cfg) != 0)
     return -1;
 
-  if (sem_init(&numConnections, 0, configParams.maxClients) == -1){
-    perror("sem_init");
+  configure_stack_size();
+  if (initialize_limiter(configParams.maxClients, configParams.adaptiveMinClients, configParams.adaptiveLimit) == -1) {
+    free_config(cfg);
+    return -1;
+  }
+
+  if (configParams.reusePort) {
+    numAcceptors = configParams.acceptorThreads > 0 ? configParams.acceptorThreads : sysconf(_SC_NPROCESSORS_ONLN);
+    if (numAcceptors < 1)
+      numAcceptors = 1;
+  }
+  acceptors = (Acceptor *)calloc(numAcceptors, sizeof(Acceptor));
+  if (!acceptors) {
+    terminate_limiter();
     free_config(cfg);
     return -1;
   }
 
   establece_manejador(SIGINT, signal_int_handler);
+  establece_manejador(SIGUSR2, signal_usr2_handler);
+  establece_manejador(SIGUSR1, signal_usr1_handler);
   establece_manejador(SIGPIPE, NULL);
+  /* SIGINT y SIGUSR2 se bloquean mientras se crean los hilos para que solo los reciba este hilo */
+  establece_manejador(SIGINT, NULL);
+  establece_manejador(SIGUSR2, NULL);
+
+  ListenAddress *addresses;
+  int numAddresses = resolve_listen_addresses(&addresses);
+  if (numAddresses < 0) {
+    printf("Error en la lista listen\n");
+    free(acceptors);
+    terminate_limiter();
+    free_config(cfg);
+    return -1;
+  }
+
+  /* Sockets heredados de una actualizacion (SIGUSR2) o de systemd */
+  int *inheritedfds;
+  int numInherited = inherit_listeners(&inheritedfds);
+
   /* Contiene las llamadas a socket(), bind() y listen() */
-  serverfd = initiate_server();
-  if (serverfd < 0) {
+  int serverfds[numAcceptors * (numAddresses + numInherited)];
+  int perAcceptor = initiate_server(addresses, numAddresses, inheritedfds, numInherited, serverfds, numAcceptors);
+  free(addresses);
+  free(inheritedfds);
+  if (perAcceptor < 0) {
     printf("Error iniciando servidor\n");
-    sem_destroy(&numConnections);
+    free(acceptors);
+    terminate_limiter();
     free_config(cfg);
     return -1;
   }
   printf("Iniciando servidor\n");
 
-  if (initialize_pool(manage_client, free_thread_resources) == -1) {
-    close(serverfd);
-    sem_destroy(&numConnections);
+  for (int i = 0; i < numAcceptors; i++) {
+    acceptors[i].serverfds = serverfds + i * perAcceptor;
+    acceptors[i].numServerfds = perAcceptor;
+  }
+  // En modo fibers los aceptadores no tienen pool: las conexiones van a los planificadores de fibras
+  for (int i = 0; i < numAcceptors; i++) {
+    int failed = 0;
+    if (configParams.mode != MODE_FIBERS && !(acceptors[i].pool = create_pool(configParams.poolCpus)))
+      failed = 1;
+    if (!failed && configParams.ioBackend == IO_URING && uring_init(&acceptors[i].ring, URINGTHREADENTRIES) == -1) {
+      syslog(LOG_ERR, "Error creating io_uring ring for acceptor");
+      failed = 1;
+    }
+    if (failed) {
+      terminate_acceptors(acceptors, numAcceptors);
+      terminate_limiter();
+      free_config(cfg);
+      return -1;
+    }
+  }
+
+  if (configParams.mode == MODE_FIBERS) {
+    if (initialize_fibers(configParams.fiberThreads, configParams.cpuAffinity, configParams.threadStackSize * 1024,
+                          free_thread_resources) == -1) {
+      syslog(LOG_ERR, "Error creating fiber schedulers");
+      terminate_acceptors(acceptors, numAcceptors);
+      terminate_limiter();
+      free_config(cfg);
+      return -1;
+    }
+  } else if (configParams.cpuAffinity) {
+    if (create_cpu_pools() == -1) {
+      syslog(LOG_ERR, "Error creating per-CPU pools");
+      terminate_cpu_pools();
+      terminate_acceptors(acceptors, numAcceptors);
+      terminate_limiter();
+      free_config(cfg);
+      return -1;
+    }
+  } else if (configParams.numaPools && create_node_pools() == -1) {
+    syslog(LOG_ERR, "Error creating per-node pools");
+    terminate_node_pools();
+    terminate_acceptors(acceptors, numAcceptors);
+    terminate_limiter();
     free_config(cfg);
     return -1;
   }
+  if (configParams.cpuAffinity || configParams.numaPools)
+    assign_acceptor_cpus(acceptors, numAcceptors);
 
-  while(got_sigint == 0x00) {
-    if (sem_wait(&numConnections) == -1) break;
-    connfd = accept_connection(serverfd);
-    if (got_sigint == 0x01) break;
-    
-    struct ClientConnection *cliConn;
-    cliConn = (struct ClientConnection *)calloc(1, sizeof(struct ClientConnection));
-    if (!cliConn) {
-      syslog(LOG_ERR, "Error allocating memory. Exiting");
-      close(serverfd);
-      break;
+  if (configParams.scriptThreads > 0 && create_script_pool() == -1) {
+    syslog(LOG_ERR, "Error creating script pool");
+    terminate_fibers();
+    terminate_cpu_pools();
+    terminate_node_pools();
+    terminate_acceptors(acceptors, numAcceptors);
+    terminate_limiter();
+    free_config(cfg);
+    return -1;
+  }
+
+  // En modo threads el event loop solo recibe las conexiones keep-alive aparcadas (park_idle).
+  // En modo fibers cada planificador espera en su propio epoll
+  if ((configParams.mode == MODE_EPOLL || (configParams.mode == MODE_THREADS && configParams.parkIdle)) &&
+      initialize_event_loop() == -1) {
+    terminate_script_pool();
+    terminate_fibers();
+    terminate_cpu_pools();
+    terminate_node_pools();
+    terminate_acceptors(acceptors, numAcceptors);
+    terminate_limiter();
+    free_config(cfg);
+    return -1;
+  }
+
+  if (configParams.overloadReject) {
+    overloadResponseLen = snprintf(overloadResponse, sizeof(overloadResponse),
+                                   "HTTP/1.1 503 Service Unavailable\r\nServer: %s\r\nRetry-After: %ld\r\n"
+                                   "Content-Length: 0\r\nConnection: close\r\n\r\n",
+                                   configParams.serverSignature, configParams.overloadRetryAfter);
+    if (overloadResponseLen >= (int)sizeof(overloadResponse))
+      overloadResponseLen = sizeof(overloadResponse) - 1;
+  }
+
+  /* Timeouts de cabeceras, cuerpo, keep-alive y peticion de todas las conexiones */
+  if (initialize_timer_wheel(connection_timed_out) == -1) {
+    stop_event_loop();
+    terminate_script_pool();
+    terminate_fibers();
+    terminate_cpu_pools();
+    terminate_node_pools();
+    terminate_acceptors(acceptors, numAcceptors);
+    terminate_event_loop();
+    terminate_limiter();
+    free_config(cfg);
+    return -1;
+  }
+
+  int created = 0;
+  for (; created < numAcceptors; created++) {
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if ((configParams.cpuAffinity || configParams.numaPools) && acceptors[created].cpu >= 0) {
+      cpu_set_t cpuset;
+      CPU_ZERO(&cpuset);
+      CPU_SET(acceptors[created].cpu, &cpuset);
+      pthread_attr_setaffinity_np(&attr, sizeof(cpuset), &cpuset);
     }
-    // printf("Iniciada nueva conexion\n");
-    cliConn->connfd = connfd;
-    if (add_job((void *)cliConn) == -1) {
-      syslog(LOG_ERR, "Error adding a job");
+    int ret = pthread_create(&acceptors[created].thread, &attr, accept_loop, &acceptors[created]);
+    pthread_attr_destroy(&attr);
+    if (ret) {
+      syslog(LOG_ERR, "Error creating acceptor thread");
+      got_sigint = 0x01;
       break;
     }
   }
+  syslog(LOG_INFO, "Started %d acceptor threads", created);
+  /* Si venimos de una actualizacion, el proceso anterior ya puede dejar de aceptar */
+  if (created == numAcceptors)
+    listeners_ready();
+
+  /* Esperamos a SIGINT o SIGUSR2 sin perder la señal si llega antes de suspendernos */
+  sigset_t waitMask;
+  pthread_sigmask(SIG_SETMASK, NULL, &waitMask);
+  sigdelset(&waitMask, SIGINT);
+  sigdelset(&waitMask, SIGUSR2);
+  int upgraded = 0;
+  while (got_sigint == 0x00) {
+    sigsuspend(&waitMask);
+    if (got_sigusr2 == 0x01) {
+      got_sigusr2 = 0x00;
+      syslog(LOG_INFO, "Got SIGUSR2. Handing listeners over to a new process");
+      if (hand_over_listeners(serverfds, numAcceptors * perAcceptor, argv) == 0) {
+        upgraded = 1;
+        break;
+      }
+      syslog(LOG_ERR, "Upgrade failed. Keep serving");
+    }
+  }
+
+  if (upgraded) {
+    // Los sockets de escucha los comparte el proceso nuevo: no se puede hacer shutdown
+    stopAccepting = 0x01;
+  } else {
+    for (int i = 0; i < created; i++) {
+      for (int j = 0; j < acceptors[i].numServerfds; j++)
+        shutdown(acceptors[i].serverfds[j], SHUT_RDWR);
+      limiter_wake();
+    }
+  }
+  // Despierta a cada aceptador, este bloqueado en poll(), accept() o limiter_acquire()
+  for (int i = 0; i < created; i++)
+    join_acceptor(&acceptors[i]);
+
+  if (upgraded) {
+    for (int i = 0; i < numAcceptors; i++) {
+      for (int j = 0; j < acceptors[i].numServerfds; j++)
+        close(acceptors[i].serverfds[j]);
+      acceptors[i].numServerfds = 0;
+    }
+    syslog(LOG_INFO, "Listeners handed over");
+  }
+  drain_connections();
   syslog(LOG_INFO, "Got signal. Terminating");
 
-  terminate_pool();
-  sem_destroy(&numConnections);
-  close(serverfd);
+  stop_event_loop();
+  terminate_script_pool();
+  terminate_fibers();
+  terminate_cpu_pools();
+  terminate_node_pools();
+  terminate_acceptors(acceptors, numAcceptors);
+  terminate_event_loop();
+  terminate_timer_wheel();
+  terminate_limiter();
   free_config(cfg);
 
   return 0;
@@ -135,11 +863,39 @@ int read_config(cfg_t **cfg) {
                       // opciones nuevas que hemos añadido
                       CFG_SIMPLE_STR("base_file", &configParams.baseFile), CFG_SIMPLE_INT("recv_buffer_length", &configParams.recvBufferLen),
                       CFG_SIMPLE_INT("timeout", &configParams.timeout), CFG_SIMPLE_STR("exe_python", &configParams.exe_scripts.python),
-                      CFG_SIMPLE_STR("exe_php", &configParams.exe_scripts.php),
+                      CFG_SIMPLE_STR("exe_php", &configParams.exe_scripts.php), CFG_SIMPLE_STR("server_mode", &configParams.serverMode),
+                      CFG_SIMPLE_BOOL("reuseport", &configParams.reusePort), CFG_SIMPLE_INT("acceptor_threads", &configParams.acceptorThreads),
+                      CFG_SIMPLE_STR("io_backend", &configParams.ioBackendName), CFG_STR_LIST("listen", "{}", CFGF_NONE),
+                      CFG_SIMPLE_INT("unix_socket_mode", &configParams.unixSocketMode), CFG_SIMPLE_INT("listen_backlog", &configParams.listenBacklog),
+                      CFG_SIMPLE_INT("defer_accept", &configParams.deferAccept), CFG_SIMPLE_INT("tcp_fastopen", &configParams.fastOpen),
+                      CFG_SIMPLE_BOOL("cpu_affinity", &configParams.cpuAffinity), CFG_SIMPLE_INT("busy_poll", &configParams.busyPoll),
+                      CFG_SIMPLE_INT("busy_poll_spin", &configParams.busyPollSpin), CFG_SIMPLE_INT("header_timeout", &configParams.headerTimeout),
+                      CFG_SIMPLE_INT("body_timeout", &configParams.bodyTimeout), CFG_SIMPLE_INT("keepalive_timeout", &configParams.keepAliveTimeout),
+                      CFG_SIMPLE_INT("request_timeout", &configParams.requestTimeout),
+                      CFG_SIMPLE_BOOL("overload_reject", &configParams.overloadReject),
+                      CFG_SIMPLE_INT("overload_retry_after", &configParams.overloadRetryAfter),
+                      CFG_SIMPLE_BOOL("adaptive_limit", &configParams.adaptiveLimit),
+                      CFG_SIMPLE_INT("adaptive_min_clients", &configParams.adaptiveMinClients),
+                      CFG_SIMPLE_STR("status_path", &configParams.statusPath),
+                      CFG_SIMPLE_BOOL("park_idle", &configParams.parkIdle),
+                      CFG_SIMPLE_INT("pool_min_threads", &configParams.poolMinThreads),
+                      CFG_SIMPLE_INT("pool_max_threads", &configParams.poolMaxThreads),
+                      CFG_SIMPLE_INT("pool_idle_timeout", &configParams.poolIdleTimeout),
+                      CFG_SIMPLE_INT("pool_prewarm_threads", &configParams.poolPrewarmThreads),
+                      CFG_SIMPLE_INT("pool_spare_threads", &configParams.poolSpareThreads),
+                      CFG_SIMPLE_INT("pool_grow_threads", &configParams.poolGrowThreads),
+                      CFG_SIMPLE_BOOL("numa_pools", &configParams.numaPools),
+                      CFG_SIMPLE_STR("pool_cpus", &configParams.poolCpus),
+                      CFG_SIMPLE_INT("script_threads", &configParams.scriptThreads),
+                      CFG_SIMPLE_INT("script_queue_limit", &configParams.scriptQueueLimit),
+                      CFG_SIMPLE_INT("drain_timeout", &configParams.drainTimeout),
+                      CFG_SIMPLE_INT("thread_stack_size", &configParams.threadStackSize),
+                      CFG_SIMPLE_INT("fiber_threads", &configParams.fiberThreads),
 
                       CFG_END()};
 
-  sprintf(tmpDir, "/tmp/httpserver_%ld/", time(NULL));
+  // El pid lo separa del directorio del proceso anterior tras una actualizacion (SIGUSR2)
+  sprintf(tmpDir, "/tmp/httpserver_%ld_%d/", time(NULL), getpid());
 
   strcpy(mkDir, "mkdir ");
   strcat(mkDir, tmpDir);
@@ -159,12 +915,87 @@ int read_config(cfg_t **cfg) {
   configParams.tmpDirectory = strdup(tmpDir);
   configParams.exe_scripts.python = strdup("/usr/bin/python");
   configParams.exe_scripts.php = strdup("/usr/bin/php");
+  configParams.serverMode = strdup("threads");
+  configParams.reusePort = cfg_false;
+  configParams.acceptorThreads = 0; // un aceptador por CPU
+  configParams.ioBackendName = strdup("blocking");
+  configParams.listenBacklog = LISTENMAXCONNECTIONS;
+  configParams.deferAccept = 0;
+  configParams.fastOpen = 0;
+  configParams.unixSocketMode = 0660;
+  configParams.cpuAffinity = cfg_false;
+  configParams.busyPoll = 0;
+  configParams.busyPollSpin = 0;
+  configParams.headerTimeout = -1; // -1: el valor de timeout
+  configParams.bodyTimeout = -1;
+  configParams.keepAliveTimeout = -1;
+  configParams.requestTimeout = 0;
+  configParams.overloadReject = cfg_false;
+  configParams.overloadRetryAfter = 1;
+  configParams.adaptiveLimit = cfg_false;
+  configParams.adaptiveMinClients = 4;
+  configParams.statusPath = strdup("");
+  configParams.parkIdle = cfg_false;
+  configParams.poolMinThreads = THREADBATCHCOUNT;
+  configParams.poolMaxThreads = 0;
+  configParams.poolIdleTimeout = 60;
+  configParams.poolPrewarmThreads = 0;
+  configParams.poolSpareThreads = THREADBATCHCOUNT / 2;
+  configParams.poolGrowThreads = THREADBATCHCOUNT;
+  configParams.numaPools = cfg_false;
+  configParams.poolCpus = strdup("");
+  configParams.scriptThreads = 0;
+  configParams.scriptQueueLimit = 0;
+  configParams.drainTimeout = 30;
+  configParams.threadStackSize = 256;
+  configParams.fiberThreads = 0;
 
   *cfg = cfg_init(opts, 0);
   if (cfg_parse(*cfg, "server.conf") != CFG_SUCCESS) {
     syslog(LOG_ERR, "No se pudo leer el archivo de configuración");
     return -1;
   }
+
+  // Los timeouts que no aparecen en el archivo toman el valor de timeout
+  if (configParams.headerTimeout < 0)
+    configParams.headerTimeout = configParams.timeout;
+  if (configParams.bodyTimeout < 0)
+    configParams.bodyTimeout = configParams.timeout;
+  if (configParams.keepAliveTimeout < 0)
+    configParams.keepAliveTimeout = configParams.timeout;
+
+  // Copiamos la lista listen para poder usarla igual que el resto de parametros
+  configParams.numListenAddresses = cfg_size(*cfg, "listen");
+  if (configParams.numListenAddresses > 0) {
+    configParams.listenAddresses = (char **)calloc(configParams.numListenAddresses, sizeof(char *));
+    if (!configParams.listenAddresses)
+      return -1;
+    for (int i = 0; i < configParams.numListenAddresses; i++)
+      configParams.listenAddresses[i] = strdup(cfg_getnstr(*cfg, "listen", i));
+  }
+
+  if (strcmp(configParams.serverMode, "threads") == 0) {
+    configParams.mode = MODE_THREADS;
+  } else if (strcmp(configParams.serverMode, "epoll") == 0) {
+    configParams.mode = MODE_EPOLL;
+  } else if (strcmp(configParams.serverMode, "fibers") == 0) {
+    configParams.mode = MODE_FIBERS;
+  } else {
+    syslog(LOG_ERR, "Modo de servidor desconocido: %s", configParams.serverMode);
+    return -1;
+  }
+
+  if (strcmp(configParams.ioBackendName, "blocking") == 0) {
+    configParams.ioBackend = IO_BLOCKING;
+  } else if (strcmp(configParams.ioBackendName, "uring") == 0) {
+    // Si el kernel no soporta io_uring (o alguna de sus operaciones) se usa el backend de siempre
+    configParams.ioBackend = uring_probe() ? IO_URING : IO_BLOCKING;
+    if (configParams.ioBackend != IO_URING)
+      syslog(LOG_NOTICE, "io_uring not available. Falling back to blocking backend");
+  } else {
+    syslog(LOG_ERR, "Backend de entrada/salida desconocido: %s", configParams.ioBackendName);
+    return -1;
+  }
   return 0;
 }
 
@@ -191,6 +1022,18 @@ void free_config(cfg_t *cfg) {
     free(configParams.exe_scripts.python);
   if (configParams.exe_scripts.php)
     free(configParams.exe_scripts.php);
+  if (configParams.serverMode)
+    free(configParams.serverMode);
+  if (configParams.ioBackendName)
+    free(configParams.ioBackendName);
+  if (configParams.statusPath)
+    free(configParams.statusPath);
+  if (configParams.poolCpus)
+    free(configParams.poolCpus);
+  for (int i = 0; i < configParams.numListenAddresses; i++)
+    free(configParams.listenAddresses[i]);
+  if (configParams.listenAddresses)
+    free(configParams.listenAddresses);
 }
 
 /********
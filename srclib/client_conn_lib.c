@@ -11,15 +11,22 @@
 
 #include "../includes/client_conn_lib.h"
 #include "../includes/client_process_functions.h"
+#include "../includes/event_loop_lib.h"
+#include "../includes/fiber_lib.h"
+#include "../includes/limiter_lib.h"
 #include "../includes/picohttpparser.h"
 #include "../includes/server.h"
+#include "../includes/socket_lib.h"
+#include "../includes/thread_pool_lib.h"
 
+#include <errno.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
@@ -30,14 +37,181 @@
 /* Calcula el minimo */
 #define min(a, b) (a < b) ? a : b
 
+/* Pool de los scripts (opcion script_threads) y peticiones que estan en el, esperando o ejecutandose */
+static struct ThreadPool *scriptPool = NULL;
+static long scriptLoad = 0;
+/* Cierre ordenado en curso (drain_clients) */
+static volatile u_int8_t drainingClients = 0x00;
+
+/* Buffers de una peticion: la respuesta y la peticion parseada (con sus MAXNUMHEADERS cabeceras).
+ * Un hilo solo los tiene mientras procesa lo recibido, no mientras espera datos, asi que no
+ * ocupan la pila de cada hilo y hay tantos como peticiones procesandose a la vez */
+typedef struct RequestBuffers {
+  char sendBuffer[RESPONSE_LEN];
+  RequestContent request;
+  struct RequestBuffers *next; // siguiente de la lista de libres
+} RequestBuffers;
+/* Buffers libres para reutilizar (como mucho REQUESTBUFFERSCACHE) y buffers reservados en total */
+static RequestBuffers *freeBuffers = NULL;
+static long numFreeBuffers = 0, numBuffers = 0;
+static pthread_mutex_t buffersMutex = PTHREAD_MUTEX_INITIALIZER;
+/* Conexiones abiertas y memoria que ocupan (connection_alloc) */
+static long numConnections = 0, connectionBytes = 0;
+
+/********
+ * FUNCIÓN: static RequestBuffers *get_request_buffers()
+ * DESCRIPCIÓN: Toma unos buffers de peticion libres o, si no hay, reserva otros
+ * ARGS_OUT: RequestBuffers * - Los buffers, NULL en caso de error
+ ********/
+static RequestBuffers *get_request_buffers() {
+  pthread_mutex_lock(&buffersMutex);
+  RequestBuffers *buffers = freeBuffers;
+  if (buffers) {
+    freeBuffers = buffers->next;
+    numFreeBuffers--;
+  }
+  pthread_mutex_unlock(&buffersMutex);
+  if (!buffers && (buffers = (RequestBuffers *)malloc(sizeof(RequestBuffers))))
+    __atomic_add_fetch(&numBuffers, 1, __ATOMIC_RELAXED);
+  return buffers;
+}
+
+/********
+ * FUNCIÓN: static void put_request_buffers(RequestBuffers *buffers)
+ * ARGS_IN: RequestBuffers *buffers - Buffers que ya no se usan
+ * DESCRIPCIÓN: Devuelve los buffers a la lista de libres, o los libera si ya hay REQUESTBUFFERSCACHE
+ ********/
+static void put_request_buffers(RequestBuffers *buffers) {
+  pthread_mutex_lock(&buffersMutex);
+  if (numFreeBuffers < REQUESTBUFFERSCACHE) {
+    buffers->next = freeBuffers;
+    freeBuffers = buffers;
+    numFreeBuffers++;
+    buffers = NULL;
+  }
+  pthread_mutex_unlock(&buffersMutex);
+  if (buffers) {
+    free(buffers);
+    __atomic_sub_fetch(&numBuffers, 1, __ATOMIC_RELAXED);
+  }
+}
+
+/********
+ * FUNCIÓN: void *connection_alloc(size_t size)
+ * ARGS_IN: size_t size - Bytes a reservar
+ * DESCRIPCIÓN: Reserva (a 0) memoria de una conexion y la suma a la memoria de las conexiones
+ * ARGS_OUT: void * - La memoria reservada, NULL en caso de error
+ ********/
+void *connection_alloc(size_t size) {
+  void *ptr = calloc(size, 1);
+  if (ptr)
+    __atomic_add_fetch(&connectionBytes, size, __ATOMIC_RELAXED);
+  return ptr;
+}
+
+/********
+ * FUNCIÓN: void connection_free(void *ptr, size_t size)
+ * ARGS_IN: void *ptr - Memoria reservada con connection_alloc (puede ser NULL)
+ *          size_t size - Bytes con los que se reservo
+ * DESCRIPCIÓN: Libera memoria de una conexion y la resta de la memoria de las conexiones
+ ********/
+void connection_free(void *ptr, size_t size) {
+  if (!ptr)
+    return;
+  free(ptr);
+  __atomic_sub_fetch(&connectionBytes, size, __ATOMIC_RELAXED);
+}
+
+/********
+ * FUNCIÓN: void connection_memory(ConnectionMemory *memory)
+ * ARGS_IN: ConnectionMemory *memory - (output) Memoria de las conexiones en este momento
+ * DESCRIPCIÓN: Informa de la memoria que ocupan las conexiones abiertas y los buffers de peticion.
+ *              La pila de los hilos no se cuenta: es thread_stack_size por hilo
+ ********/
+void connection_memory(ConnectionMemory *memory) {
+  memory->connections = __atomic_load_n(&numConnections, __ATOMIC_RELAXED);
+  memory->connectionBytes = __atomic_load_n(&connectionBytes, __ATOMIC_RELAXED);
+  pthread_mutex_lock(&buffersMutex);
+  memory->requestBuffers = __atomic_load_n(&numBuffers, __ATOMIC_RELAXED);
+  memory->requestBuffersInUse = memory->requestBuffers - numFreeBuffers;
+  pthread_mutex_unlock(&buffersMutex);
+  memory->requestBufferBytes = sizeof(RequestBuffers);
+}
+
+/********
+ * FUNCIÓN: size_t client_stack_size()
+ * DESCRIPCIÓN: Pila que necesita como minimo un hilo que ejecuta manage_client: CLIENTSTACKFRAME
+ *              mas la url y el archivo de la peticion, que estan en la pila y cuya longitud
+ *              depende de recv_buffer_length, base_file y root_path
+ * ARGS_OUT: size_t - Bytes de pila
+ ********/
+size_t client_stack_size() {
+  // La ruta de la peticion nunca es mayor que el buffer de recepcion
+  size_t pathLen = configParams.recvBufferLen;
+  return CLIENTSTACKFRAME + (pathLen + 1) + (pathLen + 1 + strlen(configParams.baseFile) + strlen(configParams.rootPath));
+}
+
+/********
+ * FUNCIÓN: void set_script_pool(struct ThreadPool *pool)
+ * ARGS_IN: struct ThreadPool *pool - Pool que ejecuta los scripts (NULL para ejecutarlos en el
+ *                                    pool de cada conexion)
+ * DESCRIPCIÓN: Separa las peticiones de script (GET con argumentos y POST) de las de archivos
+ *              estaticos: tras parsearlas pasan a este pool, de tamaño fijo, y al responder la
+ *              conexion vuelve a su pool. Los scripts lentos no ocupan los hilos de los estaticos
+ ********/
+void set_script_pool(struct ThreadPool *pool) { __atomic_store_n(&scriptPool, pool, __ATOMIC_RELEASE); }
+
+/********
+ * FUNCIÓN: static int enter_script_lane(ClientConnection *cliConn, RequestContent *request, char *sendBuffer)
+ * ARGS_IN: ClientConnection *cliConn - Conexion con una peticion de script ya parseada
+ *          RequestContent *request - Peticion, que sigue al principio del buffer de recepcion
+ *          char *sendBuffer - Buffer donde poder almacenar la respuesta de error
+ * DESCRIPCIÓN: Pasa la conexion al pool de scripts, que vuelve a parsear la peticion y la
+ *              atiende. Con script_queue_limit peticiones de script en el pool, responde un 503
+ * ARGS_OUT: int - Devuelve 1 si la conexion ha pasado al pool de scripts, 0 si se ha respondido
+ *                 con un 503 y -1 en caso de error
+ ********/
+static int enter_script_lane(ClientConnection *cliConn, RequestContent *request, char *sendBuffer) {
+  ThreadPool *pool = __atomic_load_n(&scriptPool, __ATOMIC_ACQUIRE);
+  long load = __atomic_add_fetch(&scriptLoad, 1, __ATOMIC_RELAXED);
+
+  if (!pool || (configParams.scriptQueueLimit > 0 && load > configParams.scriptQueueLimit)) {
+    __atomic_sub_fetch(&scriptLoad, 1, __ATOMIC_RELAXED);
+    return process_error(request, sendBuffer, cliConn, SERVICE_UNAVAILABLE);
+  }
+  cliConn->scriptLane = 0x01;
+  cliConn->readyLen = request->totalLen;
+  if (add_job(pool, cliConn) == -1) {
+    syslog(LOG_ERR, "Error adding a job to the script pool");
+    cliConn->scriptLane = 0x00;
+    cliConn->readyLen = 0;
+    __atomic_sub_fetch(&scriptLoad, 1, __ATOMIC_RELAXED);
+    return -1;
+  }
+  return 1;
+}
+
+/********
+ * FUNCIÓN: static int use_script_lane(ClientConnection *cliConn)
+ * ARGS_IN: ClientConnection *cliConn - Conexion con una peticion de script
+ * DESCRIPCIÓN: Indica si la peticion debe pasar al pool de scripts: hay pool de scripts y no
+ *              se esta atendiendo ya en el
+ * ARGS_OUT: int - 1 si debe pasar al pool de scripts, 0 si no
+ ********/
+static int use_script_lane(ClientConnection *cliConn) {
+  return __atomic_load_n(&scriptPool, __ATOMIC_ACQUIRE) && !cliConn->scriptLane;
+}
+
 /********
  * FUNCIÓN: static int create_and_send_response(ClientConnection *cliConn, RequestContent *request, char *sendBuffer)
  * ARGS_IN: ClientConnection *cliConn - Estructura conteniendo información sobre la conexión
  *          RequestContent *request - Estructura que contiene informacion de la request actual
  *          char *sendBuffer - Buffer donde poder almacenar la respuesta
  * DESCRIPCIÓN: Funcion que llama a la función correspondiente
- *              en funcion del método que contenga la request.
- * ARGS_OUT: int - devuelve 0 en caso de éxito y -1 en caso contrario
+ *              en funcion del método que contenga la request. Las peticiones de script
+ *              pasan antes al pool de scripts, si lo hay.
+ * ARGS_OUT: int - devuelve 0 en caso de éxito, 1 si la conexion ha pasado al pool de
+ *                 scripts y -1 en caso contrario
  ********/
 static int create_and_send_response(ClientConnection *cliConn, RequestContent *request, char *sendBuffer) {
   char *method = request->method;
@@ -45,20 +219,30 @@ static int create_and_send_response(ClientConnection *cliConn, RequestContent *r
   int minorVersion = request->minorVersion;
 
   if (minorVersion != 0 && minorVersion != 1)
-    return process_error(request, sendBuffer, cliConn->connfd, HTTP_VER_NOT_SUPP);
+    return process_error(request, sendBuffer, cliConn, HTTP_VER_NOT_SUPP);
 
   /* OPTIONS only supported in 1.1 */
   if (minorVersion == 1 && strncmp(method, "OPTIONS", min(methodLen, 7)) == 0)
-    return process_OPTIONS(request, sendBuffer, cliConn->connfd);
+    return process_OPTIONS(request, sendBuffer, cliConn);
 
-  else if (strncmp(method, "GET", min(methodLen, 3)) == 0)
-    return process_GET(request, sendBuffer, cliConn->connfd, &cliConn->fcloseVar);
-  else if (strncmp(method, "POST", min(methodLen, 4)) == 0)
-    return process_POST(request, sendBuffer, cliConn->connfd, &cliConn->fcloseVar);
+  else if (strncmp(method, "GET", min(methodLen, 3)) == 0) {
+    if (configParams.statusPath[0] && request->pathLen == strlen(configParams.statusPath) &&
+        strncmp(request->path, configParams.statusPath, request->pathLen) == 0)
+      return process_status(request, sendBuffer, cliConn);
+    // Con argumentos se ejecuta el script
+    if (memchr(request->path, '?', request->pathLen) && use_script_lane(cliConn))
+      return enter_script_lane(cliConn, request, sendBuffer);
+    return process_GET(request, sendBuffer, cliConn);
+  }
+  else if (strncmp(method, "POST", min(methodLen, 4)) == 0) {
+    if (use_script_lane(cliConn))
+      return enter_script_lane(cliConn, request, sendBuffer);
+    return process_POST(request, sendBuffer, cliConn);
+  }
   else if (strncmp(method, "HEAD", min(methodLen, 4)) == 0)
-    return process_HEAD(request, sendBuffer, cliConn->connfd);
+    return process_HEAD(request, sendBuffer, cliConn);
 
-  return process_error(request, sendBuffer, cliConn->connfd, NOT_IMPLEMENTED);
+  return process_error(request, sendBuffer, cliConn, NOT_IMPLEMENTED);
 }
 
 /********
@@ -82,6 +266,20 @@ static int my_parse_request(RequestContent *request) {
   return pRet;
 }
 
+/********
+ * FUNCIÓN: static long content_length(RequestContent *request)
+ * ARGS_IN: RequestContent *request - Request ya parseada
+ * DESCRIPCIÓN: Busca la cabecera Content-Length de la request
+ * ARGS_OUT: long - Longitud del cuerpo anunciada por el cliente, 0 si no hay cabecera
+ ********/
+static long content_length(RequestContent *request) {
+  for (size_t i = 0; i < request->numHeaders; i++) {
+    if (request->headers[i].name_len == 14 && strncasecmp(request->headers[i].name, "Content-Length", 14) == 0)
+      return strtol(request->headers[i].value, NULL, 10);
+  }
+  return 0;
+}
+
 /********
  * FUNCIÓN: void free_thread_resources(void *arg)
  * ARGS_IN: void *arg - Memoria de un puntero a ClientConnection. Es void* pues
@@ -98,16 +296,182 @@ void free_thread_resources(void *arg) {
     return;
   }
   ClientConnection *cliConn = *(ClientConnection **)arg;
-  if (cliConn->freeVar) {
-    free(cliConn->freeVar);
-  }
+  // Antes de cerrar el socket: al volver, la rueda ya no puede hacer shutdown sobre el descriptor
+  timer_cancel(&cliConn->timer);
+  connection_free(cliConn->freeVar, configParams.recvBufferLen + 1);
   if (cliConn->closeVar > 0) {
     close(cliConn->closeVar);
   }
   if (cliConn->fcloseVar) {
     fclose(cliConn->fcloseVar);
   }
-  free(cliConn);
+  connection_free(cliConn->pendingData, cliConn->pendingLen);
+  if (cliConn->pendingFile > 0) {
+    close(cliConn->pendingFile);
+  }
+  __atomic_sub_fetch(&numConnections, 1, __ATOMIC_RELAXED);
+  connection_free(cliConn, sizeof(ClientConnection));
+}
+
+/********
+ * FUNCIÓN: void connection_timed_out(TimerNode *timer)
+ * ARGS_IN: TimerNode *timer - Timer de la conexion que ha vencido
+ * DESCRIPCIÓN: Funcion de vencimiento de la rueda de timers. Hace shutdown del socket: el hilo
+ *              bloqueado en recv/send (o el event loop) ve el cierre y libera la conexion
+ ********/
+void connection_timed_out(TimerNode *timer) {
+  ClientConnection *cliConn = (ClientConnection *)timer->data;
+  shutdown(cliConn->connfd, SHUT_RDWR);
+}
+
+/********
+ * FUNCIÓN: static void arm_deadline(ClientConnection *cliConn, long timeout)
+ * ARGS_IN: ClientConnection *cliConn - Conexion
+ *          long timeout - Segundos de la fase que empieza (0 si la fase no tiene limite propio)
+ * DESCRIPCIÓN: Arma el timer de la conexion con el timeout de la fase o, si vence antes,
+ *              con lo que le queda a la peticion en curso (request_timeout)
+ ********/
+static void arm_deadline(ClientConnection *cliConn, long timeout) {
+  long long ms = timeout > 0 ? timeout * 1000LL : -1;
+
+  if (cliConn->requestStart > 0 && configParams.requestTimeout > 0) {
+    long long remaining = cliConn->requestStart + configParams.requestTimeout * 1000LL - timer_now();
+    if (ms < 0 || remaining < ms)
+      ms = remaining > 0 ? remaining : 0;
+  }
+  if (ms < 0)
+    timer_cancel(&cliConn->timer);
+  else
+    timer_arm(&cliConn->timer, ms);
+}
+
+/********
+ * FUNCIÓN: static void start_request(ClientConnection *cliConn)
+ * ARGS_IN: ClientConnection *cliConn - Conexion
+ * DESCRIPCIÓN: Empieza una peticion: cuenta su tiempo total y da header_timeout para las cabeceras
+ ********/
+static void start_request(ClientConnection *cliConn) {
+  cliConn->requestStart = timer_now();
+  cliConn->requestStartUs = limiter_now();
+  arm_deadline(cliConn, configParams.headerTimeout);
+}
+
+/********
+ * FUNCIÓN: static void end_request(ClientConnection *cliConn)
+ * ARGS_IN: ClientConnection *cliConn - Conexion
+ * DESCRIPCIÓN: Termina la peticion (respuesta enviada): pasa su latencia al limite de
+ *              conexiones y la conexion espera la siguiente durante keepalive_timeout
+ ********/
+static void end_request(ClientConnection *cliConn) {
+  limiter_sample(limiter_now() - cliConn->requestStartUs);
+  cliConn->requestStart = 0;
+  __atomic_store_n(&cliConn->waiting, 0x01, __ATOMIC_RELAXED);
+  arm_deadline(cliConn, configParams.keepAliveTimeout);
+}
+
+/********
+ * FUNCIÓN: void start_connection_timeouts(ClientConnection *cliConn)
+ * ARGS_IN: ClientConnection *cliConn - Conexion recien aceptada
+ * DESCRIPCIÓN: Asocia el timer a la conexion y empieza a contar header_timeout, de modo
+ *              que tambien vence una conexion que nunca llega a enviar nada. Desde ahora la
+ *              conexion cuenta como abierta hasta free_thread_resources
+ ********/
+void start_connection_timeouts(ClientConnection *cliConn) {
+  __atomic_add_fetch(&numConnections, 1, __ATOMIC_RELAXED);
+  cliConn->timer.data = cliConn;
+  start_request(cliConn);
+  __atomic_store_n(&cliConn->waiting, 0x01, __ATOMIC_RELAXED);
+}
+
+/********
+ * FUNCIÓN: static int waiting_timer(TimerNode *timer)
+ * ARGS_IN: TimerNode *timer - Timer armado de una conexion
+ * DESCRIPCIÓN: Indica si la conexion del timer espera la siguiente peticion sin haber recibido nada
+ * ARGS_OUT: int - 1 si la conexion esta esperando, 0 si no
+ ********/
+static int waiting_timer(TimerNode *timer) {
+  ClientConnection *cliConn = (ClientConnection *)timer->data;
+  return __atomic_load_n(&cliConn->waiting, __ATOMIC_RELAXED);
+}
+
+/********
+ * FUNCIÓN: void drain_clients()
+ * DESCRIPCIÓN: Empieza el cierre ordenado de las conexiones: las respuestas llevan
+ *              "Connection: close" y cada conexion se cierra al terminar su peticion en curso.
+ *              Las que esperan la siguiente peticion (con timeout armado) se cierran ya
+ ********/
+void drain_clients() {
+  drainingClients = 0x01;
+  // Su timer vence ahora: el hilo (o el event loop) ve el cierre y libera la conexion
+  timer_expire_matching(waiting_timer);
+}
+
+/********
+ * FUNCIÓN: int clients_draining()
+ * DESCRIPCIÓN: Indica si se ha llamado a drain_clients
+ * ARGS_OUT: int - 1 si las conexiones se estan cerrando, 0 si no
+ ********/
+int clients_draining() { return drainingClients; }
+
+/********
+ * FUNCIÓN: static int spin_receive(int sockfd, char *buffer, int len)
+ * ARGS_IN: int sockfd - Socket del que recibir
+ *          char *buffer - Donde dejar los datos
+ *          int len - Espacio libre en buffer
+ * DESCRIPCIÓN: Reintenta recv sin bloquear durante busy_poll_spin microsegundos. Cambia CPU
+ *              por latencia: si la siguiente peticion llega en ese tiempo el hilo no se duerme
+ *              ni hay que despertarlo
+ * ARGS_OUT: int - Bytes recibidos, 0 si el cliente ha cerrado, -1 en caso de error
+ *                 (errno EAGAIN si se agota el tiempo sin datos)
+ ********/
+static int spin_receive(int sockfd, char *buffer, int len) {
+  struct timespec start, now;
+  long elapsed;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  do {
+    int ret = recv(sockfd, buffer, len, MSG_DONTWAIT);
+    if (ret >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+      return ret;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - start.tv_sec) * 1000000 + (now.tv_nsec - start.tv_nsec) / 1000;
+  } while (elapsed < configParams.busyPollSpin);
+
+  errno = EAGAIN;
+  return -1;
+}
+
+/********
+ * FUNCIÓN: static int receive_data(ClientConnection *cliConn, char *recvBuffer)
+ * ARGS_IN: ClientConnection *cliConn - Conexion de la que recibir
+ *          char *recvBuffer - Buffer de recepcion de la conexion
+ * DESCRIPCIÓN: Devuelve los datos que el event loop ya dejo en el buffer (backend io_uring)
+ *              o, si no hay, los recibe del socket a continuacion de los acumulados.
+ *              Con busy_poll_spin primero se reintenta sin bloquear. Con park_idle no se
+ *              bloquea entre dos peticiones: sin datos la conexion se aparca en el event loop.
+ *              En modo fibers la espera solo bloquea la fibra, no el hilo
+ * ARGS_OUT: int - Bytes recibidos, 0 si el cliente ha cerrado, -1 en caso de error
+ *                 (errno EAGAIN si la conexion debe volver al event loop)
+ ********/
+static int receive_data(ClientConnection *cliConn, char *recvBuffer) {
+  char *buffer = recvBuffer + cliConn->recvLen;
+  int len = configParams.recvBufferLen - cliConn->recvLen;
+  int park = configParams.mode == MODE_EPOLL || (configParams.parkIdle && cliConn->requestStart == 0);
+
+  if (cliConn->readyLen > 0) {
+    int readyLen = cliConn->readyLen;
+    cliConn->readyLen = 0;
+    return readyLen;
+  }
+  if (configParams.mode == MODE_FIBERS)
+    return fiber_recv(cliConn->connfd, buffer, len);
+  if (configParams.busyPollSpin > 0) {
+    int ret = spin_receive(cliConn->connfd, buffer, len);
+    // Sin datos la conexion se devuelve al event loop
+    if (ret >= 0 || errno != EAGAIN || park)
+      return ret;
+  }
+  return recv(cliConn->connfd, buffer, len, park ? MSG_DONTWAIT : 0);
 }
 
 /********
@@ -116,35 +480,85 @@ void free_thread_resources(void *arg) {
  * DESCRIPCIÓN: Funcion que recibe, parsea y procesa una request,
  *              creando posteriormente la respuesta adecuada.
  *              Esta funcion se ejecuta en un thread independiente.
+ *              En modo epoll se llama cada vez que el socket esta listo y, cuando
+ *              no quedan datos, devuelve la conexion al event loop en vez de cerrarla.
+ *              Con park_idle el modo threads hace lo mismo con las conexiones keep-alive
+ *              que esperan la siguiente peticion, de modo que no ocupan un hilo.
+ *              En modo fibers se ejecuta en una fibra durante toda la vida de la conexion.
  * ARGS_OUT: void * - No retorna ningun valor de utilidad. NULL
  ********/
 void *manage_client(void *cliConnVoid) {
-  int recvLen = 0, pRet;
+  int recvLen = 0, pRet, turnRequests = 0;
   char *recvBuffer = NULL;
-  char sendBuffer[RESPONSE_LEN];
-  RequestContent request;
+  RequestBuffers *buffers;
+  RequestContent *request;
   ClientConnection *cliConn = (ClientConnection *)cliConnVoid;
-  cliConn->freeVar = NULL;
-  cliConn->closeVar = 0;
-  cliConn->fcloseVar = NULL;
 
-  // Allocamos el buffer de recepcion
-  recvBuffer = (char *)calloc(configParams.recvBufferLen + 1, 1);
-  cliConn->freeVar = recvBuffer;
-  if (!recvBuffer) {
-    syslog(LOG_ERR, "Error allocating buffer. Client not managed.");
-    close((int)cliConn->connfd);
-    return (NULL);
+  if (!cliConn->freeVar) {
+    // Primera vez que se atiende la conexion
+    cliConn->fcloseVar = NULL;
+
+    // Allocamos el buffer de recepcion
+    recvBuffer = (char *)connection_alloc(configParams.recvBufferLen + 1);
+    cliConn->freeVar = recvBuffer;
+    if (!recvBuffer) {
+      syslog(LOG_ERR, "Error allocating buffer. Client not managed.");
+      free_thread_resources(&cliConn);
+      limiter_release();
+      return (NULL);
+    }
+  }
+  recvBuffer = (char *)cliConn->freeVar;
+
+  // En modo epoll la conexion puede volver con una respuesta a medio enviar
+  if (cliConn->pendingLen > 0 || cliConn->pendingFileLen > 0) {
+    pRet = flush_pending_data(cliConn);
+    if (pRet == 1 && event_loop_watch(cliConn, 1) == 0)
+      return (NULL);
+    if (pRet != 0)
+      goto close_connection;
+    end_request(cliConn);
+    if (drainingClients)
+      goto close_connection;
   }
 
   // Bucle principal que se queda esperando a nuevas requests
-  while ((recvLen = recv(cliConn->connfd, recvBuffer, configParams.recvBufferLen, 0)) > 0) {
-    memset(&request, 0, sizeof(RequestContent));
+  while ((recvLen = receive_data(cliConn, recvBuffer)) > 0) {
+    // Primeros bytes de una peticion (conexion nueva o keep-alive). drain_clients elige las
+    // conexiones en espera con la rueda bloqueada: tras timer_cancel ya no puede cerrar esta,
+    // y entonces se quita la marca y se arma header_timeout desde este primer byte
+    if (__atomic_load_n(&cliConn->waiting, __ATOMIC_RELAXED)) {
+      timer_cancel(&cliConn->timer);
+      __atomic_store_n(&cliConn->waiting, 0x00, __ATOMIC_RELAXED);
+      start_request(cliConn);
+    }
+    cliConn->recvLen += recvLen;
+    // Los buffers solo se tienen mientras se procesa lo recibido: se devuelven antes de esperar mas datos
+    if (!(buffers = get_request_buffers())) {
+      syslog(LOG_ERR, "Error allocating request buffers. Closing connection");
+      break;
+    }
+    request = &buffers->request;
+    memset(request, 0, sizeof(RequestContent));
     // Parseo la request recibida y la devuelvo en la estructura request
-    request.totalLen = recvLen;
-    request.completeRequest = recvBuffer;
-    pRet = my_parse_request(&request);
-    recvBuffer[recvLen] = 0;
+    request->totalLen = cliConn->recvLen;
+    request->completeRequest = recvBuffer;
+    pRet = my_parse_request(request);
+    recvBuffer[cliConn->recvLen] = 0;
+
+    // Request incompleta: seguimos leyendo mientras quepa en el buffer
+    if (cliConn->recvLen < configParams.recvBufferLen &&
+        (pRet == -2 || (pRet > 0 && (long)(request->totalLen - request->requestLen) < content_length(request)))) {
+      put_request_buffers(buffers);
+      // Cabeceras completas: body_timeout cuenta entre cada lectura del cuerpo
+      if (pRet > 0)
+        arm_deadline(cliConn, configParams.bodyTimeout);
+      continue;
+    }
+    cliConn->recvLen = 0;
+    // Peticion completa: solo queda el limite total mientras se genera y envia la respuesta
+    arm_deadline(cliConn, 0);
+
     if (pRet < 0) {
       syslog(LOG_ERR, "Error parsing request. Closing connection. pRet = %d", pRet);
 
@@ -152,18 +566,70 @@ void *manage_client(void *cliConnVoid) {
        * sería error suyo (request mal formulada). Aún así nos ha llegado ha dar algún fallo
        * la librería de parseo, pero consideramos que esta es la respuesta más apropiada, ya que
        * el primer caso es el caso más frecuente */
-      process_error(&request, sendBuffer, cliConn->connfd, BAD_REQUEST);
+      process_error(request, buffers->sendBuffer, cliConn, BAD_REQUEST);
+      put_request_buffers(buffers);
       break;
     }
 
-    // Enviar respuesta al cliente
-    if (create_and_send_response(cliConn, &request, sendBuffer) == -1) {
+    // Enviar respuesta al cliente. Lo que no se pudo enviar ya se ha copiado en pendingData
+    int responded = create_and_send_response(cliConn, request, buffers->sendBuffer);
+    put_request_buffers(buffers);
+    // La conexion sigue en el pool de scripts: ya no es de este hilo
+    if (responded == 1)
+      return (NULL);
+    // Peticion de script atendida: la conexion vuelve a su pool en cuanto termine de responder
+    int leaveLane = cliConn->scriptLane;
+    if (leaveLane) {
+      cliConn->scriptLane = 0x00;
+      __atomic_sub_fetch(&scriptLoad, 1, __ATOMIC_RELAXED);
+    }
+    if (responded == -1) {
       syslog(LOG_ERR, "Error creating response. Closing connection");
       break;
     }
+
+    // El socket no admitia toda la respuesta: esperamos a que sea escribible
+    if (cliConn->pendingLen > 0 || cliConn->pendingFileLen > 0) {
+      if (event_loop_watch(cliConn, 1) == 0)
+        return (NULL);
+      break;
+    }
+    end_request(cliConn);
+    // Cierre ordenado: la respuesta ya llevaba "Connection: close"
+    if (drainingClients)
+      break;
+    if (leaveLane && configParams.mode == MODE_FIBERS &&
+        fiber_spawn(manage_client, cliConn, configParams.cpuAffinity ? incoming_cpu(cliConn->connfd) : -1) == 0)
+      return (NULL);
+    if (leaveLane && configParams.mode != MODE_FIBERS && add_job(cliConn->pool, cliConn) == 0)
+      return (NULL);
+
+    // Una conexion con peticiones encadenadas no acapara el hilo: sigue como continuacion en
+    // su cola local, donde otro hilo libre puede robarla mientras este atiende otro trabajo.
+    // En modo fibers cede el planificador a las demas fibras listas
+    if (++turnRequests >= CONNREQUESTSPERTURN && configParams.mode == MODE_FIBERS && in_fiber()) {
+      turnRequests = 0;
+      fiber_yield();
+    }
+    if (turnRequests >= CONNREQUESTSPERTURN &&
+        (configParams.mode == MODE_EPOLL || (configParams.mode == MODE_THREADS && configParams.parkIdle)) &&
+        add_local_job(cliConn->pool, cliConn) == 0)
+      return (NULL);
+  }
+
+  // Sin mas datos: se devuelve la conexion al event loop (modo epoll o park_idle)
+  if (recvLen < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+    // Entre peticiones no hace falta el buffer de recepcion: se reserva de nuevo al volver
+    if (cliConn->requestStart == 0 && cliConn->recvLen == 0 && cliConn->readyLen == 0) {
+      connection_free(cliConn->freeVar, configParams.recvBufferLen + 1);
+      cliConn->freeVar = NULL;
+    }
+    if (event_loop_watch(cliConn, 0) == 0)
+      return (NULL);
   }
 
+close_connection:
   free_thread_resources(&cliConn);
-  sem_post(&numConnections);
+  limiter_release();
   return (NULL);
 }
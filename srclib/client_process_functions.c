@@ -10,13 +10,20 @@
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
 #include "../includes/client_process_functions.h"
+#include "../includes/fiber_lib.h"
+#include "../includes/limiter_lib.h"
 #include "../includes/picohttpparser.h"
 #include "../includes/server.h"
+#include "../includes/thread_pool_lib.h"
+#include "../includes/uring_lib.h"
 
+#include <errno.h>
 #include <fcntl.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <pthread.h>
+#include <signal.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -25,9 +32,12 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/syslog.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
+extern char **environ;
+
 /********
  * FUNCIÓN: static void get_response_code_string(HTTPResponseCode responseCode, char *responseString)
  * ARGS_IN: HTTPResponseCode responseCode - el codigo de respuesta
@@ -54,6 +64,9 @@ static void get_response_code_string(HTTPResponseCode responseCode, char *respon
   case NOT_IMPLEMENTED:
     strcpy(responseString, "Not Implemented");
     break;
+  case SERVICE_UNAVAILABLE:
+    strcpy(responseString, "Service Unavailable");
+    break;
   case HTTP_VER_NOT_SUPP:
     strcpy(responseString, "HTTP Version Not Supported");
     break;
@@ -189,6 +202,25 @@ static char *obtain_executable(char *filename) {
   return NULL;
 }
 
+/********
+ * FUNCIÓN: static char *alloc_script_buffers(char **outputFile, size_t argsLen)
+ * ARGS_IN: char **outputFile - (output) Buffer para la ruta del archivo de salida del script
+ *          size_t argsLen - Longitud maxima de los argumentos del script
+ * DESCRIPCIÓN: Reserva de una vez la ruta de salida del script y sus argumentos. Van en memoria
+ *              dinamica porque los argumentos pueden ser tan largos como la peticion, y la pila
+ *              de los hilos es pequeña (thread_stack_size). Se libera con free(*outputFile)
+ * ARGS_OUT: char * - Buffer para los argumentos, NULL en caso de error
+ ********/
+static char *alloc_script_buffers(char **outputFile, size_t argsLen) {
+  size_t outputLen = strlen(configParams.tmpDirectory) + 1024;
+  *outputFile = (char *)malloc(outputLen + argsLen);
+  if (!*outputFile) {
+    syslog(LOG_ERR, "Error allocating script buffers");
+    return NULL;
+  }
+  return *outputFile + outputLen;
+}
+
 /********
  * FUNCIÓN: static int execute_script(char *filepath, char *filename, char *args, long uid)
  * ARGS_IN: char *filepath - (output) Archivo al cual redirigir la salida del script
@@ -209,7 +241,10 @@ static int execute_script(char *filepath, char *filename, char *args, long uid)
   strcpy(filepath, configParams.tmpDirectory);
   sprintf(filepath + strlen(filepath), "%ld_%ld.txt", uid, time(NULL));
 
-  char command[strlen(executable) + 1 + strlen(filename) + 1 + strlen(args) + strlen(" > ") + strlen(filepath) + 1];
+  // En memoria dinamica: los argumentos pueden ser tan largos como la peticion
+  char *command = (char *)malloc(strlen(executable) + 1 + strlen(filename) + 1 + strlen(args) + strlen(" > ") + strlen(filepath) + 1);
+  if (!command)
+    return -1;
   strcpy(command, executable);
   strcat(command, " ");
   strcat(command, filename);
@@ -218,13 +253,106 @@ static int execute_script(char *filepath, char *filename, char *args, long uid)
   strcat(command, " > ");
   strcat(command, filepath);
   syslog(LOG_INFO, "Executing: %s\n", command);
-  system(command);
+
+  /* No se usa system(): ignora SIGINT en todo el proceso mientras espera al script, y la
+   * señal de cierre del servidor se perderia. El shell empieza sin señales bloqueadas */
+  pid_t pid;
+  posix_spawnattr_t attr;
+  sigset_t noSignals;
+  char *shArgs[] = {"sh", "-c", command, NULL};
+  sigemptyset(&noSignals);
+  posix_spawnattr_init(&attr);
+  posix_spawnattr_setsigmask(&attr, &noSignals);
+  posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+  int ret = posix_spawn(&pid, "/bin/sh", NULL, &attr, shArgs, environ);
+  posix_spawnattr_destroy(&attr);
+  free(command);
+  if (ret != 0)
+    return -1;
+  // En modo fibers solo espera la fibra: el planificador sigue con las demas conexiones
+  fiber_waitpid(pid, NULL);
+  return 0;
+}
+
+/********
+ * FUNCIÓN: static int send_data_nonblocking(ClientConnection *cliConn, int filefd, char *sendBuffer, int sendBufferLen, char *filename)
+ * ARGS_IN: ClientConnection *cliConn - Conexion (con socket no bloqueante) por la que enviar los datos
+ *          int filefd - (opcional) Descriptor del archivo a enviar
+ *          char *sendBuffer - Buffer a enviar
+ *          int sendBufferLen - Longitud del buffer a enviar
+ *          char *filename - (opcional) Archivo asociado filefd para obtener informacion de dicho archivo
+ * DESCRIPCIÓN: Version de send_data para el modo epoll. Envia todo lo que admite el socket
+ *              y guarda en cliConn lo que falte, para terminarlo con flush_pending_data
+ *              cuando el event loop indique que el socket es escribible.
+ * ARGS_OUT: int - Devuelve -1 en caso de error, 0 en el resto de casos
+ ********/
+static int send_data_nonblocking(ClientConnection *cliConn, int filefd, char *sendBuffer, int sendBufferLen, char *filename) {
+  long fileLen = filefd > 0 ? get_file_size(filename) : 0;
+  /* MSG_MORE evita las dos llamadas a setsockopt(TCP_CORK) del modo bloqueante */
+  int writeRet = send(cliConn->connfd, sendBuffer, sendBufferLen, fileLen > 0 ? MSG_MORE : 0);
+  if (writeRet < 0) {
+    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+      syslog(LOG_ERR, "Error sending data");
+      return -1;
+    }
+    writeRet = 0;
+  }
+
+  if (writeRet < sendBufferLen) {
+    cliConn->pendingData = (char *)connection_alloc(sendBufferLen - writeRet);
+    if (!cliConn->pendingData) {
+      syslog(LOG_ERR, "Error allocating pending data");
+      return -1;
+    }
+    memcpy(cliConn->pendingData, sendBuffer + writeRet, sendBufferLen - writeRet);
+    cliConn->pendingLen = sendBufferLen - writeRet;
+    cliConn->pendingOffset = 0;
+  }
+
+  if (fileLen <= 0)
+    return 0;
+
+  /* El archivo se cierra al volver de process_GET/POST, asi que duplicamos el descriptor */
+  cliConn->pendingFile = dup(filefd);
+  if (cliConn->pendingFile < 0) {
+    cliConn->pendingFile = 0;
+    syslog(LOG_ERR, "Error duplicating file descriptor");
+    return -1;
+  }
+  cliConn->pendingFileOffset = 0;
+  cliConn->pendingFileLen = fileLen;
+
+  if (cliConn->pendingLen > 0)
+    return 0;
+  return flush_pending_data(cliConn) == -1 ? -1 : 0;
+}
+
+/********
+ * FUNCIÓN: static int send_data_fiber(ClientConnection *cliConn, int filefd, char *sendBuffer, int sendBufferLen, char *filename)
+ * ARGS_IN: ClientConnection *cliConn - Conexion (con socket no bloqueante) por la que enviar los datos
+ *          int filefd - (opcional) Descriptor del archivo a enviar
+ *          char *sendBuffer - Buffer a enviar
+ *          int sendBufferLen - Longitud del buffer a enviar
+ *          char *filename - (opcional) Archivo asociado filefd para obtener informacion de dicho archivo
+ * DESCRIPCIÓN: Version de send_data para el modo fibers. Envia la respuesta entera, como el
+ *              modo bloqueante, pero mientras el socket esta lleno solo espera la fibra
+ * ARGS_OUT: int - Devuelve -1 en caso de error, 0 en el resto de casos
+ ********/
+static int send_data_fiber(ClientConnection *cliConn, int filefd, char *sendBuffer, int sendBufferLen, char *filename) {
+  long fileLen = filefd > 0 ? get_file_size(filename) : 0;
+  off_t offset = 0;
+
+  if (fiber_send(cliConn->connfd, sendBuffer, sendBufferLen, fileLen > 0 ? MSG_MORE : 0) < 0 ||
+      (fileLen > 0 && fiber_sendfile(cliConn->connfd, filefd, &offset, fileLen) < 0)) {
+    syslog(LOG_ERR, "Error sending data");
+    return -1;
+  }
   return 0;
 }
 
 /********
- * FUNCIÓN: static int send_data(int sockfd, int filefd, char *sendBuffer, int sendBufferLen, char *filename)
- * ARGS_IN: int sockfd - Socket por el que enviar los datos
+ * FUNCIÓN: static int send_data(ClientConnection *cliConn, int filefd, char *sendBuffer, int sendBufferLen, char *filename)
+ * ARGS_IN: ClientConnection *cliConn - Conexion por la que enviar los datos
  *          int filefd - (opcional) Descriptor del archivo a enviar
  *          char *sendBuffer - Buffer a enviar
  *          int sendBufferLen - Longitud del buffer a enviar
@@ -233,9 +361,18 @@ static int execute_script(char *filepath, char *filename, char *args, long uid)
  *              También envia un archivo (filefd, filename) en caso de ser necesario. 
  * ARGS_OUT: int - Devuelve -1 en caso de error, 0 en el resto de casos
  ********/
-static int send_data(int sockfd, int filefd, char *sendBuffer, int sendBufferLen, char *filename) {
+static int send_data(ClientConnection *cliConn, int filefd, char *sendBuffer, int sendBufferLen, char *filename) {
+  int sockfd = cliConn->connfd;
   int si = 1, no = 0;
   int writeRet = 0;
+
+  if (configParams.mode == MODE_EPOLL)
+    return send_data_nonblocking(cliConn, filefd, sendBuffer, sendBufferLen, filename);
+  if (configParams.mode == MODE_FIBERS)
+    return send_data_fiber(cliConn, filefd, sendBuffer, sendBufferLen, filename);
+  if (configParams.ioBackend == IO_URING)
+    return uring_send_response(sockfd, sendBuffer, sendBufferLen, filefd, filefd > 0 ? get_file_size(filename) : 0);
+
   setsockopt(sockfd, IPPROTO_TCP, TCP_CORK, &si, sizeof(int));
   writeRet = write(sockfd, sendBuffer, sendBufferLen);
   if (writeRet < 0) {
@@ -253,6 +390,51 @@ static int send_data(int sockfd, int filefd, char *sendBuffer, int sendBufferLen
   return 0;
 }
 
+/********
+ * FUNCIÓN: int flush_pending_data(ClientConnection *cliConn)
+ * ARGS_IN: ClientConnection *cliConn - Conexion con datos pendientes de enviar
+ * DESCRIPCIÓN: Continua el envio de una respuesta que no cabia en el socket no bloqueante
+ * ARGS_OUT: int - Devuelve 0 si se ha enviado todo, 1 si el socket se ha vuelto a llenar
+ *                 y -1 en caso de error
+ ********/
+int flush_pending_data(ClientConnection *cliConn) {
+  while (cliConn->pendingOffset < cliConn->pendingLen) {
+    int writeRet = send(cliConn->connfd, cliConn->pendingData + cliConn->pendingOffset, cliConn->pendingLen - cliConn->pendingOffset,
+                        cliConn->pendingFileLen > 0 ? MSG_MORE : 0);
+    if (writeRet < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 1;
+      syslog(LOG_ERR, "Error sending data");
+      return -1;
+    }
+    cliConn->pendingOffset += writeRet;
+  }
+  if (cliConn->pendingData) {
+    connection_free(cliConn->pendingData, cliConn->pendingLen);
+    cliConn->pendingData = NULL;
+    cliConn->pendingLen = cliConn->pendingOffset = 0;
+  }
+
+  while (cliConn->pendingFileLen > 0) {
+    ssize_t writeRet = sendfile(cliConn->connfd, cliConn->pendingFile, &cliConn->pendingFileOffset, cliConn->pendingFileLen);
+    if (writeRet < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return 1;
+      syslog(LOG_ERR, "Error sending data");
+      return -1;
+    }
+    if (writeRet == 0) // el archivo ha encogido mientras se enviaba
+      break;
+    cliConn->pendingFileLen -= writeRet;
+  }
+  if (cliConn->pendingFile > 0) {
+    close(cliConn->pendingFile);
+    cliConn->pendingFile = 0;
+    cliConn->pendingFileLen = 0;
+  }
+  return 0;
+}
+
 /********
  * FUNCIÓN: static int response_start_line(char *sendBuffer, int minorVersion, HTTPResponseCode responseCode)
  * ARGS_IN: char *sendBuffer - (output) buffer que se rellena con la primera linea
@@ -302,6 +484,19 @@ static int server_header(char *sendBuffer) {
   return sprintf(sendBuffer, "Server: %s\r\n", configParams.serverSignature);
 }
 
+/********
+ * FUNCIÓN: static int connection_header(char *sendBuffer)
+ * ARGS_IN: char *sendBuffer - Buffer donde escribir la cabecera
+ * DESCRIPCIÓN: Durante el cierre ordenado del servidor añade "Connection: close", pues la
+ *              conexion se cierra tras esta respuesta
+ * ARGS_OUT: int - Numero de bytes escritos
+ ********/
+static int connection_header(char *sendBuffer) {
+  if (!clients_draining())
+    return 0;
+  return sprintf(sendBuffer, "Connection: close\r\n");
+}
+
 /********
  * FUNCIÓN: static int last_modified_header(char *sendBuffer, char *filename)
  * ARGS_IN: char *sendBuffer - (output) buffer que se rellena con la primera linea
@@ -378,23 +573,24 @@ static int content_type_header(char *sendBuffer, char *filename) {
 }
 
 /********
- * FUNCIÓN: int process_OPTIONS(RequestContent *request, char *sendBuffer, int sockfd)
+ * FUNCIÓN: int process_OPTIONS(RequestContent *request, char *sendBuffer, ClientConnection *cliConn)
  * ARGS_IN: RequestContent *request - Request con la inforacion a usar para responder
- *          int sockfd - Socket por el que enviar los datos
  *          char *sendBuffer - Buffer con memoria reservada a completar y enviar
+ *          ClientConnection *cliConn - Conexion por la que enviar los datos
  * DESCRIPCIÓN: Función encargada de procesar una request de tipo OPTIONS y enviar la
  *              respuesta
  * ARGS_OUT: int - Devuelve -1 en caso de error, 0 en el resto de casos
  ********/
-int process_OPTIONS(RequestContent *request, char *sendBuffer, int sockfd) {
+int process_OPTIONS(RequestContent *request, char *sendBuffer, ClientConnection *cliConn) {
   int retValue = 0, sendBufferLen = 0;
   sendBufferLen = response_start_line(sendBuffer, request->minorVersion, NO_CONTENT);
   sendBufferLen += allow_header(sendBuffer + sendBufferLen);
   sendBufferLen += date_header(sendBuffer + sendBufferLen);
   sendBufferLen += server_header(sendBuffer + sendBufferLen);
+  sendBufferLen += connection_header(sendBuffer + sendBufferLen);
   sendBufferLen += sprintf(sendBuffer + sendBufferLen, "\r\n");
 
-  int writeRet = send_data(sockfd, -1, sendBuffer, sendBufferLen, NULL);
+  int writeRet = send_data(cliConn, -1, sendBuffer, sendBufferLen, NULL);
   if (writeRet < 0) {
     retValue = -1;
   }
@@ -403,15 +599,15 @@ int process_OPTIONS(RequestContent *request, char *sendBuffer, int sockfd) {
 }
 
 /********
- * FUNCIÓN: int process_HEAD(RequestContent *request, char *sendBuffer, int sockfd)
+ * FUNCIÓN: int process_HEAD(RequestContent *request, char *sendBuffer, ClientConnection *cliConn)
  * ARGS_IN: RequestContent *request - Request con la inforacion a usar para responder
- *          int sockfd - Socket por el que enviar los datos
  *          char *sendBuffer - Buffer con memoria reservada a completar y enviar
+ *          ClientConnection *cliConn - Conexion por la que enviar los datos
  * DESCRIPCIÓN: Función encargada de procesar una request de tipo HEAD y enviar la
  *              respuesta
  * ARGS_OUT: int - Devuelve -1 en caso de error, 0 en el resto de casos
  ********/
-int process_HEAD(RequestContent *request, char *sendBuffer, int sockfd) {
+int process_HEAD(RequestContent *request, char *sendBuffer, ClientConnection *cliConn) {
   char url[request->pathLen + 1]; // picohttpparser no crea una nueva memoria
   char filename[request->pathLen + 1 + strlen(configParams.baseFile) + strlen(configParams.rootPath)];
   int retValue = 0;
@@ -421,18 +617,19 @@ int process_HEAD(RequestContent *request, char *sendBuffer, int sockfd) {
 
   if (access(filename, F_OK) != 0) {
     syslog(LOG_ERR, "Error: file not found");
-    return process_error(request, sendBuffer, sockfd, NOT_FOUND);
+    return process_error(request, sendBuffer, cliConn, NOT_FOUND);
   }
 
   sendBufferLen = response_start_line(sendBuffer, request->minorVersion, OK);
   sendBufferLen += date_header(sendBuffer + sendBufferLen);
   sendBufferLen += server_header(sendBuffer + sendBufferLen);
+  sendBufferLen += connection_header(sendBuffer + sendBufferLen);
   sendBufferLen += last_modified_header(sendBuffer + sendBufferLen, filename);
   sendBufferLen += content_length_header(sendBuffer + sendBufferLen, filename);
   sendBufferLen += content_type_header(sendBuffer + sendBufferLen, filename);
   sendBufferLen += sprintf(sendBuffer + sendBufferLen, "\r\n");
 
-  int writeRet = send_data(sockfd, -1, sendBuffer, sendBufferLen, NULL);
+  int writeRet = send_data(cliConn, -1, sendBuffer, sendBufferLen, NULL);
   if (writeRet < 0)
     retValue = -1;
 
@@ -440,117 +637,128 @@ int process_HEAD(RequestContent *request, char *sendBuffer, int sockfd) {
 }
 
 /********
- * FUNCIÓN: int process_GET(RequestContent *request, char *sendBuffer, int sockfd, FILE **toClose)
+ * FUNCIÓN: int process_GET(RequestContent *request, char *sendBuffer, ClientConnection *cliConn)
  * ARGS_IN: RequestContent *request - Request con la inforacion a usar para responder
- *          int sockfd - Socket por el que enviar los datos
  *          char *sendBuffer - Buffer con memoria reservada a completar y enviar
- *          FILE **toClose - Sirve para liberar los recursos en caso de salida brupta,
- *                           como por ejemplo al recibir(SIGINT)
+ *          ClientConnection *cliConn - Conexion por la que enviar los datos. Su campo
+ *                                      fcloseVar sirve para liberar los recursos en caso
+ *                                      de salida brupta, como por ejemplo al recibir(SIGINT)
  * DESCRIPCIÓN: Función encargada de procesar una request de tipo GET y enviar la
  *              respuesta, que es un archivo o una respuesta creada por el script ejecutado
  * ARGS_OUT: int - Devuelve -1 en caso de error, 0 en el resto de casos
  ********/
-int process_GET(RequestContent *request, char *sendBuffer, int sockfd, FILE **toClose) {
+int process_GET(RequestContent *request, char *sendBuffer, ClientConnection *cliConn) {
   char url[request->pathLen + 1]; // picohttpparser no crea nueva memoria
   char filename[request->pathLen + 1 + strlen(configParams.baseFile) + strlen(configParams.rootPath)];
-  char outputFile[strlen(configParams.tmpDirectory) + 1024];
+  char *outputFile = NULL;
   FILE *pf = NULL; // closed with fclose
   int retValue = 0;
   int queryOffset = parse_url(request, url, filename);
   char *queryString = url + queryOffset;
-  char queryValues[strlen(queryString)];
 
   if (access(filename, F_OK) != 0) {
     syslog(LOG_ERR, "Error: file not found");
-    return process_error(request, sendBuffer, sockfd, NOT_FOUND);
+    return process_error(request, sendBuffer, cliConn, NOT_FOUND);
   }
 
   char *file = filename;
   int filefd = 0;
   if (queryOffset != (int)request->pathLen) {
     // Parse queries if there are any
+    char *queryValues = alloc_script_buffers(&outputFile, strlen(queryString) + 1);
+    if (!queryValues)
+      return process_error(request, sendBuffer, cliConn, INTERNAL_SERVER_ERROR);
     if (parse_queries(queryString, queryValues) == -1) {
-      return process_error(request, sendBuffer, sockfd, FORBIDDEN);
+      free(outputFile);
+      return process_error(request, sendBuffer, cliConn, FORBIDDEN);
     }
-    int err = execute_script(outputFile, filename, queryValues, sockfd);
+    int err = execute_script(outputFile, filename, queryValues, cliConn->connfd);
     if (err == -1) {
       syslog(LOG_ERR, "Error executing the script");
-      return process_error(request, sendBuffer, sockfd, INTERNAL_SERVER_ERROR);
+      free(outputFile);
+      return process_error(request, sendBuffer, cliConn, INTERNAL_SERVER_ERROR);
     }
     file = outputFile;
   } // if there are no queries, send back the requested file
   if (!(pf = fopen(file, "rb"))) {
     syslog(LOG_ERR, "Error opening the script's output file");
-    return process_error(request, sendBuffer, sockfd, INTERNAL_SERVER_ERROR);
+    free(outputFile);
+    return process_error(request, sendBuffer, cliConn, INTERNAL_SERVER_ERROR);
   }
-  *toClose = pf;
+  cliConn->fcloseVar = pf;
   filefd = pf->_fileno;
 
   int sendBufferLen = 0;
   sendBufferLen = response_start_line(sendBuffer, request->minorVersion, OK);
   sendBufferLen += date_header(sendBuffer + sendBufferLen);
   sendBufferLen += server_header(sendBuffer + sendBufferLen);
+  sendBufferLen += connection_header(sendBuffer + sendBufferLen);
   sendBufferLen += last_modified_header(sendBuffer + sendBufferLen, filename);
   sendBufferLen += content_length_header(sendBuffer + sendBufferLen, file);
   sendBufferLen += content_type_header(sendBuffer + sendBufferLen, file);
   sendBufferLen += sprintf(sendBuffer + sendBufferLen, "\r\n");
 
-  int writeRet = send_data(sockfd, filefd, sendBuffer, sendBufferLen, file);
+  int writeRet = send_data(cliConn, filefd, sendBuffer, sendBufferLen, file);
   if (writeRet < 0)
     retValue = -1;
 
   fclose(pf);
-  *toClose = NULL;
+  cliConn->fcloseVar = NULL;
+  free(outputFile);
 
   return retValue;
 }
 
 /********
- * FUNCIÓN: int process_POST(RequestContent *request, char *sendBuffer, int sockfd, FILE **toClose)
+ * FUNCIÓN: int process_POST(RequestContent *request, char *sendBuffer, ClientConnection *cliConn)
  * ARGS_IN: RequestContent *request - Request con la inforacion a usar para responder
- *          int sockfd - Socket por el que enviar los datos
  *          char *sendBuffer - Buffer con memoria reservada a completar y enviar
- *          FILE **toClose - Sirve para liberar los recursos en caso de salida brupta,
- *                           como por ejemplo al recibir(SIGINT)
+ *          ClientConnection *cliConn - Conexion por la que enviar los datos. Su campo
+ *                                      fcloseVar sirve para liberar los recursos en caso
+ *                                      de salida brupta, como por ejemplo al recibir(SIGINT)
  * DESCRIPCIÓN: Función encargada de procesar una request de tipo POST y enviar la
  *              respuesta. Maneja argumentos tanto en la url como en el cuerpo
  * ARGS_OUT: int - Devuelve -1 en caso de error, 0 en el resto de casos
  ********/
-int process_POST(RequestContent *request, char *sendBuffer, int sockfd, FILE **toClose) {
+int process_POST(RequestContent *request, char *sendBuffer, ClientConnection *cliConn) {
   char url[request->pathLen + 1]; // picohttpparser no crea nueva memoria
   char filename[request->pathLen + 1 + strlen(configParams.baseFile) + strlen(configParams.rootPath)];
-  char outputFile[strlen(configParams.tmpDirectory) + 1024];
+  char *outputFile = NULL;
   int retValue = 0;
   FILE *pf = NULL; // closed with fclose
 
   int queryOffset = parse_url(request, url, filename);
   int requestBodyLen = request->totalLen - request->requestLen;
   char *queryString = url + queryOffset;
-  char queryValues[strlen(queryString) + requestBodyLen];
 
   if (access(filename, F_OK) != 0) {
     syslog(LOG_ERR, "Error: file not found");
-    return process_error(request, sendBuffer, sockfd, NOT_FOUND);
+    return process_error(request, sendBuffer, cliConn, NOT_FOUND);
   }
 
   char *file = filename;
   int filefd = 0;
+  char *queryValues = alloc_script_buffers(&outputFile, strlen(queryString) + requestBodyLen + 1);
+  if (!queryValues)
+    return process_error(request, sendBuffer, cliConn, INTERNAL_SERVER_ERROR);
   // Parse queries de url si existen
   int offset = parse_queries(queryString, queryValues);
   // Parse queries del cuerpo si existen
   parse_queries(request->completeRequest + request->requestLen, queryValues + offset);
-  int err = execute_script(outputFile, filename, queryValues, sockfd);
+  int err = execute_script(outputFile, filename, queryValues, cliConn->connfd);
   if (err == -1) {
     syslog(LOG_ERR, "Error executing the script");
-    return process_error(request, sendBuffer, sockfd, INTERNAL_SERVER_ERROR);
+    free(outputFile);
+    return process_error(request, sendBuffer, cliConn, INTERNAL_SERVER_ERROR);
   }
   file = outputFile;
   // if there are no queries, send back the requested file
   if (!(pf = fopen(file, "rb"))) {
     syslog(LOG_ERR, "Error opening the script's output file");
-    return process_error(request, sendBuffer, sockfd, INTERNAL_SERVER_ERROR);
+    free(outputFile);
+    return process_error(request, sendBuffer, cliConn, INTERNAL_SERVER_ERROR);
   }
-  *toClose = pf;
+  cliConn->fcloseVar = pf;
   filefd = pf->_fileno;
 
   int sendBufferLen = 0;
@@ -558,51 +766,116 @@ int process_POST(RequestContent *request, char *sendBuffer, int sockfd, FILE **t
   sendBufferLen = response_start_line(sendBuffer, request->minorVersion, OK);
   sendBufferLen += date_header(sendBuffer + sendBufferLen);
   sendBufferLen += server_header(sendBuffer + sendBufferLen);
+  sendBufferLen += connection_header(sendBuffer + sendBufferLen);
   sendBufferLen += last_modified_header(sendBuffer + sendBufferLen, filename);
   sendBufferLen += content_length_header(sendBuffer + sendBufferLen, file);
   sendBufferLen += content_type_header(sendBuffer + sendBufferLen, file);
   sendBufferLen += sprintf(sendBuffer + sendBufferLen, "\r\n");
 
-  int writeRet = send_data(sockfd, filefd, sendBuffer, sendBufferLen, file);
+  int writeRet = send_data(cliConn, filefd, sendBuffer, sendBufferLen, file);
   if (writeRet < 0)
     retValue = -1;
 
   fclose(pf);
-  *toClose = NULL;
+  cliConn->fcloseVar = NULL;
+  free(outputFile);
   return retValue;
 }
 
 /********
- * FUNCIÓN: int process_error(RequestContent *request, char *sendBuffer, int sockfd, HTTPResponseCode responseCode)
+ * FUNCIÓN: int process_status(RequestContent *request, char *sendBuffer, ClientConnection *cliConn)
  * ARGS_IN: RequestContent *request - Request con la inforacion a usar para responder
- *          int sockfd - Socket por el que enviar los datos
  *          char *sendBuffer - Buffer con memoria reservada a completar y enviar
+ *          ClientConnection *cliConn - Conexion por la que enviar los datos
+ * DESCRIPCIÓN: Responde a un GET de status_path con el estado del servidor en texto plano,
+ *              una linea "nombre: valor" por dato (limite de conexiones actual, ocupadas y
+ *              estadisticas de todos los pools juntos). Los histogramas son una lista de
+ *              POOLSTATSBUCKETS contadores, el i de tiempos de [2^(i-1), 2^i) microsegundos.
+ *              Tambien la pila de cada hilo y la memoria de las conexiones: connection_bytes
+ *              suma sus estructuras, buffers de recepcion, respuestas pendientes y los buffers
+ *              de peticion, y connection_bytes_avg es esa suma por conexion abierta. fibers son
+ *              las fibras vivas (modo fibers)
+ * ARGS_OUT: int - Devuelve -1 en caso de error, 0 en el resto de casos
+ ********/
+int process_status(RequestContent *request, char *sendBuffer, ClientConnection *cliConn) {
+  int bodyLen, sendBufferLen = 0;
+  PoolStats stats;
+  ConnectionMemory memory;
+
+  // El cuerpo no va en la pila, que es pequeña (thread_stack_size)
+  char *body = (char *)malloc(STATUSBODYLEN);
+  if (!body)
+    return process_error(request, sendBuffer, cliConn, INTERNAL_SERVER_ERROR);
+  memset(&stats, 0, sizeof(stats));
+  pools_stats(&stats);
+  connection_memory(&memory);
+  long totalMemory = memory.connectionBytes + memory.requestBuffers * memory.requestBufferBytes;
+  bodyLen = sprintf(body,
+                    "max_clients: %ld\nconnection_limit: %ld\nconnections: %ld\npool_threads: %ld\n"
+                    "pool_busy_threads: %ld\npool_idle_threads: %ld\npool_batches: %ld\npool_queued_jobs: %ld\n"
+                    "pool_jobs_started: %ld\npool_jobs_completed: %ld\npool_jobs_stolen: %ld\n"
+                    "pool_batches_created: %ld\npool_batches_retired: %ld\npool_wait_us: %ld\npool_run_us: %ld\n",
+                    configParams.maxClients, limiter_limit(), limiter_in_use(), pool_threads(), stats.busyThreads,
+                    stats.idleThreads, stats.batches, stats.queuedJobs, stats.jobsStarted, stats.jobsCompleted,
+                    stats.jobsStolen, stats.batchesCreated, stats.batchesRetired, stats.waitTime, stats.runTime);
+  bodyLen += sprintf(body + bodyLen, "pool_wait_histogram:");
+  for (int i = 0; i < POOLSTATSBUCKETS; i++)
+    bodyLen += sprintf(body + bodyLen, " %ld", stats.waitHistogram[i]);
+  bodyLen += sprintf(body + bodyLen, "\npool_run_histogram:");
+  for (int i = 0; i < POOLSTATSBUCKETS; i++)
+    bodyLen += sprintf(body + bodyLen, " %ld", stats.runHistogram[i]);
+  bodyLen += sprintf(body + bodyLen,
+                     "\nthread_stack_bytes: %ld\nrequest_buffers: %ld\nrequest_buffers_in_use: %ld\n"
+                     "request_buffer_bytes: %ld\nconnection_bytes: %ld\nconnection_bytes_avg: %ld\nfibers: %ld\n",
+                     configParams.threadStackSize * 1024, memory.requestBuffers, memory.requestBuffersInUse,
+                     memory.requestBufferBytes, totalMemory, memory.connections > 0 ? totalMemory / memory.connections : 0,
+                     fibers_alive());
+
+  sendBufferLen = response_start_line(sendBuffer, request->minorVersion, OK);
+  sendBufferLen += date_header(sendBuffer + sendBufferLen);
+  sendBufferLen += server_header(sendBuffer + sendBufferLen);
+  sendBufferLen += connection_header(sendBuffer + sendBufferLen);
+  sendBufferLen += sprintf(sendBuffer + sendBufferLen, "Content-Length: %d\r\n", bodyLen);
+  sendBufferLen += content_type_header(sendBuffer + sendBufferLen, ".txt");
+  sendBufferLen += sprintf(sendBuffer + sendBufferLen, "Cache-Control: no-store\r\n\r\n%s", body);
+  free(body);
+
+  if (send_data(cliConn, -1, sendBuffer, sendBufferLen, NULL) < 0)
+    return -1;
+  return 0;
+}
+
+/********
+ * FUNCIÓN: int process_error(RequestContent *request, char *sendBuffer, ClientConnection *cliConn, HTTPResponseCode responseCode)
+ * ARGS_IN: RequestContent *request - Request con la inforacion a usar para responder
+ *          char *sendBuffer - Buffer con memoria reservada a completar y enviar
+ *          ClientConnection *cliConn - Conexion por la que enviar los datos
  *          HTTPResponseCode responseCode - Codigo http de respuesta a enviar
  * DESCRIPCIÓN: Función encargada enviar una respuesta dado un código de error.
  * ARGS_OUT: int - Devuelve -1 en caso de error, 0 en el resto de casos
  ********/
-int process_error(RequestContent *request, char *sendBuffer, int sockfd, HTTPResponseCode responseCode) {
-  char url[request->pathLen + 1]; // picohttpparser no crea nueva memoria
-  char filename[request->pathLen + 1 + strlen(configParams.baseFile) + strlen(configParams.rootPath)];
+int process_error(RequestContent *request, char *sendBuffer, ClientConnection *cliConn, HTTPResponseCode responseCode) {
   int sendBufferLen = 0, minorVersion = request->minorVersion;
   int retValue = 0;
 
   syslog(LOG_INFO, "Error in the request: %d", responseCode);
 
-  parse_url(request, url, filename);
   if (responseCode == HTTP_VER_NOT_SUPP)
     minorVersion = 1; /* Nuestra versión por defecto es 1.1 */
 
   sendBufferLen = response_start_line(sendBuffer, minorVersion, responseCode);
   sendBufferLen += date_header(sendBuffer + sendBufferLen);
   sendBufferLen += server_header(sendBuffer + sendBufferLen);
+  sendBufferLen += connection_header(sendBuffer + sendBufferLen);
   sendBufferLen += content_length_header(sendBuffer + sendBufferLen, NULL);
+  if (responseCode == SERVICE_UNAVAILABLE)
+    sendBufferLen += sprintf(sendBuffer + sendBufferLen, "Retry-After: %ld\r\n", configParams.overloadRetryAfter);
 
   /* El tipo por defecto en estos errores parece ser text/html */
   sendBufferLen += content_type_header(sendBuffer + sendBufferLen, ".html");
   sendBufferLen += sprintf(sendBuffer + sendBufferLen, "\r\n");
 
-  int writeRet = send_data(sockfd, -1, sendBuffer, sendBufferLen, NULL);
+  int writeRet = send_data(cliConn, -1, sendBuffer, sendBufferLen, NULL);
   if (writeRet < 0)
     retValue = -1;
 
@@ -0,0 +1,453 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                               *
+ *  event_loop_lib.c - Reactor con epoll (o io_uring) que        *
+ *                     entrega al pool solo las conexiones listas*
+ *                                                               *
+ *  Autores:                                                     *
+ *    - Bhavuk Sikka    (bhavuk.sikka@estudiante.uam.es)         *
+ *    - Samuel de Lucas (samuel.lucas@estudiante.uam.es)         *
+ *                                                               *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#define _GNU_SOURCE
+#include "../includes/event_loop_lib.h"
+#include "../includes/limiter_lib.h"
+#include "../includes/server.h"
+#include "../includes/thread_pool_lib.h"
+#include "../includes/uring_lib.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/syslog.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Descriptor del conjunto de epoll */
+static int epollfd = -1;
+/* Hilo que espera los eventos */
+static pthread_t loopThread;
+/* Variable que indica si el hilo del event loop debe terminar */
+static volatile u_int8_t stopLoop = 0x00;
+/* Variable que indica si el event loop esta en marcha */
+static u_int8_t loopRunning = 0x00;
+
+/* Backend io_uring: el ring compartido (las entradas se preparan bajo ringMutex,
+ * los completados solo los consume el hilo del event loop) */
+static URing loopRing;
+static pthread_mutex_t ringMutex = PTHREAD_MUTEX_INITIALIZER;
+/* Buffers que se entregan al kernel para que elija uno en cada recv */
+static char *providedBuffers = NULL;
+
+/* Tipo de operacion codificado en los bits bajos del user_data de cada entrada */
+#define OPRECV 0x1UL   // recv con buffer elegido por el kernel
+#define OPPOLLIN 0x2UL  // sin buffers libres: se espera a que haya datos
+#define OPPOLLOUT 0x3UL // esperando a poder escribir
+#define OPMASK 0x3UL
+/* user_data de las operaciones internas del ring */
+#define OPBUFFERS 0x8UL
+
+/* Lista de conexiones armadas en el event loop, que no pertenecen a ningun hilo.
+ * Al terminar se cierran las que sigan en ella (los timeouts los lleva la rueda de timers) */
+static ClientConnection *idleHead = NULL, *idleTail = NULL;
+static pthread_mutex_t idleMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/********
+ * FUNCIÓN: static void idle_unlink(ClientConnection *cliConn)
+ * ARGS_IN: ClientConnection *cliConn - Conexion a quitar de la lista
+ * DESCRIPCIÓN: Quita la conexion de la lista de espera. Se llama con idleMutex bloqueado
+ ********/
+static void idle_unlink(ClientConnection *cliConn) {
+  if (cliConn->idlePrev)
+    cliConn->idlePrev->idleNext = cliConn->idleNext;
+  else if (idleHead == cliConn)
+    idleHead = cliConn->idleNext;
+  else
+    return; // no estaba en la lista
+
+  if (cliConn->idleNext)
+    cliConn->idleNext->idlePrev = cliConn->idlePrev;
+  else
+    idleTail = cliConn->idlePrev;
+
+  cliConn->idlePrev = cliConn->idleNext = NULL;
+}
+
+/********
+ * FUNCIÓN: static void close_idle_connection(ClientConnection *cliConn)
+ * ARGS_IN: ClientConnection *cliConn - Conexion a cerrar
+ * DESCRIPCIÓN: Cierra una conexion que no pertenece a ningun hilo y libera sus recursos
+ ********/
+static void close_idle_connection(ClientConnection *cliConn) {
+  free_thread_resources(&cliConn);
+  limiter_release();
+}
+
+/********
+ * FUNCIÓN: static void *event_loop(void *args)
+ * ARGS_IN: void *args - No usado
+ * DESCRIPCIÓN: Espera eventos sobre las conexiones y las entrega al pool de hilos
+ * ARGS_OUT: void * - No devuelve informacion util. NULL
+ ********/
+static void *event_loop(void *args) {
+  struct epoll_event events[EVENTLOOPMAXEVENTS];
+
+  while (!stopLoop) {
+    int numEvents = epoll_wait(epollfd, events, EVENTLOOPMAXEVENTS, -1);
+    if (numEvents < 0) {
+      if (errno == EINTR)
+        continue;
+      syslog(LOG_ERR, "Error in epoll_wait. Stopping event loop");
+      break;
+    }
+
+    for (int i = 0; i < numEvents; i++) {
+      ClientConnection *cliConn = (ClientConnection *)events[i].data.ptr;
+      pthread_mutex_lock(&idleMutex);
+      idle_unlink(cliConn);
+      pthread_mutex_unlock(&idleMutex);
+
+      // Con EPOLLONESHOT la conexion queda desarmada hasta que el hilo la vuelva a armar
+      if (add_job(cliConn->pool, (void *)cliConn) == -1) {
+        syslog(LOG_ERR, "Error adding a job from the event loop");
+        close_idle_connection(cliConn);
+      }
+    }
+  }
+  return NULL;
+}
+
+/********
+ * FUNCIÓN: static void provide_buffer(int bid)
+ * ARGS_IN: int bid - Identificador del buffer a devolver
+ * DESCRIPCIÓN: Devuelve al kernel un buffer ya consumido. Se llama con ringMutex bloqueado
+ ********/
+static void provide_buffer(int bid) {
+  struct io_uring_sqe *sqe = uring_get_sqe(&loopRing);
+  if (!sqe) {
+    uring_submit(&loopRing, 0);
+    sqe = uring_get_sqe(&loopRing);
+    if (!sqe)
+      return;
+  }
+  sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+  sqe->fd = 1;
+  sqe->addr = (unsigned long)(providedBuffers + (size_t)bid * configParams.recvBufferLen);
+  sqe->len = configParams.recvBufferLen;
+  sqe->off = bid;
+  sqe->buf_group = EVENTLOOPBUFFERGROUP;
+  sqe->user_data = OPBUFFERS;
+}
+
+/********
+ * FUNCIÓN: static int uring_arm(ClientConnection *cliConn, unsigned long op)
+ * ARGS_IN: ClientConnection *cliConn - Conexion a armar
+ *          unsigned long op - OPRECV, OPPOLLIN u OPPOLLOUT
+ * DESCRIPCIÓN: Prepara y envia la peticion de la conexion en el ring del event loop
+ * ARGS_OUT: int - Devuelve 0 en caso de exito, -1 en caso de error
+ ********/
+static int uring_arm(ClientConnection *cliConn, unsigned long op) {
+  pthread_mutex_lock(&ringMutex);
+  struct io_uring_sqe *sqe = uring_get_sqe(&loopRing);
+  if (!sqe) {
+    uring_submit(&loopRing, 0);
+    sqe = uring_get_sqe(&loopRing);
+  }
+  if (!sqe) {
+    pthread_mutex_unlock(&ringMutex);
+    return -1;
+  }
+
+  sqe->fd = cliConn->connfd;
+  sqe->user_data = (unsigned long)cliConn | op;
+  if (op == OPRECV) {
+    // El kernel elige el buffer solo cuando llegan datos: las conexiones en espera no ocupan memoria
+    long space = configParams.recvBufferLen - cliConn->recvLen - cliConn->readyLen;
+    sqe->opcode = IORING_OP_RECV;
+    sqe->len = space;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = EVENTLOOPBUFFERGROUP;
+  } else {
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->poll32_events = op == OPPOLLOUT ? POLLOUT : POLLIN;
+  }
+
+  int ret = uring_submit(&loopRing, 0);
+  pthread_mutex_unlock(&ringMutex);
+  return ret < 0 ? -1 : 0;
+}
+
+/********
+ * FUNCIÓN: static void uring_dispatch(ClientConnection *cliConn)
+ * ARGS_IN: ClientConnection *cliConn - Conexion lista
+ * DESCRIPCIÓN: Entrega al pool una conexion cuya peticion del ring se ha completado
+ ********/
+static void uring_dispatch(ClientConnection *cliConn) {
+  if (add_job(cliConn->pool, (void *)cliConn) == -1) {
+    syslog(LOG_ERR, "Error adding a job from the event loop");
+    close_idle_connection(cliConn);
+  }
+}
+
+/********
+ * FUNCIÓN: static void uring_recv_completed(ClientConnection *cliConn, struct io_uring_cqe *cqe)
+ * ARGS_IN: ClientConnection *cliConn - Conexion cuyo recv se ha completado
+ *          struct io_uring_cqe *cqe - Completado del recv
+ * DESCRIPCIÓN: Copia los datos del buffer elegido por el kernel al buffer de la conexion,
+ *              devuelve el buffer al kernel y entrega la conexion al pool
+ ********/
+static void uring_recv_completed(ClientConnection *cliConn, struct io_uring_cqe *cqe) {
+  if (cqe->res == -ENOBUFS) {
+    // Todos los buffers ocupados: se espera a que haya datos y el hilo hara el recv
+    if (uring_arm(cliConn, OPPOLLIN) == -1)
+      close_idle_connection(cliConn);
+    return;
+  }
+  if (cqe->res <= 0) {
+    // El cliente ha cerrado, o el socket se ha cerrado por inactividad
+    close_idle_connection(cliConn);
+    return;
+  }
+
+  int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+  char *data = providedBuffers + (size_t)bid * configParams.recvBufferLen;
+  if (!cliConn->freeVar)
+    cliConn->freeVar = connection_alloc(configParams.recvBufferLen + 1);
+  if (cliConn->freeVar) {
+    memcpy((char *)cliConn->freeVar + cliConn->recvLen + cliConn->readyLen, data, cqe->res);
+    cliConn->readyLen += cqe->res;
+  }
+
+  pthread_mutex_lock(&ringMutex);
+  provide_buffer(bid);
+  pthread_mutex_unlock(&ringMutex);
+
+  if (!cliConn->freeVar) {
+    syslog(LOG_ERR, "Error allocating buffer. Client not managed.");
+    close_idle_connection(cliConn);
+    return;
+  }
+  uring_dispatch(cliConn);
+}
+
+/********
+ * FUNCIÓN: static void *uring_event_loop(void *args)
+ * ARGS_IN: void *args - No usado
+ * DESCRIPCIÓN: Recoge los completados del ring y entrega las conexiones al pool
+ * ARGS_OUT: void * - No devuelve informacion util. NULL
+ ********/
+static void *uring_event_loop(void *args) {
+  while (!stopLoop) {
+    pthread_mutex_lock(&ringMutex);
+    // Se envian de una vez los buffers devueltos en la vuelta anterior
+    uring_submit(&loopRing, 0);
+    pthread_mutex_unlock(&ringMutex);
+
+    if (uring_wait_events(&loopRing, 1) == -1 && errno != EINTR) {
+      syslog(LOG_ERR, "Error in io_uring_enter. Stopping event loop");
+      break;
+    }
+
+    struct io_uring_cqe *cqe;
+    while (!stopLoop && (cqe = uring_peek_cqe(&loopRing))) {
+      struct io_uring_cqe completed = *cqe;
+      uring_cqe_seen(&loopRing);
+
+      if (completed.user_data == OPBUFFERS) {
+        if (completed.res < 0)
+          syslog(LOG_ERR, "Error providing buffers to io_uring");
+        continue;
+      }
+
+      ClientConnection *cliConn = (ClientConnection *)(completed.user_data & ~OPMASK);
+      pthread_mutex_lock(&idleMutex);
+      idle_unlink(cliConn);
+      pthread_mutex_unlock(&idleMutex);
+
+      if ((completed.user_data & OPMASK) == OPRECV)
+        uring_recv_completed(cliConn, &completed);
+      else
+        uring_dispatch(cliConn);
+    }
+  }
+  return NULL;
+}
+
+/********
+ * FUNCIÓN: static int initialize_uring_event_loop()
+ * DESCRIPCIÓN: Crea el ring del event loop y le entrega los buffers de recepcion
+ * ARGS_OUT: int - Devuelve 0 en caso de exito, -1 en caso de error
+ ********/
+static int initialize_uring_event_loop() {
+  if (uring_init(&loopRing, EVENTLOOPMAXEVENTS) == -1) {
+    syslog(LOG_ERR, "Error creating io_uring ring");
+    return -1;
+  }
+  providedBuffers = (char *)malloc((size_t)EVENTLOOPBUFFERS * configParams.recvBufferLen);
+  if (!providedBuffers) {
+    uring_free(&loopRing);
+    return -1;
+  }
+
+  struct io_uring_sqe *sqe = uring_get_sqe(&loopRing);
+  sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+  sqe->fd = EVENTLOOPBUFFERS;
+  sqe->addr = (unsigned long)providedBuffers;
+  sqe->len = configParams.recvBufferLen;
+  sqe->off = 0;
+  sqe->buf_group = EVENTLOOPBUFFERGROUP;
+  sqe->user_data = OPBUFFERS;
+
+  struct io_uring_cqe *cqe = uring_wait_cqe(&loopRing);
+  if (!cqe || cqe->res < 0) {
+    syslog(LOG_ERR, "Error providing buffers to io_uring");
+    uring_free(&loopRing);
+    free(providedBuffers);
+    providedBuffers = NULL;
+    return -1;
+  }
+  uring_cqe_seen(&loopRing);
+  return 0;
+}
+
+/********
+ * FUNCIÓN: static void release_event_loop()
+ * DESCRIPCIÓN: Cierra el conjunto de epoll o el ring, y libera los buffers de recepcion
+ ********/
+static void release_event_loop() {
+  if (epollfd >= 0) {
+    close(epollfd);
+    epollfd = -1;
+  }
+  uring_free(&loopRing);
+  if (providedBuffers) {
+    free(providedBuffers);
+    providedBuffers = NULL;
+  }
+}
+
+/********
+ * FUNCIÓN: int initialize_event_loop()
+ * DESCRIPCIÓN: Crea el conjunto de epoll (o el ring de io_uring) y el hilo que espera
+ *              eventos en él. Cada conexion que se vuelve legible o escribible se entrega
+ *              al pool de hilos con add_job. Con io_uring el propio ring hace el recv
+ *              sobre buffers compartidos y la conexion llega al pool con los datos ya leidos
+ * ARGS_OUT: int - Devuelve 0 en caso de exito, -1 en caso de error
+ ********/
+int initialize_event_loop() {
+  if (configParams.ioBackend == IO_URING) {
+    if (initialize_uring_event_loop() == -1)
+      return -1;
+  } else {
+    epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if (epollfd < 0) {
+      syslog(LOG_ERR, "Error creating epoll set");
+      return -1;
+    }
+  }
+
+  stopLoop = 0x00;
+  if (pthread_create(&loopThread, NULL, configParams.ioBackend == IO_URING ? uring_event_loop : event_loop, NULL)) {
+    syslog(LOG_ERR, "Error creating event loop thread");
+    release_event_loop();
+    return -1;
+  }
+  loopRunning = 0x01;
+  return 0;
+}
+
+/********
+ * FUNCIÓN: int event_loop_watch(ClientConnection *cliConn, int writable)
+ * ARGS_IN: ClientConnection *cliConn - Conexion a vigilar
+ *          int writable - 0 para esperar datos del cliente, 1 para esperar a poder escribir
+ * DESCRIPCIÓN: Arma la conexion en el event loop (edge-triggered y oneshot).
+ *              Tras llamar a esta función el hilo no debe volver a tocar cliConn,
+ *              pues otro hilo puede estar atendiendola ya
+ * ARGS_OUT: int - Devuelve 0 en caso de exito, -1 en caso de error
+ ********/
+int event_loop_watch(ClientConnection *cliConn, int writable) {
+  struct epoll_event event;
+  int op = cliConn->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+
+  event.events = (writable ? EPOLLOUT : EPOLLIN) | EPOLLRDHUP | EPOLLET | EPOLLONESHOT;
+  event.data.ptr = cliConn;
+
+  // Se inserta antes de armar: una vez armada, el event loop puede sacarla en cualquier momento
+  pthread_mutex_lock(&idleMutex);
+  cliConn->idlePrev = idleTail;
+  cliConn->idleNext = NULL;
+  if (idleTail)
+    idleTail->idleNext = cliConn;
+  else
+    idleHead = cliConn;
+  idleTail = cliConn;
+  pthread_mutex_unlock(&idleMutex);
+
+  if (configParams.ioBackend == IO_URING) {
+    if (uring_arm(cliConn, writable ? OPPOLLOUT : OPRECV) == 0)
+      return 0;
+    syslog(LOG_ERR, "Error adding connection to io_uring");
+    pthread_mutex_lock(&idleMutex);
+    idle_unlink(cliConn);
+    pthread_mutex_unlock(&idleMutex);
+    return -1;
+  }
+
+  cliConn->registered = 0x01;
+  if (epoll_ctl(epollfd, op, cliConn->connfd, &event) == -1) {
+    syslog(LOG_ERR, "Error adding connection to epoll set");
+    pthread_mutex_lock(&idleMutex);
+    idle_unlink(cliConn);
+    pthread_mutex_unlock(&idleMutex);
+    return -1;
+  }
+  return 0;
+}
+
+/********
+ * FUNCIÓN: void stop_event_loop()
+ * DESCRIPCIÓN: Detiene el hilo del event loop. Despues de esta llamada
+ *              no se entregan mas trabajos al pool
+ ********/
+void stop_event_loop() {
+  struct timespec deadline;
+
+  if (!loopRunning)
+    return;
+  stopLoop = 0x01;
+  // SIGUSR1 interrumpe epoll_wait/io_uring_enter. Se repite porque la señal puede llegar
+  // justo despues de comprobar stopLoop y antes de que el hilo se bloquee
+  do {
+    pthread_kill(loopThread, SIGUSR1);
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += 100 * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+  } while (pthread_timedjoin_np(loopThread, NULL, &deadline) == ETIMEDOUT);
+  loopRunning = 0x00;
+}
+
+/********
+ * FUNCIÓN: void terminate_event_loop()
+ * DESCRIPCIÓN: Cierra las conexiones que seguian en espera y libera el conjunto de epoll o el ring.
+ *              Se debe llamar despues de terminate_pool
+ ********/
+void terminate_event_loop() {
+  // Primero se cierra el ring, que cancela las peticiones que apuntan a las conexiones
+  release_event_loop();
+
+  pthread_mutex_lock(&idleMutex);
+  while (idleHead) {
+    ClientConnection *cliConn = idleHead;
+    idle_unlink(cliConn);
+    close_idle_connection(cliConn);
+  }
+  pthread_mutex_unlock(&idleMutex);
+}
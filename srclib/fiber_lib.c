@@ -0,0 +1,677 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                               *
+ *  fiber_lib.c - Fibras (corrutinas con pila propia) sobre      *
+ *                unos pocos hilos planificadores con epoll      *
+ *                                                               *
+ *  Autores:                                                     *
+ *    - Bhavuk Sikka    (bhavuk.sikka@estudiante.uam.es)         *
+ *    - Samuel de Lucas (samuel.lucas@estudiante.uam.es)         *
+ *                                                               *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#define _GNU_SOURCE
+#include "../includes/fiber_lib.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/syslog.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#if !defined(__x86_64__)
+#include <ucontext.h>
+#endif
+
+/* Pila de las fibras si no se indica otra */
+#define FIBERDEFAULTSTACK (256 * 1024)
+
+typedef struct Scheduler Scheduler;
+
+/* Fibra. Se guarda al final de su propia pila, asi que crear una fibra solo reserva la pila */
+typedef struct Fiber {
+#if defined(__x86_64__)
+  void *sp; // puntero de pila guardado al salir de la fibra
+#else
+  ucontext_t context;
+#endif
+  void *(*function)(void *);
+  void *arg;
+  void *stack;          // inicio del mapeo de la pila (con la pagina de guarda)
+  Scheduler *scheduler; // planificador que la ejecuta, siempre el mismo
+  int watchedFd;        // ultimo descriptor que ha registrado en el epoll del planificador
+  u_int8_t finished;
+  struct Fiber *next;                  // cola de fibras listas o de fibras nuevas
+  struct Fiber *prevAlive, *nextAlive; // fibras del planificador que no han terminado
+} Fiber;
+
+/* Planificador: un hilo que ejecuta sus fibras listas y espera en su epoll a las demas */
+struct Scheduler {
+  pthread_t thread;
+  int epfd;
+  int wakefd; // eventfd con el que fiber_spawn despierta al planificador
+  int cpu;    // CPU a la que esta fijado (-1 si no)
+#if defined(__x86_64__)
+  void *sp; // puntero de pila del bucle del planificador mientras se ejecuta una fibra
+#else
+  ucontext_t context;
+#endif
+  /* Solo los usa el hilo del planificador */
+  Fiber *readyHead, *readyTail;
+  Fiber *alive;
+  /* Fibras nuevas y pilas para reutilizar, que tambien tocan los hilos que llaman a fiber_spawn */
+  pthread_mutex_t mutex;
+  Fiber *newHead, *newTail;
+  void *stackCache[FIBERSTACKCACHE];
+  int numCached;
+  volatile u_int8_t stop;
+} __attribute__((aligned(64)));
+
+static Scheduler *schedulers = NULL;
+static int numSchedulers = 0;
+/* Planificador fijado a cada CPU (-1 si no hay) */
+static int cpuScheduler[CPU_SETSIZE];
+static unsigned long nextScheduler = 0;
+/* Bytes de cada mapeo de pila (pagina de guarda y Fiber incluidas) */
+static size_t stackMapSize = 0, pageSize = 0;
+static void (*cleanup_function)(void *) = NULL;
+static long aliveFibers = 0;
+static __thread Fiber *currentFiber = NULL;
+
+#if defined(__x86_64__)
+/* Cambio de contexto: guarda en la pila actual los registros que la ABI obliga a conservar
+ * (y los registros de control de la FPU), guarda el puntero de pila en *saveSp y sigue por la
+ * pila newSp, donde la otra parte hizo lo mismo. Sin llamadas al sistema, a diferencia de
+ * swapcontext, que cambia la mascara de señales */
+void fiber_switch_context(void **saveSp, void *newSp) __attribute__((visibility("hidden")));
+__asm__(".text\n"
+        ".globl fiber_switch_context\n"
+        ".hidden fiber_switch_context\n"
+        ".type fiber_switch_context, @function\n"
+        "fiber_switch_context:\n"
+        "  pushq %rbp\n"
+        "  pushq %rbx\n"
+        "  pushq %r12\n"
+        "  pushq %r13\n"
+        "  pushq %r14\n"
+        "  pushq %r15\n"
+        "  subq $8, %rsp\n"
+        "  stmxcsr (%rsp)\n"
+        "  fnstcw 4(%rsp)\n"
+        "  movq %rsp, (%rdi)\n"
+        "  movq %rsi, %rsp\n"
+        "  ldmxcsr (%rsp)\n"
+        "  fldcw 4(%rsp)\n"
+        "  addq $8, %rsp\n"
+        "  popq %r15\n"
+        "  popq %r14\n"
+        "  popq %r13\n"
+        "  popq %r12\n"
+        "  popq %rbx\n"
+        "  popq %rbp\n"
+        "  ret\n"
+        ".size fiber_switch_context, .-fiber_switch_context\n");
+#endif
+
+/********
+ * FUNCIÓN: static void enter_fiber(Scheduler *sched, Fiber *fiber)
+ * ARGS_IN: Scheduler *sched - Planificador que llama
+ *          Fiber *fiber - Fibra a ejecutar
+ * DESCRIPCIÓN: Pasa a ejecutar la fibra hasta que espera, cede o termina
+ ********/
+static void enter_fiber(Scheduler *sched, Fiber *fiber) {
+#if defined(__x86_64__)
+  fiber_switch_context(&sched->sp, fiber->sp);
+#else
+  swapcontext(&sched->context, &fiber->context);
+#endif
+}
+
+/********
+ * FUNCIÓN: static void leave_fiber(Fiber *fiber)
+ * ARGS_IN: Fiber *fiber - Fibra en ejecucion
+ * DESCRIPCIÓN: Vuelve al bucle del planificador. La fibra sigue aqui cuando se la vuelve a ejecutar
+ ********/
+static void leave_fiber(Fiber *fiber) {
+#if defined(__x86_64__)
+  fiber_switch_context(&fiber->sp, fiber->scheduler->sp);
+#else
+  swapcontext(&fiber->context, &fiber->scheduler->context);
+#endif
+}
+
+/********
+ * FUNCIÓN: static void fiber_entry()
+ * DESCRIPCIÓN: Primera funcion de cada fibra: ejecuta su funcion y la marca como terminada
+ *              para que el planificador libere la pila. Nunca vuelve
+ ********/
+static void fiber_entry() {
+  Fiber *fiber = currentFiber;
+  fiber->function(fiber->arg);
+  fiber->finished = 0x01;
+  leave_fiber(fiber);
+}
+
+/********
+ * FUNCIÓN: static int prepare_fiber(Fiber *fiber)
+ * ARGS_IN: Fiber *fiber - Fibra nueva, al final de su pila
+ * DESCRIPCIÓN: Prepara la pila para que el primer cambio de contexto empiece en fiber_entry
+ * ARGS_OUT: int - Devuelve 0 en caso de exito, -1 en caso de error
+ ********/
+static int prepare_fiber(Fiber *fiber) {
+#if defined(__x86_64__)
+  void **sp = (void **)((uintptr_t)fiber & ~(uintptr_t)15);
+  *--sp = NULL;                 // direccion de retorno de fiber_entry, que nunca vuelve
+  *--sp = (void *)fiber_entry;  // el ret de fiber_switch_context salta aqui
+  for (int i = 0; i < 6; i++)
+    *--sp = NULL;               // rbp, rbx, r12-r15
+  *--sp = (void *)(0x1F80UL | (0x037FUL << 32)); // MXCSR y control de la x87 por defecto
+  fiber->sp = sp;
+  return 0;
+#else
+  if (getcontext(&fiber->context) == -1)
+    return -1;
+  fiber->context.uc_stack.ss_sp = (char *)fiber->stack + pageSize;
+  fiber->context.uc_stack.ss_size = (char *)fiber - ((char *)fiber->stack + pageSize);
+  fiber->context.uc_link = NULL;
+  makecontext(&fiber->context, fiber_entry, 0);
+  return 0;
+#endif
+}
+
+/********
+ * FUNCIÓN: static void push_ready(Scheduler *sched, Fiber *fiber)
+ * ARGS_IN: Scheduler *sched - Planificador de la fibra
+ *          Fiber *fiber - Fibra lista para ejecutarse
+ * DESCRIPCIÓN: Añade la fibra al final de la cola de listas. Solo la llama el hilo del planificador
+ ********/
+static void push_ready(Scheduler *sched, Fiber *fiber) {
+  fiber->next = NULL;
+  if (sched->readyTail)
+    sched->readyTail->next = fiber;
+  else
+    sched->readyHead = fiber;
+  sched->readyTail = fiber;
+}
+
+/********
+ * FUNCIÓN: static void release_stack(Scheduler *sched, void *stack)
+ * ARGS_IN: Scheduler *sched - Planificador
+ *          void *stack - Mapeo de la pila de una fibra que ya no se ejecuta
+ * DESCRIPCIÓN: Guarda la pila para otra fibra o, si ya hay FIBERSTACKCACHE, la libera
+ ********/
+static void release_stack(Scheduler *sched, void *stack) {
+  pthread_mutex_lock(&sched->mutex);
+  if (sched->numCached < FIBERSTACKCACHE) {
+    sched->stackCache[sched->numCached++] = stack;
+    stack = NULL;
+  }
+  pthread_mutex_unlock(&sched->mutex);
+  if (stack)
+    munmap(stack, stackMapSize);
+}
+
+/********
+ * FUNCIÓN: static void take_new_fibers(Scheduler *sched)
+ * ARGS_IN: Scheduler *sched - Planificador
+ * DESCRIPCIÓN: Pasa a la cola de listas las fibras creadas con fiber_spawn. Sus pilas se tocan
+ *              por primera vez aqui, asi que quedan en el nodo NUMA del planificador
+ ********/
+static void take_new_fibers(Scheduler *sched) {
+  pthread_mutex_lock(&sched->mutex);
+  Fiber *fiber = sched->newHead;
+  sched->newHead = sched->newTail = NULL;
+  pthread_mutex_unlock(&sched->mutex);
+
+  while (fiber) {
+    Fiber *next = fiber->next;
+    if (prepare_fiber(fiber) == -1) {
+      syslog(LOG_ERR, "Error preparing fiber");
+      cleanup_function(&fiber->arg);
+      __atomic_sub_fetch(&aliveFibers, 1, __ATOMIC_RELAXED);
+      release_stack(sched, fiber->stack);
+    } else {
+      fiber->nextAlive = sched->alive;
+      if (sched->alive)
+        sched->alive->prevAlive = fiber;
+      sched->alive = fiber;
+      push_ready(sched, fiber);
+    }
+    fiber = next;
+  }
+}
+
+/********
+ * FUNCIÓN: static void run_fiber(Scheduler *sched, Fiber *fiber)
+ * ARGS_IN: Scheduler *sched - Planificador
+ *          Fiber *fiber - Fibra lista
+ * DESCRIPCIÓN: Ejecuta la fibra hasta que espera, cede o termina. Si termina libera su pila
+ ********/
+static void run_fiber(Scheduler *sched, Fiber *fiber) {
+  currentFiber = fiber;
+  enter_fiber(sched, fiber);
+  currentFiber = NULL;
+  if (!fiber->finished)
+    return;
+
+  if (fiber->prevAlive)
+    fiber->prevAlive->nextAlive = fiber->nextAlive;
+  else
+    sched->alive = fiber->nextAlive;
+  if (fiber->nextAlive)
+    fiber->nextAlive->prevAlive = fiber->prevAlive;
+  __atomic_sub_fetch(&aliveFibers, 1, __ATOMIC_RELAXED);
+  release_stack(sched, fiber->stack);
+}
+
+/********
+ * FUNCIÓN: static void *scheduler_loop(void *args)
+ * ARGS_IN: void *args - Planificador (Scheduler *)
+ * DESCRIPCIÓN: Bucle del planificador: ejecuta una vez cada fibra lista y espera en epoll a que
+ *              los descriptores de las fibras aparcadas esten listos (sin esperar si quedan listas)
+ * ARGS_OUT: void * - No devuelve informacion util. NULL
+ ********/
+static void *scheduler_loop(void *args) {
+  Scheduler *sched = (Scheduler *)args;
+  struct epoll_event events[FIBEREVENTS];
+
+  while (!sched->stop) {
+    take_new_fibers(sched);
+
+    // Solo las que ya estaban listas: las que ceden ahora se ejecutan tras mirar el epoll
+    Fiber *last = sched->readyTail;
+    while (sched->readyHead) {
+      Fiber *fiber = sched->readyHead;
+      sched->readyHead = fiber->next;
+      if (!sched->readyHead)
+        sched->readyTail = NULL;
+      run_fiber(sched, fiber);
+      if (fiber == last)
+        break;
+    }
+
+    int numEvents = epoll_wait(sched->epfd, events, FIBEREVENTS, sched->readyHead ? 0 : -1);
+    for (int i = 0; i < numEvents; i++) {
+      if (events[i].data.ptr) {
+        push_ready(sched, (Fiber *)events[i].data.ptr);
+      } else {
+        uint64_t value;
+        if (read(sched->wakefd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+          syslog(LOG_ERR, "Error reading fiber scheduler eventfd");
+      }
+    }
+  }
+  return NULL;
+}
+
+/********
+ * FUNCIÓN: static int start_scheduler(Scheduler *sched, int cpu)
+ * ARGS_IN: Scheduler *sched - Planificador (a 0)
+ *          int cpu - CPU a la que se fija su hilo (-1 para no fijarlo)
+ * DESCRIPCIÓN: Crea el epoll y el eventfd del planificador y arranca su hilo
+ * ARGS_OUT: int - Devuelve 0 en caso de exito, -1 en caso de error
+ ********/
+static int start_scheduler(Scheduler *sched, int cpu) {
+  struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+
+  sched->cpu = cpu;
+  sched->epfd = epoll_create1(EPOLL_CLOEXEC);
+  sched->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (sched->epfd < 0 || sched->wakefd < 0 || epoll_ctl(sched->epfd, EPOLL_CTL_ADD, sched->wakefd, &event) == -1) {
+    if (sched->epfd >= 0)
+      close(sched->epfd);
+    if (sched->wakefd >= 0)
+      close(sched->wakefd);
+    return -1;
+  }
+  pthread_mutex_init(&sched->mutex, NULL);
+
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  if (cpu >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu, &cpus);
+    pthread_attr_setaffinity_np(&attr, sizeof(cpus), &cpus);
+  }
+  int ret = pthread_create(&sched->thread, &attr, scheduler_loop, sched);
+  pthread_attr_destroy(&attr);
+  if (ret) {
+    pthread_mutex_destroy(&sched->mutex);
+    close(sched->epfd);
+    close(sched->wakefd);
+    return -1;
+  }
+  return 0;
+}
+
+/********
+ * FUNCIÓN: int initialize_fibers(int numThreads, int pinned, size_t stackSize, void (*cleanup_fun)(void *))
+ * ARGS_IN: int numThreads - Hilos planificadores (0 = uno por CPU)
+ *          int pinned - Si es 1 se crea un planificador fijado a cada CPU permitida (numThreads no se usa)
+ *          size_t stackSize - Bytes de pila de cada fibra (sin contar la pagina de guarda)
+ *          void (*cleanup_fun)(void *) - Funcion que se llama, al terminar, con un puntero al
+ *                                        argumento de cada fibra que no ha acabado (como en el pool)
+ * DESCRIPCIÓN: Crea los planificadores de fibras (M:N): cada uno es un hilo con su epoll que
+ *              ejecuta fibras hasta que se bloquean en una de las funciones fiber_* y entonces
+ *              pasa a otra. Una fibra se queda siempre en el planificador en el que empieza
+ * ARGS_OUT: int - Devuelve 0 en caso de exito, -1 en caso de error
+ ********/
+int initialize_fibers(int numThreads, int pinned, size_t stackSize, void (*cleanup_fun)(void *)) {
+  cpu_set_t allowed;
+  int cpu = -1;
+
+  pageSize = sysconf(_SC_PAGESIZE);
+  if (stackSize == 0)
+    stackSize = FIBERDEFAULTSTACK;
+  // Pagina de guarda al principio (la pila crece hacia abajo) y Fiber al final
+  stackMapSize = pageSize + (stackSize + sizeof(Fiber) + pageSize - 1) / pageSize * pageSize;
+  cleanup_function = cleanup_fun;
+
+  if (pinned && (sched_getaffinity(0, sizeof(allowed), &allowed) == -1 || CPU_COUNT(&allowed) == 0))
+    pinned = 0;
+  if (pinned)
+    numThreads = CPU_COUNT(&allowed);
+  else if (numThreads <= 0)
+    numThreads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (numThreads < 1)
+    numThreads = 1;
+
+  for (int i = 0; i < CPU_SETSIZE; i++)
+    cpuScheduler[i] = -1;
+  schedulers = (Scheduler *)aligned_alloc(64, numThreads * sizeof(Scheduler));
+  if (!schedulers)
+    return -1;
+  memset(schedulers, 0, numThreads * sizeof(Scheduler));
+
+  for (int i = 0; i < numThreads; i++) {
+    if (pinned) {
+      do {
+        cpu++;
+      } while (!CPU_ISSET(cpu, &allowed));
+    }
+    if (start_scheduler(&schedulers[i], cpu) == -1) {
+      syslog(LOG_ERR, "Error creating fiber scheduler");
+      terminate_fibers();
+      return -1;
+    }
+    numSchedulers++;
+    if (cpu >= 0)
+      cpuScheduler[cpu] = i;
+  }
+  syslog(LOG_INFO, "Started %d fiber schedulers (%zuKB stacks)", numSchedulers, stackSize / 1024);
+  return 0;
+}
+
+/********
+ * FUNCIÓN: int fiber_spawn(void *(*fun)(void *), void *arg, int cpu)
+ * ARGS_IN: void *(*fun)(void *) - Funcion que ejecuta la fibra
+ *          void *arg - Argumento de la funcion
+ *          int cpu - CPU cuyo planificador ejecuta la fibra (-1, o si no hay planificador fijado
+ *                    a esa CPU, se reparten entre todos)
+ * DESCRIPCIÓN: Crea una fibra con su propia pila (mmap, con pagina de guarda). Se puede llamar
+ *              desde cualquier hilo
+ * ARGS_OUT: int - Devuelve 0 en caso de exito, -1 en caso de error
+ ********/
+int fiber_spawn(void *(*fun)(void *), void *arg, int cpu) {
+  Scheduler *sched;
+  void *stack = NULL;
+
+  if (numSchedulers == 0)
+    return -1;
+  if (cpu >= 0 && cpu < CPU_SETSIZE && cpuScheduler[cpu] >= 0)
+    sched = &schedulers[cpuScheduler[cpu]];
+  else
+    sched = &schedulers[__atomic_fetch_add(&nextScheduler, 1, __ATOMIC_RELAXED) % numSchedulers];
+
+  pthread_mutex_lock(&sched->mutex);
+  if (sched->numCached > 0)
+    stack = sched->stackCache[--sched->numCached];
+  pthread_mutex_unlock(&sched->mutex);
+  if (!stack) {
+    stack = mmap(NULL, stackMapSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (stack == MAP_FAILED)
+      return -1;
+    // Un desbordamiento de la pila da SIGSEGV en vez de pisar la memoria de otra fibra
+    if (mprotect(stack, pageSize, PROT_NONE) == -1) {
+      munmap(stack, stackMapSize);
+      return -1;
+    }
+  }
+
+  Fiber *fiber = (Fiber *)(((uintptr_t)stack + stackMapSize - sizeof(Fiber)) & ~(uintptr_t)63);
+  memset(fiber, 0, sizeof(Fiber));
+  fiber->function = fun;
+  fiber->arg = arg;
+  fiber->stack = stack;
+  fiber->scheduler = sched;
+  fiber->watchedFd = -1;
+  __atomic_add_fetch(&aliveFibers, 1, __ATOMIC_RELAXED);
+
+  pthread_mutex_lock(&sched->mutex);
+  if (sched->newTail)
+    sched->newTail->next = fiber;
+  else
+    sched->newHead = fiber;
+  sched->newTail = fiber;
+  pthread_mutex_unlock(&sched->mutex);
+
+  uint64_t one = 1;
+  if (write(sched->wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+    syslog(LOG_ERR, "Error waking fiber scheduler");
+  return 0;
+}
+
+/********
+ * FUNCIÓN: int in_fiber()
+ * DESCRIPCIÓN: Indica si el codigo se esta ejecutando en una fibra
+ * ARGS_OUT: int - 1 si se ejecuta en una fibra, 0 si no
+ ********/
+int in_fiber() { return currentFiber != NULL; }
+
+/********
+ * FUNCIÓN: void fiber_yield()
+ * DESCRIPCIÓN: Cede el planificador a las demas fibras listas; la fibra sigue despues de ellas.
+ *              Fuera de una fibra no hace nada
+ ********/
+void fiber_yield() {
+  Fiber *fiber = currentFiber;
+  if (!fiber)
+    return;
+  push_ready(fiber->scheduler, fiber);
+  leave_fiber(fiber);
+}
+
+/********
+ * FUNCIÓN: int fiber_wait(int fd, int events)
+ * ARGS_IN: int fd - Descriptor a esperar
+ *          int events - POLLIN y/o POLLOUT
+ * DESCRIPCIÓN: Espera a que el descriptor este listo. En una fibra la aparca en el epoll de su
+ *              planificador, que mientras tanto ejecuta otras. Fuera de una fibra usa poll
+ * ARGS_OUT: int - Devuelve 0 cuando el descriptor esta listo (o cerrado), -1 en caso de error
+ ********/
+int fiber_wait(int fd, int events) {
+  Fiber *fiber = currentFiber;
+
+  if (!fiber) {
+    struct pollfd pfd = {fd, events, 0};
+    while (poll(&pfd, 1, -1) == -1) {
+      if (errno != EINTR)
+        return -1;
+    }
+    return 0;
+  }
+
+  // EPOLLONESHOT: cada espera recibe un solo evento, y el descriptor queda desactivado hasta la siguiente
+  struct epoll_event event;
+  event.events = EPOLLONESHOT | ((events & POLLIN) ? EPOLLIN | EPOLLRDHUP : 0) | ((events & POLLOUT) ? EPOLLOUT : 0);
+  event.data.ptr = fiber;
+  int op = fd == fiber->watchedFd ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+  if (epoll_ctl(fiber->scheduler->epfd, op, fd, &event) == -1) {
+    // Ya estaba registrado (de otra fibra de la misma conexion) o el numero se ha reutilizado
+    if (errno != EEXIST && errno != ENOENT)
+      return -1;
+    op = op == EPOLL_CTL_MOD ? EPOLL_CTL_ADD : EPOLL_CTL_MOD;
+    if (epoll_ctl(fiber->scheduler->epfd, op, fd, &event) == -1)
+      return -1;
+  }
+  fiber->watchedFd = fd;
+  leave_fiber(fiber);
+  return 0;
+}
+
+/********
+ * FUNCIÓN: ssize_t fiber_recv(int fd, void *buffer, size_t len)
+ * ARGS_IN: int fd - Socket
+ *          void *buffer - Buffer de recepcion
+ *          size_t len - Bytes maximos a recibir
+ * DESCRIPCIÓN: recv que, sin datos, espera con fiber_wait en vez de bloquear el hilo
+ * ARGS_OUT: ssize_t - Bytes recibidos, 0 si el cliente ha cerrado, -1 en caso de error
+ ********/
+ssize_t fiber_recv(int fd, void *buffer, size_t len) {
+  while (1) {
+    ssize_t ret = recv(fd, buffer, len, MSG_DONTWAIT);
+    if (ret >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+      return ret;
+    if (errno != EINTR && fiber_wait(fd, POLLIN) == -1)
+      return -1;
+  }
+}
+
+/********
+ * FUNCIÓN: ssize_t fiber_send(int fd, const void *buffer, size_t len, int flags)
+ * ARGS_IN: int fd - Socket
+ *          const void *buffer - Datos a enviar
+ *          size_t len - Bytes a enviar
+ *          int flags - Flags de send (MSG_MORE)
+ * DESCRIPCIÓN: Envia todo el buffer como un send bloqueante, pero con el socket lleno espera
+ *              con fiber_wait en vez de bloquear el hilo
+ * ARGS_OUT: ssize_t - Bytes enviados (len), -1 en caso de error
+ ********/
+ssize_t fiber_send(int fd, const void *buffer, size_t len, int flags) {
+  size_t sent = 0;
+
+  while (sent < len) {
+    ssize_t ret = send(fd, (const char *)buffer + sent, len - sent, flags | MSG_DONTWAIT);
+    if (ret >= 0) {
+      sent += ret;
+      continue;
+    }
+    if (errno == EINTR)
+      continue;
+    if ((errno != EAGAIN && errno != EWOULDBLOCK) || fiber_wait(fd, POLLOUT) == -1)
+      return -1;
+  }
+  return sent;
+}
+
+/********
+ * FUNCIÓN: ssize_t fiber_sendfile(int outfd, int infd, off_t *offset, size_t count)
+ * ARGS_IN: int outfd - Socket
+ *          int infd - Archivo a enviar
+ *          off_t *offset - Offset del archivo desde el que se envia (se actualiza)
+ *          size_t count - Bytes a enviar
+ * DESCRIPCIÓN: Envia count bytes del archivo con sendfile. Con el socket lleno espera con
+ *              fiber_wait en vez de bloquear el hilo
+ * ARGS_OUT: ssize_t - Bytes enviados (menos de count si el archivo es mas corto), -1 en caso de error
+ ********/
+ssize_t fiber_sendfile(int outfd, int infd, off_t *offset, size_t count) {
+  size_t sent = 0;
+
+  while (sent < count) {
+    ssize_t ret = sendfile(outfd, infd, offset, count - sent);
+    if (ret > 0) {
+      sent += ret;
+      continue;
+    }
+    if (ret == 0) // el archivo ha encogido mientras se enviaba
+      break;
+    if (errno == EINTR)
+      continue;
+    if ((errno != EAGAIN && errno != EWOULDBLOCK) || fiber_wait(outfd, POLLOUT) == -1)
+      return -1;
+  }
+  return sent;
+}
+
+/********
+ * FUNCIÓN: pid_t fiber_waitpid(pid_t pid, int *status)
+ * ARGS_IN: pid_t pid - Proceso hijo
+ *          int *status - (output, opcional) Estado de salida del hijo
+ * DESCRIPCIÓN: waitpid que, en una fibra, espera la salida del hijo en el epoll del
+ *              planificador (pidfd) en vez de bloquear el hilo
+ * ARGS_OUT: pid_t - pid del hijo, -1 en caso de error
+ ********/
+pid_t fiber_waitpid(pid_t pid, int *status) {
+#ifdef SYS_pidfd_open
+  if (currentFiber) {
+    // Sin pidfd (kernel anterior a 5.3) se espera bloqueando el planificador
+    int pidfd = syscall(SYS_pidfd_open, pid, 0);
+    if (pidfd >= 0) {
+      fiber_wait(pidfd, POLLIN);
+      close(pidfd);
+    }
+  }
+#endif
+  pid_t ret;
+  while ((ret = waitpid(pid, status, 0)) == -1 && errno == EINTR)
+    ;
+  return ret;
+}
+
+/********
+ * FUNCIÓN: long fibers_alive()
+ * DESCRIPCIÓN: Fibras creadas que aun no han terminado
+ * ARGS_OUT: long - Numero de fibras
+ ********/
+long fibers_alive() { return __atomic_load_n(&aliveFibers, __ATOMIC_RELAXED); }
+
+/********
+ * FUNCIÓN: void terminate_fibers()
+ * DESCRIPCIÓN: Detiene los planificadores y libera las fibras que no han terminado, llamando
+ *              antes a la funcion de limpieza con su argumento
+ ********/
+void terminate_fibers() {
+  uint64_t one = 1;
+
+  for (int i = 0; i < numSchedulers; i++) {
+    schedulers[i].stop = 0x01;
+    if (write(schedulers[i].wakefd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+      syslog(LOG_ERR, "Error waking fiber scheduler");
+  }
+  for (int i = 0; i < numSchedulers; i++)
+    pthread_join(schedulers[i].thread, NULL);
+
+  for (int i = 0; i < numSchedulers; i++) {
+    Scheduler *sched = &schedulers[i];
+    // Las fibras aparcadas o sin empezar no se reanudan: solo se liberan sus recursos
+    for (Fiber *fiber = sched->alive, *next; fiber; fiber = next) {
+      next = fiber->nextAlive;
+      cleanup_function(&fiber->arg);
+      munmap(fiber->stack, stackMapSize);
+    }
+    for (Fiber *fiber = sched->newHead, *next; fiber; fiber = next) {
+      next = fiber->next;
+      cleanup_function(&fiber->arg);
+      munmap(fiber->stack, stackMapSize);
+    }
+    for (int j = 0; j < sched->numCached; j++)
+      munmap(sched->stackCache[j], stackMapSize);
+    pthread_mutex_destroy(&sched->mutex);
+    close(sched->epfd);
+    close(sched->wakefd);
+  }
+  free(schedulers);
+  schedulers = NULL;
+  numSchedulers = 0;
+  aliveFibers = 0;
+}
@@ -0,0 +1,244 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                               *
+ *  limiter_lib.c - Limite adaptativo de conexiones simultaneas  *
+ *                                                               *
+ *  Autores:                                                     *
+ *    - Bhavuk Sikka    (bhavuk.sikka@estudiante.uam.es)         *
+ *    - Samuel de Lucas (samuel.lucas@estudiante.uam.es)         *
+ *                                                               *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "../includes/limiter_lib.h"
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <sys/syslog.h>
+#include <time.h>
+
+/* Plazas libres. Al bajar el limite se retiran las plazas libres que haya y las que
+ * faltan quedan como deuda, que se cobra al liberarse las plazas ocupadas */
+static sem_t freeSlots;
+static long debt = 0;
+static long currentLimit = 0;
+static long maxClients = 0, minClients = 0;
+static int adaptiveLimit = 0;
+/* Conexiones con plaza */
+static long inUse = 0;
+/* Protege la deuda, el limite y la ventana de latencias */
+static pthread_mutex_t limiterMutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Ventana de latencias actual y latencia de referencia (media de las ventanas) */
+static long long windowStart = 0, windowSum = 0;
+static long windowSamples = 0;
+static double longLatency = 0;
+/* Limite con decimales, para que el suavizado no se pierda al redondear */
+static double estimatedLimit = 0;
+
+/********
+ * FUNCIÓN: static void set_limit(long newLimit)
+ * ARGS_IN: long newLimit - Nuevo limite
+ * DESCRIPCIÓN: Cambia el numero de plazas. Se llama con limiterMutex bloqueado
+ ********/
+static void set_limit(long newLimit) {
+  long delta = newLimit - currentLimit;
+
+  currentLimit = newLimit;
+  for (; delta > 0; delta--) {
+    if (debt > 0)
+      debt--;
+    else
+      sem_post(&freeSlots);
+  }
+  for (; delta < 0; delta++) {
+    if (sem_trywait(&freeSlots) != 0)
+      debt++;
+  }
+}
+
+/********
+ * FUNCIÓN: static long queue_size(long limit)
+ * ARGS_IN: long limit - Limite actual
+ * DESCRIPCIÓN: Plazas que se añaden en cada ventana sin aumento de latencia (raiz cuadrada
+ *              del limite): el limite crece rapido cuando es pequeño y despacio cuando es grande
+ * ARGS_OUT: long - Numero de plazas
+ ********/
+static long queue_size(long limit) {
+  long root = 1;
+  while ((root + 1) * (root + 1) <= limit)
+    root++;
+  return root;
+}
+
+/********
+ * FUNCIÓN: static void update_limit(double shortLatency)
+ * ARGS_IN: double shortLatency - Latencia media de la ventana que se acaba de cerrar
+ * DESCRIPCIÓN: Recalcula el limite con el gradiente entre la latencia de referencia y la
+ *              reciente. Se llama con limiterMutex bloqueado
+ ********/
+static void update_limit(double shortLatency) {
+  if (longLatency == 0)
+    longLatency = shortLatency;
+  else
+    longLatency = longLatency * (1 - LIMITERLONGWEIGHT) + shortLatency * LIMITERLONGWEIGHT;
+  // Si la carga ha bajado mucho, la referencia se adapta antes
+  if (longLatency > 2 * shortLatency)
+    longLatency *= 0.95;
+
+  // Con menos de la mitad de las plazas ocupadas la latencia no dice nada del limite
+  if (__atomic_load_n(&inUse, __ATOMIC_RELAXED) < currentLimit / 2)
+    return;
+
+  double gradient = shortLatency > 0 ? LIMITERTOLERANCE * longLatency / shortLatency : 1.0;
+  if (gradient > 1.0)
+    gradient = 1.0;
+  if (gradient < 0.5)
+    gradient = 0.5;
+
+  double newLimit = estimatedLimit * gradient + queue_size(currentLimit);
+  estimatedLimit = estimatedLimit * (1 - LIMITERSMOOTHING) + newLimit * LIMITERSMOOTHING;
+  if (estimatedLimit > maxClients)
+    estimatedLimit = maxClients;
+  if (estimatedLimit < minClients)
+    estimatedLimit = minClients;
+
+  if ((long)estimatedLimit != currentLimit) {
+    syslog(LOG_INFO, "Concurrency limit %ld -> %ld (latency %.0fus, reference %.0fus)", currentLimit, (long)estimatedLimit,
+           shortLatency, longLatency);
+    set_limit((long)estimatedLimit);
+  }
+}
+
+/********
+ * FUNCIÓN: int initialize_limiter(long maxLimit, long minLimit, int adaptive)
+ * ARGS_IN: long maxLimit - Numero maximo de conexiones a la vez (max_clients)
+ *          long minLimit - Limite minimo al que puede bajar el limite adaptativo
+ *          int adaptive - Si es 0 el limite es siempre maxLimit
+ * DESCRIPCIÓN: Inicializa el limite de conexiones simultaneas. En modo adaptativo el limite
+ *              empieza en maxLimit y se ajusta con la latencia de las peticiones: baja cuando
+ *              la latencia reciente supera la de referencia y sube mientras se mantiene
+ * ARGS_OUT: int - Devuelve 0 en caso de exito, -1 en caso de error
+ ********/
+int initialize_limiter(long maxLimit, long minLimit, int adaptive) {
+  if (sem_init(&freeSlots, 0, maxLimit) == -1) {
+    syslog(LOG_ERR, "Error initializing connection limit");
+    return -1;
+  }
+  maxClients = currentLimit = maxLimit;
+  minClients = minLimit < 1 ? 1 : (minLimit > maxLimit ? maxLimit : minLimit);
+  adaptiveLimit = adaptive;
+  estimatedLimit = maxLimit;
+  debt = inUse = 0;
+  longLatency = 0;
+  windowSamples = windowSum = 0;
+  windowStart = limiter_now();
+  return 0;
+}
+
+/********
+ * FUNCIÓN: int limiter_acquire()
+ * DESCRIPCIÓN: Espera a que haya una plaza libre y la ocupa
+ * ARGS_OUT: int - Devuelve 0 en caso de exito, -1 si una señal interrumpe la espera (errno EINTR)
+ ********/
+int limiter_acquire() {
+  if (sem_wait(&freeSlots) == -1)
+    return -1;
+  __atomic_add_fetch(&inUse, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+/********
+ * FUNCIÓN: int limiter_try_acquire()
+ * DESCRIPCIÓN: Ocupa una plaza si hay alguna libre, sin esperar
+ * ARGS_OUT: int - Devuelve 0 si se ha ocupado la plaza, -1 si no hay ninguna libre
+ ********/
+int limiter_try_acquire() {
+  if (sem_trywait(&freeSlots) == -1)
+    return -1;
+  __atomic_add_fetch(&inUse, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+/********
+ * FUNCIÓN: void limiter_release()
+ * DESCRIPCIÓN: Libera la plaza de una conexion que se ha cerrado. Si el limite ha bajado
+ *              por debajo de las conexiones abiertas, la plaza desaparece en vez de liberarse
+ ********/
+void limiter_release() {
+  __atomic_sub_fetch(&inUse, 1, __ATOMIC_RELAXED);
+  if (!adaptiveLimit) {
+    sem_post(&freeSlots);
+    return;
+  }
+  pthread_mutex_lock(&limiterMutex);
+  if (debt > 0)
+    debt--;
+  else
+    sem_post(&freeSlots);
+  pthread_mutex_unlock(&limiterMutex);
+}
+
+/********
+ * FUNCIÓN: void limiter_wake()
+ * DESCRIPCIÓN: Despierta a un hilo bloqueado en limiter_acquire sin liberar ninguna plaza.
+ *              Solo se usa al terminar el servidor
+ ********/
+void limiter_wake() { sem_post(&freeSlots); }
+
+/********
+ * FUNCIÓN: void limiter_sample(long long latency)
+ * ARGS_IN: long long latency - Microsegundos desde el inicio de una peticion hasta su respuesta
+ * DESCRIPCIÓN: Añade la latencia de una peticion a la ventana actual y, al cerrarse la
+ *              ventana, recalcula el limite. No hace nada si el limite no es adaptativo
+ ********/
+void limiter_sample(long long latency) {
+  if (!adaptiveLimit)
+    return;
+
+  pthread_mutex_lock(&limiterMutex);
+  windowSum += latency;
+  windowSamples++;
+  long long now = limiter_now();
+  if (windowSamples >= LIMITERWINDOWSAMPLES ||
+      (windowSamples >= LIMITERMINSAMPLES && now - windowStart >= LIMITERWINDOWMS * 1000LL)) {
+    update_limit((double)windowSum / windowSamples);
+    windowSum = windowSamples = 0;
+    windowStart = now;
+  }
+  pthread_mutex_unlock(&limiterMutex);
+}
+
+/********
+ * FUNCIÓN: long limiter_limit()
+ * DESCRIPCIÓN: Limite actual de conexiones simultaneas
+ * ARGS_OUT: long - El limite
+ ********/
+long limiter_limit() {
+  pthread_mutex_lock(&limiterMutex);
+  long limit = currentLimit;
+  pthread_mutex_unlock(&limiterMutex);
+  return limit;
+}
+
+/********
+ * FUNCIÓN: long limiter_in_use()
+ * DESCRIPCIÓN: Conexiones que ocupan una plaza en este momento
+ * ARGS_OUT: long - Numero de conexiones
+ ********/
+long limiter_in_use() { return __atomic_load_n(&inUse, __ATOMIC_RELAXED); }
+
+/********
+ * FUNCIÓN: long long limiter_now()
+ * DESCRIPCIÓN: Reloj monotono con el que se miden las latencias
+ * ARGS_OUT: long long - Microsegundos desde un instante arbitrario
+ ********/
+long long limiter_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/********
+ * FUNCIÓN: void terminate_limiter()
+ * DESCRIPCIÓN: Libera los recursos del limite
+ ********/
+void terminate_limiter() { sem_destroy(&freeSlots); }
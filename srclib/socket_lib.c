@@ -8,24 +8,254 @@
  *                                                               *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#define _GNU_SOURCE
+
 #include "../includes/socket_lib.h"
 #include "../includes/server.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <strings.h>
+#include <sys/stat.h>
 #include <sys/syslog.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/********
+ * FUNCIÓN: static long listen_backlog()
+ * DESCRIPCIÓN: Devuelve el backlog de la configuracion, limitado a net.core.somaxconn
+ *              (el kernel lo recortaria sin avisar)
+ * ARGS_OUT: long - Longitud de la cola de conexiones pendientes a pasar a listen()
+ ********/
+static long listen_backlog() {
+  long backlog = configParams.listenBacklog > 0 ? configParams.listenBacklog : LISTENMAXCONNECTIONS;
+  long somaxconn = 0;
+
+  FILE *f = fopen("/proc/sys/net/core/somaxconn", "r");
+  if (f) {
+    if (fscanf(f, "%ld", &somaxconn) != 1)
+      somaxconn = 0;
+    fclose(f);
+  }
+  if (somaxconn > 0 && backlog > somaxconn) {
+    syslog(LOG_NOTICE, "listen_backlog %ld clamped to net.core.somaxconn (%ld)", backlog, somaxconn);
+    backlog = somaxconn;
+  }
+  return backlog;
+}
+
+/* Canal con el proceso anterior durante una actualizacion (-1 si no hay) */
+static int upgradeChannel = -1;
+
+/********
+ * FUNCIÓN: static int add_listen_entry(char *entry, ListenAddress **addresses, int *numAddresses)
+ * ARGS_IN: char *entry - Entrada de la lista listen: "puerto", "ip:puerto", "*:puerto",
+ *                        "[ipv6]:puerto" o "unix:/ruta/del/socket"
+ *          ListenAddress **addresses - (input/output) Lista de direcciones, se amplia con realloc
+ *          int *numAddresses - (input/output) Numero de direcciones de la lista
+ * DESCRIPCIÓN: Resuelve una entrada de la lista listen y añade sus direcciones a la lista.
+ *              Sin ip se escucha en todas las interfaces, tanto IPv4 como IPv6
+ * ARGS_OUT: int - Devuelve 0 en caso de éxito y -1 en caso contrario
+ ********/
+static int add_listen_entry(char *entry, ListenAddress **addresses, int *numAddresses) {
+  char host[256] = "", *port = entry;
+  struct addrinfo hints, *result, *rp;
+
+  if (strncmp(entry, "unix:", 5) == 0) {
+    struct sockaddr_un *Direccion;
+    char *path = entry + 5;
+    if (path[0] == 0 || strlen(path) >= sizeof(Direccion->sun_path) || *numAddresses >= LISTENMAXADDRESSES)
+      return -1;
+    ListenAddress *tmp = (ListenAddress *)realloc(*addresses, (*numAddresses + 1) * sizeof(ListenAddress));
+    if (!tmp)
+      return -1;
+    *addresses = tmp;
+    ListenAddress *address = &tmp[(*numAddresses)++];
+    memset(address, 0, sizeof(ListenAddress));
+    Direccion = (struct sockaddr_un *)&address->addr;
+    Direccion->sun_family = AF_UNIX;
+    strcpy(Direccion->sun_path, path);
+    address->addrLen = offsetof(struct sockaddr_un, sun_path) + strlen(path) + 1;
+    return 0;
+  }
+
+  if (entry[0] == '[') {
+    char *end = strchr(entry, ']');
+    if (!end || end[1] != ':' || end - entry - 1 >= (long)sizeof(host))
+      return -1;
+    strncpy(host, entry + 1, end - entry - 1);
+    port = end + 2;
+  } else if (strrchr(entry, ':')) {
+    char *sep = strrchr(entry, ':');
+    if (sep - entry >= (long)sizeof(host))
+      return -1;
+    strncpy(host, entry, sep - entry);
+    port = sep + 1;
+  }
+  if (strcmp(host, "*") == 0)
+    host[0] = 0;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+  int ret = getaddrinfo(host[0] ? host : NULL, port, &hints, &result);
+  if (ret != 0) {
+    syslog(LOG_ERR, "Error resolving listen address %s: %s", entry, gai_strerror(ret));
+    return -1;
+  }
+
+  for (rp = result; rp; rp = rp->ai_next) {
+    if (*numAddresses >= LISTENMAXADDRESSES) {
+      syslog(LOG_ERR, "Too many listen addresses (max %d)", LISTENMAXADDRESSES);
+      freeaddrinfo(result);
+      return -1;
+    }
+    ListenAddress *tmp = (ListenAddress *)realloc(*addresses, (*numAddresses + 1) * sizeof(ListenAddress));
+    if (!tmp) {
+      freeaddrinfo(result);
+      return -1;
+    }
+    *addresses = tmp;
+    ListenAddress *address = &tmp[(*numAddresses)++];
+    memset(address, 0, sizeof(ListenAddress));
+    memcpy(&address->addr, rp->ai_addr, rp->ai_addrlen);
+    address->addrLen = rp->ai_addrlen;
+  }
+  freeaddrinfo(result);
+  return 0;
+}
+
+/********
+ * FUNCIÓN: static int address_port(ListenAddress *address)
+ * ARGS_IN: ListenAddress *address - Direccion de escucha
+ * DESCRIPCIÓN: Devuelve el puerto de la direccion
+ * ARGS_OUT: int - Puerto de la direccion
+ ********/
+static int address_port(ListenAddress *address) {
+  if (address->addr.ss_family == AF_INET6)
+    return ntohs(((struct sockaddr_in6 *)&address->addr)->sin6_port);
+  return ntohs(((struct sockaddr_in *)&address->addr)->sin_port);
+}
+
+/********
+ * FUNCIÓN: int resolve_listen_addresses(ListenAddress **addresses)
+ * ARGS_IN: ListenAddress **addresses - (output) Direcciones en las que escuchar. Se libera con free
+ * DESCRIPCIÓN: Resuelve la lista listen de la configuracion. Si esta vacia se escucha en
+ *              todas las interfaces IPv4 en listen_port, como siempre. Los sockets IPv6
+ *              solo son de doble pila si no hay una direccion IPv4 en su mismo puerto
+ * ARGS_OUT: int - Devuelve el numero de direcciones, -1 en caso de error
+ ********/
+int resolve_listen_addresses(ListenAddress **addresses) {
+  int numAddresses = 0;
+  *addresses = NULL;
+
+  if (configParams.numListenAddresses == 0) {
+    struct sockaddr_in *Direccion;
+    *addresses = (ListenAddress *)calloc(1, sizeof(ListenAddress));
+    if (!*addresses)
+      return -1;
+    Direccion = (struct sockaddr_in *)&(*addresses)->addr;
+    Direccion->sin_family = AF_INET;                /* TCP/IP family */
+    Direccion->sin_port = htons(configParams.port); /* Asigning port */
+    Direccion->sin_addr.s_addr = htonl(INADDR_ANY); /* Accept all adresses */
+    (*addresses)->addrLen = sizeof(struct sockaddr_in);
+    return 1;
+  }
+
+  for (int i = 0; i < configParams.numListenAddresses; i++) {
+    if (add_listen_entry(configParams.listenAddresses[i], addresses, &numAddresses) == -1) {
+      syslog(LOG_ERR, "Invalid listen address: %s", configParams.listenAddresses[i]);
+      free(*addresses);
+      *addresses = NULL;
+      return -1;
+    }
+  }
+
+  // Un socket IPv6 de doble pila ocuparia tambien el puerto IPv4
+  for (int i = 0; i < numAddresses; i++) {
+    if ((*addresses)[i].addr.ss_family != AF_INET6)
+      continue;
+    for (int j = 0; j < numAddresses; j++) {
+      if ((*addresses)[j].addr.ss_family == AF_INET && address_port(&(*addresses)[j]) == address_port(&(*addresses)[i]))
+        (*addresses)[i].v6only = 1;
+    }
+  }
+  return numAddresses;
+}
 
 /********
- * FUNCIÓN: int initiate_server()
- * DESCRIPCIÓN: Devuelve el descriptor del socket del servidor (o EXIT_FAILURE en caso de error)
- * ARGS_OUT: int - Devuelve el descriptor del servidor en caso de éxito y -1 en caso contrario
+ * FUNCIÓN: static int configure_listener(int sockval, int family)
+ * ARGS_IN: int sockval - Socket ya asociado a su direccion (propio o heredado)
+ *          int family - Familia del socket
+ * DESCRIPCIÓN: Aplica la configuracion a un socket de escucha y lo pone a escuchar.
+ *              Con un socket heredado que ya escuchaba, listen() solo actualiza el backlog
+ * ARGS_OUT: int - Devuelve 0 en caso de éxito y -1 en caso contrario
  ********/
-int initiate_server() {
+static int configure_listener(int sockval, int family) {
+  int isUnix = family == AF_UNIX;
+
+  /* accept4 vacia la cola sin bloquearse; la espera se hace con poll. El ring de io_uring
+   * hace su propia espera y necesita el socket bloqueante */
+  if (configParams.ioBackend != IO_URING)
+    fcntl(sockval, F_SETFL, fcntl(sockval, F_GETFL) | O_NONBLOCK);
+  else
+    fcntl(sockval, F_SETFL, fcntl(sockval, F_GETFL) & ~O_NONBLOCK);
+
+  /* El kernel no completa el accept hasta que llegan los primeros datos de la peticion */
+  int deferAccept = configParams.deferAccept;
+  if (!isUnix && deferAccept > 0 && setsockopt(sockval, IPPROTO_TCP, TCP_DEFER_ACCEPT, &deferAccept, sizeof(deferAccept)) < 0)
+    syslog(LOG_NOTICE, "Error setting TCP_DEFER_ACCEPT");
+  /* Clientes que repiten pueden mandar la peticion en el propio SYN */
+  int fastOpen = configParams.fastOpen;
+  if (!isUnix && fastOpen > 0 && setsockopt(sockval, IPPROTO_TCP, TCP_FASTOPEN, &fastOpen, sizeof(fastOpen)) < 0)
+    syslog(LOG_NOTICE, "Error setting TCP_FASTOPEN");
+  /* Las conexiones aceptadas heredan el busy poll: recv sondea la cola de la tarjeta
+   * de red en vez de esperar a la interrupcion. Se aplica siempre para que un socket
+   * heredado no conserve el valor de otra configuracion */
+  int busyPoll = configParams.busyPoll, preferBusyPoll = busyPoll > 0;
+  if (!isUnix && setsockopt(sockval, SOL_SOCKET, SO_BUSY_POLL, &busyPoll, sizeof(busyPoll)) < 0 && busyPoll > 0)
+    syslog(LOG_NOTICE, "Error setting SO_BUSY_POLL");
+  if (!isUnix && setsockopt(sockval, SOL_SOCKET, SO_PREFER_BUSY_POLL, &preferBusyPoll, sizeof(preferBusyPoll)) < 0 && busyPoll > 0)
+    syslog(LOG_NOTICE, "Error setting SO_PREFER_BUSY_POLL");
+
+  return listen(sockval, listen_backlog());
+}
+
+/********
+ * FUNCIÓN: static int open_listener(ListenAddress *address, int reusePort)
+ * ARGS_IN: ListenAddress *address - Direccion en la que escuchar
+ *          int reusePort - Si es distinto de 0 se activa SO_REUSEPORT, permitiendo
+ *                          que varios sockets escuchen en el mismo puerto
+ * DESCRIPCIÓN: Crea un socket del servidor, lo asocia a la direccion y lo pone a escuchar
+ * ARGS_OUT: int - Devuelve el descriptor del socket en caso de éxito y -1 en caso contrario
+ ********/
+static int open_listener(ListenAddress *address, int reusePort) {
   int sockval;
-  struct sockaddr_in Direccion;
+  char name[NI_MAXHOST], service[NI_MAXSERV];
+  struct sockaddr_un *unixAddress = (struct sockaddr_un *)&address->addr;
+  int isUnix = address->addr.ss_family == AF_UNIX;
+
+  if (isUnix) {
+    snprintf(name, sizeof(name), "%s", unixAddress->sun_path);
+    strcpy(service, "unix");
+  } else if (getnameinfo((struct sockaddr *)&address->addr, address->addrLen, name, sizeof(name), service, sizeof(service),
+                         NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+    strcpy(name, "?"), strcpy(service, "?");
+  }
 
-  syslog(LOG_INFO, "Creating socket");
-  if ((sockval = socket(AF_INET, SOCK_STREAM, 0)) < 0) {
+  syslog(LOG_INFO, "Creating socket for %s port %s", name, service);
+  if ((sockval = socket(address->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
     syslog(LOG_ERR, "Error creating socket");
     return -1;
   }
@@ -33,48 +263,539 @@ int initiate_server() {
    * that were sent to the client that was on that connection previously.
    * TODO: change */
   int iSetOption = 1;
-  setsockopt(sockval, SOL_SOCKET, SO_REUSEADDR, (char *)&iSetOption, sizeof(iSetOption));
+  if (!isUnix)
+    setsockopt(sockval, SOL_SOCKET, SO_REUSEADDR, (char *)&iSetOption, sizeof(iSetOption));
+  /* El kernel reparte las conexiones entrantes entre todos los sockets del puerto */
+  if (reusePort && setsockopt(sockval, SOL_SOCKET, SO_REUSEPORT, (char *)&iSetOption, sizeof(iSetOption)) < 0) {
+    syslog(LOG_ERR, "Error setting SO_REUSEPORT");
+    close(sockval);
+    return -1;
+  }
+  if (address->addr.ss_family == AF_INET6)
+    setsockopt(sockval, IPPROTO_IPV6, IPV6_V6ONLY, &address->v6only, sizeof(address->v6only));
 
-  Direccion.sin_family = AF_INET;                /* TCP/IP family */
-  Direccion.sin_port = htons(configParams.port); /* Asigning port */
-  Direccion.sin_addr.s_addr = htonl(INADDR_ANY); /* Accept all adresses */
-  bzero((void *)&(Direccion.sin_zero), 8);
+  /* Un socket que quedo de una ejecucion anterior impediria el bind */
+  struct stat st;
+  if (isUnix && stat(unixAddress->sun_path, &st) == 0) {
+    if (!S_ISSOCK(st.st_mode)) {
+      syslog(LOG_ERR, "%s exists and is not a socket", unixAddress->sun_path);
+      close(sockval);
+      return -1;
+    }
+    unlink(unixAddress->sun_path);
+  }
 
   syslog(LOG_INFO, "Binding socket");
-  if (bind(sockval, (struct sockaddr *)&Direccion, sizeof(Direccion)) < 0) {
-    syslog(LOG_ERR, "Error binding socket");
+  if (bind(sockval, (struct sockaddr *)&address->addr, address->addrLen) < 0) {
+    syslog(LOG_ERR, "Error binding socket to %s port %s", name, service);
+    close(sockval);
     return -1;
   }
+  if (isUnix && chmod(unixAddress->sun_path, configParams.unixSocketMode) < 0)
+    syslog(LOG_ERR, "Error changing permissions of %s", unixAddress->sun_path);
 
   syslog(LOG_INFO, "Listening connections");
-  if (listen(sockval, LISTENMAXCONNECTIONS) < 0) {
+  if (configure_listener(sockval, address->addr.ss_family) < 0) {
     syslog(LOG_ERR, "Error listenining");
+    close(sockval);
     return -1;
   }
   return sockval;
 }
 
 /********
- * FUNCIÓN: int establece_manejador(int signal, void (*handler))
- * ARGS_IN: int sockval - Socket del servidor por el que se acepta una conexión
- * DESCRIPCIÓN: Aceptar una nueva conexión de un cliente.
- * ARGS_OUT: int - Devuelve el descriptor del socket del cliente, -1 en caso de error
+ * FUNCIÓN: static int same_address(int sockval, ListenAddress *address)
+ * ARGS_IN: int sockval - Socket heredado
+ *          ListenAddress *address - Direccion de la configuracion
+ * DESCRIPCIÓN: Comprueba si el socket esta asociado a la direccion
+ * ARGS_OUT: int - Devuelve 1 si es la misma direccion, 0 en caso contrario
+ ********/
+static int same_address(int sockval, ListenAddress *address) {
+  struct sockaddr_storage bound;
+  socklen_t len = sizeof(bound);
+
+  if (getsockname(sockval, (struct sockaddr *)&bound, &len) < 0 || bound.ss_family != address->addr.ss_family)
+    return 0;
+  if (bound.ss_family == AF_UNIX)
+    return strcmp(((struct sockaddr_un *)&bound)->sun_path, ((struct sockaddr_un *)&address->addr)->sun_path) == 0;
+  if (bound.ss_family == AF_INET6) {
+    struct sockaddr_in6 *a = (struct sockaddr_in6 *)&bound, *b = (struct sockaddr_in6 *)&address->addr;
+    return a->sin6_port == b->sin6_port && memcmp(&a->sin6_addr, &b->sin6_addr, sizeof(a->sin6_addr)) == 0;
+  }
+  struct sockaddr_in *a = (struct sockaddr_in *)&bound, *b = (struct sockaddr_in *)&address->addr;
+  return a->sin_port == b->sin_port && a->sin_addr.s_addr == b->sin_addr.s_addr;
+}
+
+/********
+ * FUNCIÓN: static int socket_family(int sockval)
+ * ARGS_IN: int sockval - Socket
+ * DESCRIPCIÓN: Devuelve la familia del socket
+ * ARGS_OUT: int - Familia del socket (AF_UNSPEC en caso de error)
+ ********/
+static int socket_family(int sockval) {
+  struct sockaddr_storage bound;
+  socklen_t len = sizeof(bound);
+  if (getsockname(sockval, (struct sockaddr *)&bound, &len) < 0)
+    return AF_UNSPEC;
+  return bound.ss_family;
+}
+
+/********
+ * FUNCIÓN: int initiate_server(ListenAddress *addresses, int numAddresses, int *inheritedfds, int numInherited,
+ *                              int *serverfds, int numAcceptors)
+ * ARGS_IN: ListenAddress *addresses - Direcciones en las que escuchar
+ *          int numAddresses - Numero de direcciones
+ *          int *inheritedfds - (opcional) Sockets de escucha heredados (ver inherit_listeners)
+ *          int numInherited - Numero de sockets heredados
+ *          int *serverfds - (output) Descriptores de los sockets del servidor, con espacio para
+ *                           numAcceptors * (numAddresses + numInherited). Los del aceptador i
+ *                           son serverfds[i * n] ... serverfds[(i + 1) * n - 1], con n el valor devuelto
+ *          int numAcceptors - Numero de aceptadores. Si es mayor que 1 cada uno abre sus
+ *                             propios sockets en todas las direcciones usando SO_REUSEPORT.
+ *                             Los sockets AF_UNIX no lo admiten: todos comparten el mismo (dup)
+ * DESCRIPCIÓN: Crea los sockets del servidor (socket(), bind() y listen()). Las direcciones que
+ *              ya tienen un socket heredado lo reutilizan; los heredados que no corresponden a
+ *              ninguna direccion se añaden como direcciones extra, compartidas por todos
+ * ARGS_OUT: int - Devuelve el numero de sockets de cada aceptador, -1 en caso de error
+ ********/
+int initiate_server(ListenAddress *addresses, int numAddresses, int *inheritedfds, int numInherited, int *serverfds,
+                    int numAcceptors) {
+  u_int8_t used[numInherited + 1];
+  int numSlots = numAcceptors * numAddresses, numExtra = 0, perAcceptor;
+
+  memset(used, 0, sizeof(used));
+  // Primero se asignan los sockets heredados a las direcciones que coinciden
+  for (int i = 0; i < numSlots; i++) {
+    serverfds[i] = -1;
+    for (int j = 0; j < numInherited; j++) {
+      if (!used[j] && same_address(inheritedfds[j], &addresses[i % numAddresses])) {
+        used[j] = 0x01;
+        serverfds[i] = inheritedfds[j];
+        break;
+      }
+    }
+  }
+  for (int j = 0; j < numInherited; j++)
+    numExtra += !used[j];
+  perAcceptor = numAddresses + numExtra;
+
+  // Se reparte el array en bloques de perAcceptor, empezando por el final para no pisar nada
+  for (int a = numAcceptors - 1; a >= 0; a--) {
+    for (int j = numAddresses - 1; j >= 0; j--)
+      serverfds[a * perAcceptor + j] = serverfds[a * numAddresses + j];
+  }
+  for (int a = 0; a < numAcceptors; a++) {
+    for (int k = numAddresses; k < perAcceptor; k++)
+      serverfds[a * perAcceptor + k] = -1;
+  }
+
+  for (int a = 0; a < numAcceptors; a++) {
+    for (int j = 0; j < numAddresses; j++) {
+      int *slot = &serverfds[a * perAcceptor + j];
+      ListenAddress *address = &addresses[j];
+      if (*slot >= 0) {
+        syslog(LOG_INFO, "Using inherited listening socket %d", *slot);
+        if (configure_listener(*slot, address->addr.ss_family) == 0)
+          continue;
+        syslog(LOG_ERR, "Error listenining");
+        close(*slot);
+        *slot = -1;
+      }
+      if (address->addr.ss_family != AF_UNIX || a == 0)
+        *slot = open_listener(address, numAcceptors > 1 && address->addr.ss_family != AF_UNIX);
+      // Sin socket propio (AF_UNIX o un heredado sin SO_REUSEPORT) se comparte el del primer aceptador
+      if (*slot < 0 && a > 0 && serverfds[j] >= 0)
+        *slot = fcntl(serverfds[j], F_DUPFD_CLOEXEC, 0);
+      if (*slot < 0)
+        goto error;
+    }
+
+    int k = numAddresses;
+    for (int j = 0; j < numInherited; j++) {
+      if (used[j])
+        continue;
+      int *slot = &serverfds[a * perAcceptor + k++];
+      if (a == 0) {
+        *slot = inheritedfds[j];
+        syslog(LOG_INFO, "Using extra inherited listening socket %d", *slot);
+        if (configure_listener(*slot, socket_family(*slot)) < 0) {
+          close(*slot);
+          *slot = -1;
+          goto error;
+        }
+      } else {
+        *slot = fcntl(inheritedfds[j], F_DUPFD_CLOEXEC, 0);
+        if (*slot < 0)
+          goto error;
+      }
+    }
+  }
+  return perAcceptor;
+
+error:
+  for (int i = 0; i < numAcceptors * perAcceptor; i++) {
+    if (serverfds[i] >= 0)
+      close(serverfds[i]);
+  }
+  return -1;
+}
+
+/********
+ * FUNCIÓN: int inherit_listeners(int **inheritedfds)
+ * ARGS_IN: int **inheritedfds - (output) Sockets de escucha heredados. Se libera con free
+ * DESCRIPCIÓN: Recoge los sockets de escucha que deja un proceso anterior. Pueden venir del
+ *              propio servidor durante una actualizacion (por el canal indicado en la variable
+ *              de entorno UPGRADEENV, mediante SCM_RIGHTS) o de un supervisor como systemd
+ *              (activacion por socket: LISTEN_PID y LISTEN_FDS, a partir del descriptor 3)
+ * ARGS_OUT: int - Devuelve el numero de sockets heredados, -1 en caso de error
+ ********/
+int inherit_listeners(int **inheritedfds) {
+  char *env;
+  int numInherited = 0;
+  *inheritedfds = NULL;
+
+  if ((env = getenv(UPGRADEENV)) != NULL) {
+    upgradeChannel = atoi(env);
+    unsetenv(UPGRADEENV);
+    fcntl(upgradeChannel, F_SETFD, FD_CLOEXEC);
+
+    char more = 1;
+    while (more) {
+      char buf[CMSG_SPACE(sizeof(int) * UPGRADEFDSPERMSG)];
+      struct iovec iov = {&more, 1};
+      struct msghdr msg;
+      memset(&msg, 0, sizeof(msg));
+      msg.msg_iov = &iov;
+      msg.msg_iovlen = 1;
+      msg.msg_control = buf;
+      msg.msg_controllen = sizeof(buf);
+      if (recvmsg(upgradeChannel, &msg, MSG_CMSG_CLOEXEC) <= 0) {
+        syslog(LOG_ERR, "Error receiving listening sockets from previous process");
+        close(upgradeChannel);
+        upgradeChannel = -1;
+        return numInherited;
+      }
+
+      for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+          continue;
+        int numFds = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int *tmp = (int *)realloc(*inheritedfds, (numInherited + numFds) * sizeof(int));
+        if (!tmp)
+          return -1;
+        *inheritedfds = tmp;
+        memcpy(tmp + numInherited, CMSG_DATA(cmsg), numFds * sizeof(int));
+        numInherited += numFds;
+      }
+    }
+  } else if ((env = getenv("LISTEN_PID")) != NULL && atoi(env) == getpid() && getenv("LISTEN_FDS")) {
+    numInherited = atoi(getenv("LISTEN_FDS"));
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+    if (numInherited <= 0)
+      return 0;
+    *inheritedfds = (int *)malloc(numInherited * sizeof(int));
+    if (!*inheritedfds)
+      return -1;
+    for (int i = 0; i < numInherited; i++) {
+      (*inheritedfds)[i] = 3 + i;
+      fcntl(3 + i, F_SETFD, FD_CLOEXEC);
+    }
+  }
+
+  // Los sockets compartidos por varios aceptadores llegan repetidos (dup): nos quedamos con uno
+  for (int i = 0; i < numInherited; i++) {
+    struct stat sti;
+    if (fstat((*inheritedfds)[i], &sti) < 0)
+      continue;
+    for (int j = i + 1; j < numInherited; j++) {
+      struct stat stj;
+      if (fstat((*inheritedfds)[j], &stj) == 0 && sti.st_ino == stj.st_ino && sti.st_dev == stj.st_dev) {
+        close((*inheritedfds)[j]);
+        (*inheritedfds)[j--] = (*inheritedfds)[--numInherited];
+      }
+    }
+  }
+  if (numInherited > 0)
+    syslog(LOG_INFO, "Inherited %d listening sockets", numInherited);
+  return numInherited;
+}
+
+/********
+ * FUNCIÓN: void listeners_ready()
+ * DESCRIPCIÓN: Avisa al proceso anterior (si lo hay) de que ya escuchamos en sus sockets,
+ *              para que deje de aceptar conexiones
+ ********/
+void listeners_ready() {
+  if (upgradeChannel < 0)
+    return;
+  char ready = 1;
+  if (write(upgradeChannel, &ready, 1) != 1)
+    syslog(LOG_ERR, "Error notifying previous process");
+  close(upgradeChannel);
+  upgradeChannel = -1;
+}
+
+/********
+ * FUNCIÓN: int hand_over_listeners(int *serverfds, int numServerfds, char *argv[])
+ * ARGS_IN: int *serverfds - Sockets de escucha a entregar
+ *          int numServerfds - Numero de sockets
+ *          char *argv[] - Argumentos con los que se ejecuta el nuevo binario
+ * DESCRIPCIÓN: Ejecuta de nuevo el binario del servidor y le pasa los sockets de escucha por
+ *              un socketpair con SCM_RIGHTS. Las conexiones que esperan en la cola de los
+ *              sockets no se pierden, pues los sockets pasan a ser compartidos
+ * ARGS_OUT: int - Devuelve 0 cuando el nuevo proceso ya escucha, -1 en caso de error
+ ********/
+int hand_over_listeners(int *serverfds, int numServerfds, char *argv[]) {
+  extern char **environ;
+  int channel[2], numEnv = 0;
+  char envVar[64], exePath[PATH_MAX];
+
+  /* Se ejecuta la ruta del binario y no /proc/self/exe, que seguiria apuntando al binario
+   * antiguo si se ha reemplazado el archivo (readlink añade entonces " (deleted)") */
+  ssize_t pathLen = readlink("/proc/self/exe", exePath, sizeof(exePath) - 1);
+  if (pathLen <= 0) {
+    strcpy(exePath, "/proc/self/exe");
+  } else {
+    exePath[pathLen] = '\0';
+    char *deleted = strstr(exePath, " (deleted)");
+    if (deleted && deleted[strlen(" (deleted)")] == '\0')
+      *deleted = '\0';
+  }
+
+  if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, channel) < 0) {
+    syslog(LOG_ERR, "Error creating upgrade channel");
+    return -1;
+  }
+
+  // El entorno se prepara antes del fork: en el hijo solo se usan llamadas async-signal-safe
+  while (environ[numEnv])
+    numEnv++;
+  char **envp = (char **)calloc(numEnv + 2, sizeof(char *));
+  if (!envp) {
+    close(channel[0]);
+    close(channel[1]);
+    return -1;
+  }
+  int k = 0;
+  for (int i = 0; i < numEnv; i++) {
+    if (strncmp(environ[i], UPGRADEENV "=", strlen(UPGRADEENV) + 1) && strncmp(environ[i], "LISTEN_", 7))
+      envp[k++] = environ[i];
+  }
+  snprintf(envVar, sizeof(envVar), UPGRADEENV "=%d", channel[1]);
+  envp[k] = envVar;
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    syslog(LOG_ERR, "Error forking new server");
+    free(envp);
+    close(channel[0]);
+    close(channel[1]);
+    return -1;
+  }
+  if (pid == 0) {
+    sigset_t empty;
+    sigemptyset(&empty);
+    sigprocmask(SIG_SETMASK, &empty, NULL);
+    fcntl(channel[1], F_SETFD, 0);
+    execve(exePath, argv, envp);
+    _exit(EXIT_FAILURE);
+  }
+  free(envp);
+  close(channel[1]);
+  syslog(LOG_INFO, "Started new server (PID = %d). Handing over %d listening sockets", pid, numServerfds);
+
+  for (int sent = 0; sent < numServerfds;) {
+    int numFds = numServerfds - sent < UPGRADEFDSPERMSG ? numServerfds - sent : UPGRADEFDSPERMSG;
+    char buf[CMSG_SPACE(sizeof(int) * UPGRADEFDSPERMSG)];
+    char more = sent + numFds < numServerfds;
+    struct iovec iov = {&more, 1};
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    memset(buf, 0, sizeof(buf));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * numFds);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * numFds);
+    memcpy(CMSG_DATA(cmsg), serverfds + sent, sizeof(int) * numFds);
+    if (sendmsg(channel[0], &msg, MSG_NOSIGNAL) < 0) {
+      syslog(LOG_ERR, "Error handing over listening sockets");
+      close(channel[0]);
+      return -1;
+    }
+    sent += numFds;
+  }
+
+  // Seguimos aceptando hasta que el nuevo proceso confirma que ya escucha
+  struct pollfd pfd = {channel[0], POLLIN, 0};
+  char ready = 0;
+  int ret;
+  while ((ret = poll(&pfd, 1, UPGRADETIMEOUT)) < 0 && errno == EINTR) {
+  }
+  if (ret <= 0 || read(channel[0], &ready, 1) != 1 || ready != 1) {
+    syslog(LOG_ERR, "New server did not start. Keeping the current one");
+    close(channel[0]);
+    return -1;
+  }
+  close(channel[0]);
+  return 0;
+}
+
+/********
+ * FUNCIÓN: static int accept_burst(int *sockvals, int numSockvals, int flags, int *connfds, int maxConns, int wait)
+ * ARGS_IN: int *sockvals - Sockets del servidor (no bloqueantes)
+ *          int numSockvals - Numero de sockets
+ *          int flags - Flags para accept4
+ *          int *connfds - (output) Descriptores de los sockets de los clientes aceptados
+ *          int maxConns - Numero maximo de conexiones a aceptar
+ *          int wait - Si es 0 solo se aceptan las conexiones que ya esten en la cola de los sockets
+ * DESCRIPCIÓN: Acepta por turnos de todos los sockets hasta vaciar sus colas, esperando
+ *              con poll si todas estan vacias y no se ha aceptado ninguna
+ * ARGS_OUT: int - Devuelve el numero de conexiones aceptadas, -1 en caso de error
  ********/
-int accept_connection(int sockval) {
-  int desc;
-  socklen_t len;
-  struct sockaddr Conexion;
+static int accept_burst(int *sockvals, int numSockvals, int flags, int *connfds, int maxConns, int wait) {
+  u_int8_t empty[numSockvals]; // sockets cuya cola ya se ha vaciado
+  int numEmpty = 0, numConns = 0;
+
+  memset(empty, 0, sizeof(empty));
+  while (numConns < maxConns) {
+    for (int i = 0; i < numSockvals && numConns < maxConns; i++) {
+      if (empty[i])
+        continue;
+      int desc = accept4(sockvals[i], NULL, NULL, flags);
+      if (desc >= 0) {
+        connfds[numConns++] = desc;
+        continue;
+      }
+      if (errno == ECONNABORTED)
+        continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        if (numConns > 0)
+          return numConns;
+        if (errno != EINTR)
+          syslog(LOG_ERR, "Error accepting connection");
+        return -1;
+      }
+      empty[i] = 0x01;
+      numEmpty++;
+    }
+    if (numEmpty < numSockvals)
+      continue;
+    if (numConns > 0 || !wait)
+      break;
+
+    // Colas vacias: se espera a la siguiente conexion (SIGUSR1 interrumpe poll)
+    struct pollfd pfds[numSockvals];
+    for (int i = 0; i < numSockvals; i++) {
+      pfds[i].fd = sockvals[i];
+      pfds[i].events = POLLIN;
+    }
+    if (poll(pfds, numSockvals, -1) == -1)
+      return -1;
+    for (int i = 0; i < numSockvals; i++) {
+      if (pfds[i].revents & (POLLERR | POLLNVAL))
+        return -1;
+      if (pfds[i].revents) {
+        empty[i] = 0x00;
+        numEmpty--;
+      }
+    }
+  }
+  return numConns;
+}
 
-  len = sizeof(Conexion);
+/********
+ * FUNCIÓN: int accept_connections(int *sockvals, int numSockvals, URing *ring, int *connfds, int maxConns, int wait)
+ * ARGS_IN: int *sockvals - Sockets del servidor por los que se aceptan las conexiones
+ *          int numSockvals - Numero de sockets
+ *          URing *ring - (opcional) Ring del aceptador para usar el multishot accept de io_uring
+ *          int *connfds - (output) Descriptores de los sockets de los clientes aceptados
+ *          int maxConns - Numero maximo de conexiones a aceptar
+ *          int wait - Si es 0 solo se aceptan las conexiones que ya esten en la cola de los sockets
+ * DESCRIPCIÓN: Vacia la cola de conexiones pendientes de los sockets a rafagas con accept4, sin
+ *              ninguna llamada extra por conexion: las opciones de socket se heredan del socket
+ *              de escucha y SOCK_NONBLOCK (modos epoll y fibers) y SOCK_CLOEXEC se aplican en el propio accept4
+ * ARGS_OUT: int - Devuelve el numero de conexiones aceptadas, -1 en caso de error
+ ********/
+int accept_connections(int *sockvals, int numSockvals, URing *ring, int *connfds, int maxConns, int wait) {
+  int flags = SOCK_CLOEXEC | (configParams.mode != MODE_THREADS ? SOCK_NONBLOCK : 0);
+  int numConns = 0;
 
-  if ((desc = accept(sockval, &Conexion, &len)) < 0) {
-    syslog(LOG_ERR, "Error accepting connection");
+  if (!ring) {
+    numConns = accept_burst(sockvals, numSockvals, flags, connfds, maxConns, wait);
+    return numConns == 0 && wait ? -1 : numConns;
+  }
+
+  while (numConns < maxConns) {
+    int index;
+    int desc = uring_accept(ring, sockvals, numSockvals, flags, wait && numConns == 0, &index);
+    if (desc >= 0) {
+      connfds[numConns++] = desc;
+      continue;
+    }
+    if (errno == ECONNABORTED)
+      continue;
+    if (numConns == 0 && errno != EAGAIN && errno != EINTR && errno != ECANCELED)
+      syslog(LOG_ERR, "Error accepting connection");
+    break;
+  }
+
+  if (numConns == 0)
+    return wait ? -1 : 0;
+  return numConns;
+}
+
+/********
+ * FUNCIÓN: int incoming_cpu(int sockval)
+ * ARGS_IN: int sockval - Socket de un cliente ya aceptado
+ * DESCRIPCIÓN: Consulta con SO_INCOMING_CPU la CPU que ha procesado los paquetes de la conexion
+ * ARGS_OUT: int - Devuelve la CPU, -1 si el kernel no la conoce
+ ********/
+int incoming_cpu(int sockval) {
+  int cpu = -1;
+  socklen_t len = sizeof(cpu);
+  if (getsockopt(sockval, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) < 0)
     return -1;
+  return cpu;
+}
+
+/********
+ * FUNCIÓN: void steer_listeners(int *sockvals, int numSockvals, int cpu)
+ * ARGS_IN: int *sockvals - Sockets de escucha de un aceptador
+ *          int numSockvals - Numero de sockets
+ *          int cpu - CPU en la que se ejecuta el aceptador
+ * DESCRIPCIÓN: Marca los sockets con SO_INCOMING_CPU para que, dentro de un grupo SO_REUSEPORT,
+ *              el kernel entregue a este aceptador las conexiones procesadas en su CPU
+ ********/
+void steer_listeners(int *sockvals, int numSockvals, int cpu) {
+  for (int i = 0; i < numSockvals; i++) {
+    // Los sockets unix no tienen grupo SO_REUSEPORT
+    if (socket_family(sockvals[i]) != AF_UNIX)
+      setsockopt(sockvals[i], SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu));
+  }
+}
+
+/********
+ * FUNCIÓN: void reject_connection(int connfd, const char *response, int responseLen)
+ * ARGS_IN: int connfd - Socket de un cliente recien aceptado
+ *          const char *response - Respuesta ya formateada
+ *          int responseLen - Longitud de la respuesta
+ * DESCRIPCIÓN: Rechaza la conexion sin pasar por el pool: envia la respuesta con una sola
+ *              escritura no bloqueante y cierra. Antes se lee lo que el cliente ya haya
+ *              enviado, pues cerrar con datos sin leer manda un RST que puede hacer que el
+ *              cliente descarte la respuesta
+ ********/
+void reject_connection(int connfd, const char *response, int responseLen) {
+  char discard[2048];
+  if (recv(connfd, discard, sizeof(discard), MSG_DONTWAIT) < 0 && errno != EAGAIN && errno != EWOULDBLOCK) {
+    close(connfd);
+    return;
   }
-  struct timeval tv;
-  tv.tv_sec = configParams.timeout;
-  tv.tv_usec = 0;
-  if (tv.tv_sec > 0)
-    setsockopt(desc, SOL_SOCKET, SO_RCVTIMEO, (const char *)&tv, sizeof tv);
-  return desc;
+  send(connfd, response, responseLen, MSG_DONTWAIT | MSG_NOSIGNAL);
+  close(connfd);
 }
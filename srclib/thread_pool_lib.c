@@ -8,59 +8,514 @@
  *                                                               *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#define _GNU_SOURCE
 #include "../includes/thread_pool_lib.h"
 #include "../includes/client_conn_lib.h"
 #include "../includes/signal_lib.h"
+#include "../includes/topology_lib.h"
 
+#include <errno.h>
+#include <linux/futex.h>
 #include <pthread.h>
+#include <sched.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/syscall.h>
 #include <sys/syslog.h>
+#include <time.h>
 #include <unistd.h>
 
+/* Valores de wakeWord: dormido, despertado para coger un trabajo o para terminar, y esperando
+ * a que se cree el resto de su lote */
+#define HOLDERSLEEPING 0
+#define HOLDERWAKE 1
+#define HOLDERRETIRE 2
+#define HOLDERSTARTING 3
+
+/* Cola local de un hilo (deque de Chase-Lev). Su dueño mete y saca trabajos por abajo, de modo
+ * que ejecuta primero el ultimo, cuyos datos aun estan en su cache, y el resto de hilos los
+ * roban por arriba */
+typedef struct LocalQueue {
+  long top __attribute__((aligned(64)));
+  long bottom __attribute__((aligned(64)));
+  void *jobs[THREADLOCALQUEUESIZE];
+  long long queued[THREADLOCALQUEUESIZE]; // instante (pool_now_us) en el que se encolo cada trabajo
+} LocalQueue;
+
+/* Estadisticas acumuladas de un hilo. Solo las escribe el propio hilo; pool_stats las lee
+ * y las suma a las del resto */
+typedef struct ThreadStats {
+  long jobsStarted, jobsCompleted, jobsStolen;
+  long waitTime, runTime;
+  long waitHistogram[POOLSTATSBUCKETS];
+  long runHistogram[POOLSTATSBUCKETS];
+} ThreadStats;
+
 /* Estructura de un trabajo para ejecutar holder_execution_job */
 typedef struct HolderJob {
-  int id;        // batch id
-  int position;  // posicion en el batch
-  void *jobInfo; // informacion del trabajo creado
+  int id;           // batch id
+  int position;     // posicion en el batch
+  void *jobInfo;    // informacion del trabajo en ejecucion (NULL si el hilo esta libre)
+  ThreadPool *pool; // pool al que pertenece el hilo
+  int wakeWord;     // futex en el que duerme el hilo (HOLDERSLEEPING, HOLDERWAKE, HOLDERRETIRE o HOLDERSTARTING)
+  long long lastActive; // instante (pool_now) en el que el hilo termino su ultimo trabajo
+  LocalQueue *localQueue; // continuaciones que el hilo ha encolado con add_local_job
+  ThreadStats stats __attribute__((aligned(64))); // en su propia linea de cache
 } HolderJob;
 
-/* Estructura de una lista doblemente enlazada e
- * informacion del lote, conteniendo informacion para cada hilo */
+/* Informacion del lote, conteniendo informacion para cada hilo */
 typedef struct ThreadBatch {
-  struct ThreadBatch *prevBatch;
   int id;
   pthread_t threads[THREADBATCHCOUNT];
-  pthread_mutex_t mutex[THREADBATCHCOUNT];
   HolderJob holderJobs[THREADBATCHCOUNT];
-  struct ThreadBatch *nextBatch;
 } ThreadBatch;
 
-/* Funcion que se llama al iniciar un trabajo */
-void *(*client_function)(void *);
-/* Funcion que se llama al limpiar un trabajo */
-void (*cleanup_function)(void *);
+/* Celda de la cola de trabajos. sequence indica de quien es el turno: igual a la posicion,
+ * la celda esta libre para el productor de esa posicion; igual a la posicion + 1, tiene
+ * un trabajo para el consumidor de esa posicion */
+typedef struct JobCell {
+  unsigned long sequence;
+  void *job;
+  long long queued; // instante (pool_now_us) en el que se encolo el trabajo
+} JobCell;
+
+/* Estructura de un pool de hilos independiente */
+struct ThreadPool {
+  /* Funcion que se llama al iniciar un trabajo */
+  void *(*client_function)(void *);
+  /* Funcion que se llama al limpiar un trabajo */
+  void (*cleanup_function)(void *);
+  /* Primer lote necesario para el pool de hilos */
+  ThreadBatch firstBatch;
+  /* Lotes del pool (batches[0] es firstBatch): el hilo i esta en la posicion
+   * i % THREADBATCHCOUNT del lote i / THREADBATCHCOUNT */
+  ThreadBatch *batches[THREADPOOLMAXBATCHES];
+  int numBatches;
+  /* Variable que indica si los hilos deben de suicidarse */
+  volatile u_int8_t suicide;
+  /* CPUs a las que se fijan los hilos del pool (si pinned) */
+  cpu_set_t cpus;
+  u_int8_t pinned;
+  /* Hilos libres que aun no tienen un trabajo reservado. add_job reserva uno por trabajo
+   * (y crea un lote si no hay). Si es negativo, el pool ha llegado a su maximo y hay
+   * trabajos en la cola esperando a que termine alguno de los que se estan ejecutando */
+  int idleThreads;
+  /* Serializa la creacion y retirada de lotes */
+  pthread_mutex_t growMutex;
+  /* Limites del pool: nunca baja de minThreads hilos ni pasa de maxBatches lotes */
+  int minThreads, maxBatches;
+  u_int8_t atMax;
+  /* Crecimiento en segundo plano: con menos de spareThreads hilos libres se crean growBatches lotes */
+  int spareThreads, growBatches;
+  u_int8_t growRequested;
+  /* Lotes que llevan idleTimeout milisegundos sin trabajo se retiran (0 = no se retiran) */
+  long long idleTimeout;
+  /* Hilo que crea y retira los lotes del pool (si no existe, add_job crea los lotes) */
+  pthread_t maintainerThread;
+  u_int8_t maintainerRunning, stopMaintainer;
+  pthread_mutex_t maintainerMutex;
+  pthread_cond_t maintainerCond;
+  /* Cola acotada sin locks (varios productores y consumidores) con los trabajos pendientes */
+  JobCell jobs[THREADPOOLQUEUESIZE];
+  unsigned long enqueuePos __attribute__((aligned(64)));
+  unsigned long dequeuePos __attribute__((aligned(64)));
+  /* Numero de trabajos encolados que ningun hilo ha cogido aun */
+  int pendingJobs __attribute__((aligned(64)));
+  /* Bitmap de hilos dormidos (bit i = hilo i). Se despierta siempre al de menor indice,
+   * asi que los trabajos se reparten entre los mismos pocos hilos y el resto sigue dormido */
+  unsigned long sleepingMask[THREADPOOLMASKWORDS] __attribute__((aligned(64)));
+  /* Bitmap de hilos con trabajos en su cola local, en el que los hilos sin trabajo buscan a quien robar */
+  unsigned long queuedMask[THREADPOOLMASKWORDS] __attribute__((aligned(64)));
+  /* Colas locales de los hilos de cada lote. Se crean con el lote pero no se liberan al
+   * retirarlo (un hilo puede estar mirando si tiene trabajos), sino al destruir el pool */
+  LocalQueue *localQueues[THREADPOOLMAXBATCHES];
+  /* Estadisticas de los hilos de los lotes retirados, y lotes creados y retirados (con growMutex) */
+  ThreadStats retiredStats;
+  long batchesCreated, batchesRetired;
+  /* Lista de todos los pools (con poolsMutex) */
+  struct ThreadPool *nextPool;
+};
+
+/* Hilos de todos los pools */
+static long totalThreads = 0;
+/* Tamaño de pila de los hilos que se crean (0 = el del sistema) */
+static size_t poolStackSize = 0;
+/* Pools que existen, para pools_stats */
+static ThreadPool *allPools = NULL;
+static pthread_mutex_t poolsMutex = PTHREAD_MUTEX_INITIALIZER;
+/* Hilo del pool que se esta ejecutando (NULL si no es un hilo de ningun pool) */
+static __thread HolderJob *currentHolder = NULL;
+
+/********
+ * FUNCIÓN: static long long pool_now()
+ * DESCRIPCIÓN: Reloj monotono con el que se mide el tiempo sin trabajo de los hilos
+ * ARGS_OUT: long long - Milisegundos desde un instante arbitrario
+ ********/
+static long long pool_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/********
+ * FUNCIÓN: static long long pool_now_us()
+ * DESCRIPCIÓN: El mismo reloj que pool_now, con el que se miden los tiempos de las estadisticas
+ * ARGS_OUT: long long - Microsegundos desde un instante arbitrario
+ ********/
+static long long pool_now_us() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
 
-/* Tengo garantia de que se inicializa a 0 todo, porque es global */
-/* Primer lote necesario para el pool de hilos */
-ThreadBatch firstBatch;
-/* Variable que indica si los hilos deben de suicidarse */
-u_int8_t suicide;
+/********
+ * FUNCIÓN: static void stat_add(long *counter, long value)
+ * ARGS_IN: long *counter - Contador de las estadisticas del hilo que llama
+ *          long value - Valor a sumar
+ * DESCRIPCIÓN: Suma al contador sin instrucciones atomicas de lectura-escritura: solo lo
+ *              escribe su hilo, y pool_stats lo lee entero
+ ********/
+static void stat_add(long *counter, long value) {
+  __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + value, __ATOMIC_RELAXED);
+}
 
 /********
- * FUNCIÓN: static ThreadBatch *find_batch(int id)
- * ARGS_IN: int id - identificador del batch
- * DESCRIPCIÓN: Busca el batch con el identificador id
- * ARGS_OUT: ThreadBatch * - devuelve la batch con el idendificador especificado
+ * FUNCIÓN: static void stat_time(long *total, long *histogram, long long time)
+ * ARGS_IN: long *total - Suma de tiempos del hilo que llama
+ *          long *histogram - Histograma (POOLSTATSBUCKETS intervalos) del hilo que llama
+ *          long long time - Tiempo medido, en microsegundos
+ * DESCRIPCIÓN: Añade el tiempo a la suma y a su intervalo del histograma
  ********/
-static ThreadBatch *find_batch(int id) {
-  ThreadBatch *batch = &firstBatch;
-  for (int i = 0; i < id; i++) {
-    batch = batch->nextBatch;
+static void stat_time(long *total, long *histogram, long long time) {
+  int bucket = time > 0 ? 64 - __builtin_clzll(time) : 0;
+
+  if (bucket >= POOLSTATSBUCKETS)
+    bucket = POOLSTATSBUCKETS - 1;
+  stat_add(total, time > 0 ? time : 0);
+  stat_add(&histogram[bucket], 1);
+}
+
+/********
+ * FUNCIÓN: static void merge_stats(ThreadStats *total, ThreadStats *stats)
+ * ARGS_IN: ThreadStats *total - (output) Estadisticas a las que se suman
+ *          ThreadStats *stats - Estadisticas de un hilo, que puede estar escribiendolas
+ * DESCRIPCIÓN: Suma las estadisticas de un hilo a total
+ ********/
+static void merge_stats(ThreadStats *total, ThreadStats *stats) {
+  total->jobsStarted += __atomic_load_n(&stats->jobsStarted, __ATOMIC_RELAXED);
+  total->jobsCompleted += __atomic_load_n(&stats->jobsCompleted, __ATOMIC_RELAXED);
+  total->jobsStolen += __atomic_load_n(&stats->jobsStolen, __ATOMIC_RELAXED);
+  total->waitTime += __atomic_load_n(&stats->waitTime, __ATOMIC_RELAXED);
+  total->runTime += __atomic_load_n(&stats->runTime, __ATOMIC_RELAXED);
+  for (int i = 0; i < POOLSTATSBUCKETS; i++) {
+    total->waitHistogram[i] += __atomic_load_n(&stats->waitHistogram[i], __ATOMIC_RELAXED);
+    total->runHistogram[i] += __atomic_load_n(&stats->runHistogram[i], __ATOMIC_RELAXED);
   }
-  return batch;
+}
+
+/********
+ * FUNCIÓN: static long futex(int *word, int op, int val)
+ * ARGS_IN: int *word - Palabra del futex
+ *          int op - FUTEX_WAIT_PRIVATE o FUTEX_WAKE_PRIVATE
+ *          int val - Valor esperado (WAIT) o numero de hilos a despertar (WAKE)
+ * DESCRIPCIÓN: Llamada al sistema futex, que glibc no envuelve
+ * ARGS_OUT: long - Resultado de la llamada
+ ********/
+static long futex(int *word, int op, int val) { return syscall(SYS_futex, word, op, val, NULL, NULL, 0); }
+
+/********
+ * FUNCIÓN: static int enqueue_job(ThreadPool *pool, void *job)
+ * ARGS_IN: ThreadPool *pool - Pool
+ *          void *job - Trabajo a encolar
+ * DESCRIPCIÓN: Encola el trabajo en O(1) sin locks: reserva una posicion con CAS y
+ *              publica el trabajo al actualizar la secuencia de su celda
+ * ARGS_OUT: int - Devuelve 0 en caso de exito, -1 si la cola esta llena
+ ********/
+static int enqueue_job(ThreadPool *pool, void *job) {
+  unsigned long pos = __atomic_load_n(&pool->enqueuePos, __ATOMIC_RELAXED);
+  JobCell *cell;
+
+  for (;;) {
+    cell = &pool->jobs[pos & (THREADPOOLQUEUESIZE - 1)];
+    long diff = (long)(__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) - pos);
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&pool->enqueuePos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if (diff < 0) {
+      return -1;
+    } else {
+      pos = __atomic_load_n(&pool->enqueuePos, __ATOMIC_RELAXED);
+    }
+  }
+  cell->job = job;
+  cell->queued = pool_now_us();
+  __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/********
+ * FUNCIÓN: static void *dequeue_job(ThreadPool *pool, long long *queued)
+ * ARGS_IN: ThreadPool *pool - Pool
+ *          long long *queued - (output) Instante en el que se encolo el trabajo
+ * DESCRIPCIÓN: Saca un trabajo de la cola en O(1) sin locks
+ * ARGS_OUT: void * - El trabajo, o NULL si la cola esta vacia (o el siguiente trabajo
+ *                    aun no se ha terminado de publicar)
+ ********/
+static void *dequeue_job(ThreadPool *pool, long long *queued) {
+  unsigned long pos = __atomic_load_n(&pool->dequeuePos, __ATOMIC_RELAXED);
+  JobCell *cell;
+
+  for (;;) {
+    cell = &pool->jobs[pos & (THREADPOOLQUEUESIZE - 1)];
+    long diff = (long)(__atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE) - (pos + 1));
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&pool->dequeuePos, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        break;
+    } else if (diff < 0) {
+      return NULL;
+    } else {
+      pos = __atomic_load_n(&pool->dequeuePos, __ATOMIC_RELAXED);
+    }
+  }
+  void *job = cell->job;
+  *queued = cell->queued;
+  __atomic_store_n(&cell->sequence, pos + THREADPOOLQUEUESIZE, __ATOMIC_RELEASE);
+  return job;
+}
+
+/********
+ * FUNCIÓN: static int local_push(LocalQueue *queue, void *job)
+ * ARGS_IN: LocalQueue *queue - Cola local del hilo que llama
+ *          void *job - Trabajo a encolar
+ * DESCRIPCIÓN: Mete el trabajo por abajo en la cola. Solo la llama su dueño
+ * ARGS_OUT: int - Devuelve 0 en caso de exito, -1 si la cola esta llena
+ ********/
+static int local_push(LocalQueue *queue, void *job) {
+  long bottom = __atomic_load_n(&queue->bottom, __ATOMIC_RELAXED);
+  long top = __atomic_load_n(&queue->top, __ATOMIC_ACQUIRE);
+
+  if (bottom - top >= THREADLOCALQUEUESIZE)
+    return -1;
+  __atomic_store_n(&queue->jobs[bottom & (THREADLOCALQUEUESIZE - 1)], job, __ATOMIC_RELAXED);
+  __atomic_store_n(&queue->queued[bottom & (THREADLOCALQUEUESIZE - 1)], pool_now_us(), __ATOMIC_RELAXED);
+  __atomic_store_n(&queue->bottom, bottom + 1, __ATOMIC_RELEASE);
+  return 0;
+}
+
+/********
+ * FUNCIÓN: static void *local_take(LocalQueue *queue, long long *queued)
+ * ARGS_IN: LocalQueue *queue - Cola local del hilo que llama
+ *          long long *queued - (output) Instante en el que se encolo el trabajo
+ * DESCRIPCIÓN: Saca por abajo el ultimo trabajo encolado. Solo la llama su dueño, y solo
+ *              compite con los ladrones por el ultimo trabajo que queda
+ * ARGS_OUT: void * - El trabajo, o NULL si la cola esta vacia
+ ********/
+static void *local_take(LocalQueue *queue, long long *queued) {
+  long bottom = __atomic_load_n(&queue->bottom, __ATOMIC_RELAXED) - 1;
+  __atomic_store_n(&queue->bottom, bottom, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  long top = __atomic_load_n(&queue->top, __ATOMIC_RELAXED);
+  void *job = NULL;
+
+  if (top <= bottom) {
+    job = __atomic_load_n(&queue->jobs[bottom & (THREADLOCALQUEUESIZE - 1)], __ATOMIC_RELAXED);
+    *queued = __atomic_load_n(&queue->queued[bottom & (THREADLOCALQUEUESIZE - 1)], __ATOMIC_RELAXED);
+    if (top == bottom) {
+      if (!__atomic_compare_exchange_n(&queue->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        job = NULL;
+      __atomic_store_n(&queue->bottom, bottom + 1, __ATOMIC_RELAXED);
+    }
+  } else {
+    __atomic_store_n(&queue->bottom, bottom + 1, __ATOMIC_RELAXED);
+  }
+  return job;
+}
+
+/********
+ * FUNCIÓN: static void *local_steal(LocalQueue *queue, int *empty, long long *queued)
+ * ARGS_IN: LocalQueue *queue - Cola local de otro hilo
+ *          int *empty - Se pone a 1 si la cola estaba vacia
+ *          long long *queued - (output) Instante en el que se encolo el trabajo
+ * DESCRIPCIÓN: Roba por arriba el trabajo mas antiguo de la cola
+ * ARGS_OUT: void * - El trabajo, o NULL si la cola esta vacia u otro hilo se lo ha llevado antes
+ ********/
+static void *local_steal(LocalQueue *queue, int *empty, long long *queued) {
+  long top = __atomic_load_n(&queue->top, __ATOMIC_ACQUIRE);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  long bottom = __atomic_load_n(&queue->bottom, __ATOMIC_ACQUIRE);
+
+  *empty = top >= bottom;
+  if (*empty)
+    return NULL;
+  void *job = __atomic_load_n(&queue->jobs[top & (THREADLOCALQUEUESIZE - 1)], __ATOMIC_RELAXED);
+  *queued = __atomic_load_n(&queue->queued[top & (THREADLOCALQUEUESIZE - 1)], __ATOMIC_RELAXED);
+  if (!__atomic_compare_exchange_n(&queue->top, &top, top + 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    return NULL;
+  return job;
+}
+
+/********
+ * FUNCIÓN: static HolderJob *holder_job(ThreadPool *pool, int index)
+ * ARGS_IN: ThreadPool *pool - Pool
+ *          int index - Indice global del hilo
+ * DESCRIPCIÓN: Acceso directo a la informacion de un hilo a traves del array de lotes
+ * ARGS_OUT: HolderJob * - Informacion del hilo
+ ********/
+static HolderJob *holder_job(ThreadPool *pool, int index) {
+  return &pool->batches[index / THREADBATCHCOUNT]->holderJobs[index % THREADBATCHCOUNT];
+}
+
+/********
+ * FUNCIÓN: static int wake_thread(ThreadPool *pool)
+ * ARGS_IN: ThreadPool *pool - Pool
+ * DESCRIPCIÓN: Despierta al hilo dormido de menor indice: lo localiza con find-first-set
+ *              sobre el bitmap y se lo queda quien consigue borrar su bit
+ * ARGS_OUT: int - Devuelve 0 si se ha despertado a un hilo, -1 si no habia ninguno dormido
+ ********/
+static int wake_thread(ThreadPool *pool) {
+  int numWords = (__atomic_load_n(&pool->numBatches, __ATOMIC_ACQUIRE) * THREADBATCHCOUNT + 63) / 64;
+
+  for (int word = 0; word < numWords; word++) {
+    unsigned long mask = __atomic_load_n(&pool->sleepingMask[word], __ATOMIC_SEQ_CST);
+    while (mask) {
+      unsigned long bit = 1UL << __builtin_ctzl(mask);
+      unsigned long prev = __atomic_fetch_and(&pool->sleepingMask[word], ~bit, __ATOMIC_SEQ_CST);
+      if (prev & bit) {
+        HolderJob *hJob = holder_job(pool, word * 64 + __builtin_ctzl(bit));
+        __atomic_store_n(&hJob->wakeWord, HOLDERWAKE, __ATOMIC_RELEASE);
+        futex(&hJob->wakeWord, FUTEX_WAKE_PRIVATE, 1);
+        return 0;
+      }
+      mask = prev & ~bit;
+    }
+  }
+  return -1;
+}
+
+/********
+ * FUNCIÓN: static void post_jobs(ThreadPool *pool, int numJobs)
+ * ARGS_IN: ThreadPool *pool - Pool
+ *          int numJobs - Trabajos que se acaban de encolar
+ * DESCRIPCIÓN: Anuncia los trabajos encolados y despierta a un hilo dormido por cada uno.
+ *              Solo hay llamada al sistema si hay algun hilo dormido
+ ********/
+static void post_jobs(ThreadPool *pool, int numJobs) {
+  __atomic_add_fetch(&pool->pendingJobs, numJobs, __ATOMIC_SEQ_CST);
+  for (int i = 0; i < numJobs && wake_thread(pool) == 0; i++)
+    ;
+}
+
+/********
+ * FUNCIÓN: static int wait_job(ThreadPool *pool, HolderJob *hJob)
+ * ARGS_IN: ThreadPool *pool - Pool
+ *          HolderJob *hJob - Informacion del hilo que espera
+ * DESCRIPCIÓN: Duerme en el futex del hilo hasta que haya un trabajo pendiente y lo coge
+ * ARGS_OUT: int - Devuelve 0 si ha cogido un trabajo, -1 si el hilo debe terminar (el pool
+ *                 se destruye o su lote se retira)
+ ********/
+static int wait_job(ThreadPool *pool, HolderJob *hJob) {
+  int index = hJob->id * THREADBATCHCOUNT + hJob->position;
+  unsigned long *word = &pool->sleepingMask[index / 64];
+  unsigned long bit = 1UL << (index % 64);
+
+  while (!pool->suicide) {
+    int pending = __atomic_load_n(&pool->pendingJobs, __ATOMIC_SEQ_CST);
+    if (pending > 0) {
+      if (__atomic_compare_exchange_n(&pool->pendingJobs, &pending, pending - 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST))
+        return 0;
+      continue;
+    }
+
+    __atomic_store_n(&hJob->wakeWord, HOLDERSLEEPING, __ATOMIC_RELAXED);
+    __atomic_fetch_or(word, bit, __ATOMIC_SEQ_CST);
+    // Con el bit ya puesto se vuelve a mirar: o post_jobs ve el bit o aqui se ve el trabajo
+    if (__atomic_load_n(&pool->pendingJobs, __ATOMIC_SEQ_CST) == 0 && !pool->suicide)
+      futex(&hJob->wakeWord, FUTEX_WAIT_PRIVATE, HOLDERSLEEPING);
+    // Si el bit ya no estaba, otro hilo lo ha reclamado y va a indicar en wakeWord para que
+    if (!(__atomic_fetch_and(word, ~bit, __ATOMIC_SEQ_CST) & bit)) {
+      while (__atomic_load_n(&hJob->wakeWord, __ATOMIC_ACQUIRE) == HOLDERSLEEPING && !pool->suicide)
+        futex(&hJob->wakeWord, FUTEX_WAIT_PRIVATE, HOLDERSLEEPING);
+      if (__atomic_load_n(&hJob->wakeWord, __ATOMIC_ACQUIRE) == HOLDERRETIRE)
+        return -1;
+    }
+  }
+  return -1;
+}
+
+/********
+ * FUNCIÓN: static void *steal_job(ThreadPool *pool, long long *queued)
+ * ARGS_IN: ThreadPool *pool - Pool
+ *          long long *queued - (output) Instante en el que se encolo el trabajo
+ * DESCRIPCIÓN: Roba un trabajo de la cola local de algun hilo, localizandolos con find-first-set
+ *              sobre el bitmap de colas con trabajos. Quita del bitmap las colas que encuentra vacias
+ * ARGS_OUT: void * - El trabajo, o NULL si no ha conseguido robar ninguno
+ ********/
+static void *steal_job(ThreadPool *pool, long long *queued) {
+  int numWords = (__atomic_load_n(&pool->numBatches, __ATOMIC_ACQUIRE) * THREADBATCHCOUNT + 63) / 64;
+
+  for (int word = 0; word < numWords; word++) {
+    unsigned long mask = __atomic_load_n(&pool->queuedMask[word], __ATOMIC_SEQ_CST);
+    while (mask) {
+      int index = word * 64 + __builtin_ctzl(mask);
+      unsigned long bit = 1UL << (index % 64);
+      LocalQueue *queue = &pool->localQueues[index / THREADBATCHCOUNT][index % THREADBATCHCOUNT];
+      int empty;
+      void *job = local_steal(queue, &empty, queued);
+      if (job)
+        return job;
+      if (empty) {
+        __atomic_fetch_and(&pool->queuedMask[word], ~bit, __ATOMIC_SEQ_CST);
+        // Su dueño puede haber encolado justo antes de que se borrase el bit
+        if (__atomic_load_n(&queue->top, __ATOMIC_SEQ_CST) < __atomic_load_n(&queue->bottom, __ATOMIC_SEQ_CST))
+          __atomic_fetch_or(&pool->queuedMask[word], bit, __ATOMIC_SEQ_CST);
+      }
+      mask &= ~bit;
+    }
+  }
+  return NULL;
+}
+
+/********
+ * FUNCIÓN: static void *find_job(ThreadPool *pool, HolderJob *hJob, long long *queued)
+ * ARGS_IN: ThreadPool *pool - Pool
+ *          HolderJob *hJob - Hilo que ha cogido un trabajo anunciado
+ *          long long *queued - (output) Instante en el que se encolo el trabajo
+ * DESCRIPCIÓN: Busca el trabajo anunciado: primero en la cola local del hilo, despues en la
+ *              cola del pool y por ultimo en las colas locales del resto de hilos
+ * ARGS_OUT: void * - El trabajo, o NULL si el pool se destruye mientras se busca
+ ********/
+static void *find_job(ThreadPool *pool, HolderJob *hJob, long long *queued) {
+  void *job = NULL;
+
+  // El trabajo esta anunciado, pero su productor puede no haber terminado de publicarlo
+  while (!pool->suicide) {
+    if ((job = local_take(hJob->localQueue, queued)) || (job = dequeue_job(pool, queued)))
+      return job;
+    if ((job = steal_job(pool, queued))) {
+      stat_add(&hJob->stats.jobsStolen, 1);
+      return job;
+    }
+    sched_yield();
+  }
+  return NULL;
+}
+
+/********
+ * FUNCIÓN: static int reserve_threads(ThreadPool *pool, int numThreads)
+ * ARGS_IN: ThreadPool *pool - Pool
+ *          int numThreads - Hilos a reservar
+ * DESCRIPCIÓN: Reserva numThreads hilos libres, o ninguno si no hay tantos
+ * ARGS_OUT: int - Devuelve 0 si se han reservado, -1 si no habia suficientes hilos libres
+ ********/
+static int reserve_threads(ThreadPool *pool, int numThreads) {
+  int idle = __atomic_load_n(&pool->idleThreads, __ATOMIC_RELAXED);
+  while (idle >= numThreads) {
+    if (__atomic_compare_exchange_n(&pool->idleThreads, &idle, idle - numThreads, 1, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+      return 0;
+  }
+  return -1;
 }
 
 /********
@@ -80,28 +535,44 @@ static void signal_usr1_handler() {}
 /********
  * FUNCIÓN: static void *holder_execution_job(void *args)
  * ARGS_IN: void *args - Puntero a HolderJob que contiene informacion para el hilo
- * DESCRIPCIÓN: Se mantiene en espera hasta que se desbloquea para ejecutar la funcion del servidor
+ * DESCRIPCIÓN: Espera trabajos (propios, de la cola del pool o robados a otros hilos) y
+ *              ejecuta con cada uno la funcion del servidor
  * ARGS_OUT: void * - No devuelve informacion util. NULL
  ********/
 static void *holder_execution_job(void *args) {
   HolderJob *hJob = (HolderJob *)args;
-  ThreadBatch *myBatch = find_batch(hJob->id);
+  ThreadPool *pool = hJob->pool;
 
-  pthread_cleanup_push(cleanup_function, &hJob->jobInfo);
+  currentHolder = hJob;
+  pthread_cleanup_push(pool->cleanup_function, &hJob->jobInfo);
 
-  while (hJob->jobInfo == NULL) {
-    int ret = pthread_mutex_lock(&myBatch->mutex[hJob->position]);
+  // No se cogen trabajos hasta que esta creado todo el lote: si falla, el lote se deshace sin que
+  // ninguno de sus hilos haya tocado la cola ni los bitmaps
+  while (__atomic_load_n(&hJob->wakeWord, __ATOMIC_ACQUIRE) == HOLDERSTARTING)
+    futex(&hJob->wakeWord, FUTEX_WAIT_PRIVATE, HOLDERSTARTING);
 
-    // comprobamos si suicide esta activo porque pthread_mutex_lock no se puede interrumpir nunca, entonces
-    // cuando quiero matarlos, la función destroy_all_job pone jobInfo a NULL y hace unlock del mutex. 
-    if (ret == -1 || suicide) {
+  while (__atomic_load_n(&hJob->wakeWord, __ATOMIC_ACQUIRE) != HOLDERRETIRE && !pool->suicide) {
+    if (wait_job(pool, hJob) == -1)
       break;
-    }
+    long long queued;
+    void *job = find_job(pool, hJob, &queued);
+    if (!job)
+      break;
+    long long start = pool_now_us();
+    stat_add(&hJob->stats.jobsStarted, 1);
+    stat_time(&hJob->stats.waitTime, hJob->stats.waitHistogram, start - queued);
+
     // llamada de la funcion del cliente
-    (*client_function)(hJob->jobInfo);
+    __atomic_store_n(&hJob->jobInfo, job, __ATOMIC_RELAXED);
+    (*pool->client_function)(hJob->jobInfo);
 
-    // como ha terminado, jobInfo se pone a NULL
-    hJob->jobInfo = NULL;
+    // como ha terminado, jobInfo se pone a NULL y el hilo vuelve a estar libre
+    __atomic_store_n(&hJob->jobInfo, NULL, __ATOMIC_RELAXED);
+    long long end = pool_now_us();
+    stat_add(&hJob->stats.jobsCompleted, 1);
+    stat_time(&hJob->stats.runTime, hJob->stats.runHistogram, end - start);
+    __atomic_store_n(&hJob->lastActive, end / 1000, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&pool->idleThreads, 1, __ATOMIC_RELEASE);
   }
 
   pthread_cleanup_pop(1);
@@ -109,76 +580,264 @@ static void *holder_execution_job(void *args) {
 }
 
 /********
- * FUNCIÓN: static int initialize_batch(ThreadBatch *batch, int id)
- * ARGS_IN: ThreadBatch *batch - Lote que se rellena con la informacion necesaria
+ * FUNCIÓN: static int initialize_batch(ThreadPool *pool, ThreadBatch *batch, int id)
+ * ARGS_IN: ThreadPool *pool - Pool al que pertenece el lote
+ *          ThreadBatch *batch - Lote que se rellena con la informacion necesaria
  *          int id - Identificador a asignar al lote
- * DESCRIPCIÓN: Inicializa el lote
+ * DESCRIPCIÓN: Inicializa el lote y lo añade al array de lotes. Cada hilo creado cuenta
+ *              como libre en idleThreads. Si no se pueden crear todos los hilos, los ya creados
+ *              terminan sin coger ningun trabajo y se esperan, y el lote se quita del array
  * ARGS_OUT: int - Devuelve 0 en caso de exito, -1 en caso de error
  ********/
-static int initialize_batch(ThreadBatch *batch, int id) {
+static int initialize_batch(ThreadPool *pool, ThreadBatch *batch, int id) {
+  pthread_attr_t attr, *attrp = NULL;
   batch->id = id;
+  // Las colas locales de esta posicion del array se conservan de un lote a otro
+  if (!pool->localQueues[id]) {
+    pool->localQueues[id] = (LocalQueue *)aligned_alloc(64, THREADBATCHCOUNT * sizeof(LocalQueue));
+    if (!pool->localQueues[id])
+      return -1;
+    memset(pool->localQueues[id], 0, THREADBATCHCOUNT * sizeof(LocalQueue));
+  }
+  // Se publica antes de crear los hilos: wake_thread debe poder ver el bit de cualquiera de ellos
+  pool->batches[id] = batch;
+  __atomic_store_n(&pool->numBatches, id + 1, __ATOMIC_RELEASE);
+
+  if ((pool->pinned || poolStackSize > 0) && pthread_attr_init(&attr) == 0) {
+    attrp = &attr;
+    if (pool->pinned && pthread_attr_setaffinity_np(attrp, sizeof(pool->cpus), &pool->cpus))
+      syslog(LOG_ERR, "Error setting thread pool affinity");
+    if (poolStackSize > 0 && pthread_attr_setstacksize(attrp, poolStackSize))
+      syslog(LOG_ERR, "Error setting thread pool stack size");
+  }
 
   for (int i = 0; i < THREADBATCHCOUNT; i++) {
     batch->holderJobs[i].id = id;
     batch->holderJobs[i].position = i;
-    int ret = pthread_mutex_init(&batch->mutex[i], NULL);
-    if (ret) {
-      pthread_kill(batch->threads[i], SIGKILL);
-      for (int j = 0; j < i; j++) {
-        pthread_kill(batch->threads[j], SIGKILL);
-        pthread_mutex_destroy(&batch->mutex[j]);
-      }
-      return -1;
-    }
-    pthread_mutex_lock(&batch->mutex[i]);
+    batch->holderJobs[i].pool = pool;
+    batch->holderJobs[i].lastActive = pool_now();
+    batch->holderJobs[i].localQueue = &pool->localQueues[id][i];
+    batch->holderJobs[i].wakeWord = HOLDERSTARTING;
 
-    ret = pthread_create(&batch->threads[i], NULL, &holder_execution_job, &batch->holderJobs[i]);
+    int ret = pthread_create(&batch->threads[i], attrp, &holder_execution_job, &batch->holderJobs[i]);
     if (ret) {
+      syslog(LOG_ERR, "Error creating pool thread: %s", strerror(ret));
       for (int j = 0; j < i; j++) {
-        pthread_kill(batch->threads[j], SIGKILL);
-        pthread_mutex_destroy(&batch->mutex[j]);
+        __atomic_store_n(&batch->holderJobs[j].wakeWord, HOLDERRETIRE, __ATOMIC_RELEASE);
+        futex(&batch->holderJobs[j].wakeWord, FUTEX_WAKE_PRIVATE, 1);
       }
+      for (int j = 0; j < i; j++)
+        pthread_join(batch->threads[j], NULL);
+      if (attrp)
+        pthread_attr_destroy(attrp);
+      __atomic_store_n(&pool->numBatches, id, __ATOMIC_RELEASE);
+      pool->batches[id] = NULL;
       return -1;
     }
   }
+  if (attrp)
+    pthread_attr_destroy(attrp);
+  for (int i = 0; i < THREADBATCHCOUNT; i++) {
+    __atomic_store_n(&batch->holderJobs[i].wakeWord, HOLDERWAKE, __ATOMIC_RELEASE);
+    futex(&batch->holderJobs[i].wakeWord, FUTEX_WAKE_PRIVATE, 1);
+  }
+  __atomic_add_fetch(&pool->idleThreads, THREADBATCHCOUNT, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&totalThreads, THREADBATCHCOUNT, __ATOMIC_RELAXED);
+  pool->batchesCreated++;
   return 0;
 }
 
 /********
- * FUNCIÓN: static ThreadBatch *create_new_batch(ThreadBatch *lastBatch)
- * ARGS_IN: ThreadBatch *lastBatch - (opcional) ultima batch de la lista enlazada.
- *                                   Permite asignar la nueva lista más rápido
- * DESCRIPCIÓN: Crea un nuevo lote
- * ARGS_OUT: ThreadBatch * - Devuelve la nueva batch en caso de éxito. NULL en caso de error
+ * FUNCIÓN: static int add_batch(ThreadPool *pool)
+ * ARGS_IN: ThreadPool *pool - Pool al que se añade el lote
+ * DESCRIPCIÓN: Crea un nuevo lote al final del array. Se llama con growMutex bloqueado
+ * ARGS_OUT: int - Devuelve 0 en caso de exito, -1 en caso de error
  ********/
-static ThreadBatch *create_new_batch(ThreadBatch *lastBatch) {
-  ThreadBatch *batch = &firstBatch;
-  if (lastBatch) {
-    // encuentra el ultimo batch mas rapido
-    batch = lastBatch;
-  }
-  int id;
-  for (; batch->nextBatch != NULL; batch = batch->nextBatch) {
+static int add_batch(ThreadPool *pool) {
+  ThreadBatch *batch = (ThreadBatch *)calloc(1, sizeof(ThreadBatch));
+  if (!batch || initialize_batch(pool, batch, pool->numBatches) == -1) {
+    syslog(LOG_ERR, "Error creating batch\n");
+    free(batch);
+    return -1;
   }
-  id = batch->id + 1;
+  return 0;
+}
 
-  ThreadBatch *newBatch = (ThreadBatch *)calloc(1, sizeof(ThreadBatch));
-  if (!newBatch) {
-    return NULL;
+/********
+ * FUNCIÓN: static int grow_pool(ThreadPool *pool)
+ * ARGS_IN: ThreadPool *pool - Pool al que se añade el lote
+ * DESCRIPCIÓN: Crea un nuevo lote si hay trabajos reservados sin hilo. Si varios hilos se
+ *              quedan sin hilos libres a la vez, solo uno crea el lote. Con el pool en su
+ *              maximo, o si no se pueden crear mas hilos, los trabajos esperan en la cola a que
+ *              termine otro
+ * ARGS_OUT: int - Devuelve 0 si el trabajo tendra hilo, -1 en caso de error
+ ********/
+static int grow_pool(ThreadPool *pool) {
+  int ret = 0;
+
+  pthread_mutex_lock(&pool->growMutex);
+  // Otro hilo puede haber creado un lote mientras esperabamos
+  if (__atomic_load_n(&pool->idleThreads, __ATOMIC_ACQUIRE) < 0) {
+    if (pool->numBatches < pool->maxBatches) {
+      // Sin hilos nuevos (RLIMIT_NPROC, memoria) se sigue con los que hay
+      if (add_batch(pool) == -1 && pool->numBatches == 0)
+        ret = -1;
+    } else if (!pool->atMax) {
+      pool->atMax = 0x01;
+      syslog(LOG_WARNING, "Thread pool reached its maximum of %d threads, jobs will wait", pool->maxBatches * THREADBATCHCOUNT);
+    }
   }
+  pthread_mutex_unlock(&pool->growMutex);
+  return ret;
+}
 
-  ThreadBatch *prevBatch = batch;
+/********
+ * FUNCIÓN: static int retire_batch(ThreadPool *pool)
+ * ARGS_IN: ThreadPool *pool - Pool del que se retira el lote
+ * DESCRIPCIÓN: Retira el ultimo lote si todos sus hilos llevan idleTimeout sin trabajo y el
+ *              pool no baja de minThreads ni de spareThreads libres: reclama el bit de cada hilo dormido (asi ningun
+ *              trabajo lo despierta), les indica que terminen, los espera y libera el lote
+ * ARGS_OUT: int - Devuelve 0 si se ha retirado el lote, -1 si no
+ ********/
+static int retire_batch(ThreadPool *pool) {
+  int b = pool->numBatches - 1;
+  long long now = pool_now();
 
-  batch = newBatch;
+  // Sin el lote deben quedar al menos minThreads hilos y mas de spareThreads libres (si no,
+  // el siguiente trabajo haria crecer de nuevo el pool)
+  if (b == 0 || b * THREADBATCHCOUNT < pool->minThreads ||
+      __atomic_load_n(&pool->idleThreads, __ATOMIC_RELAXED) <= THREADBATCHCOUNT + pool->spareThreads)
+    return -1;
+  ThreadBatch *batch = pool->batches[b];
+  for (int i = 0; i < THREADBATCHCOUNT; i++) {
+    if (now - __atomic_load_n(&batch->holderJobs[i].lastActive, __ATOMIC_RELAXED) < pool->idleTimeout)
+      return -1;
+  }
+  if (reserve_threads(pool, THREADBATCHCOUNT) == -1)
+    return -1;
 
-  batch->prevBatch = prevBatch;
-  prevBatch->nextBatch = batch;
+  int claimed = 0;
+  for (; claimed < THREADBATCHCOUNT; claimed++) {
+    int index = b * THREADBATCHCOUNT + claimed;
+    unsigned long bit = 1UL << (index % 64);
+    if (!(__atomic_fetch_and(&pool->sleepingMask[index / 64], ~bit, __ATOMIC_SEQ_CST) & bit))
+      break;
+  }
+  // Un hilo dormido puede tener aun continuaciones que otro hilo va a robar
+  int busy = claimed < THREADBATCHCOUNT;
+  for (int i = 0; !busy && i < THREADBATCHCOUNT; i++) {
+    LocalQueue *queue = batch->holderJobs[i].localQueue;
+    busy = __atomic_load_n(&queue->top, __ATOMIC_SEQ_CST) < __atomic_load_n(&queue->bottom, __ATOMIC_SEQ_CST);
+  }
+  // Algun hilo esta ocupado: los reclamados se despiertan como si hubiera trabajo y vuelven a dormir
+  if (busy) {
+    __atomic_add_fetch(&pool->idleThreads, THREADBATCHCOUNT, __ATOMIC_RELEASE);
+    for (int i = 0; i < claimed; i++) {
+      __atomic_store_n(&batch->holderJobs[i].wakeWord, HOLDERWAKE, __ATOMIC_RELEASE);
+      futex(&batch->holderJobs[i].wakeWord, FUTEX_WAKE_PRIVATE, 1);
+    }
+    return -1;
+  }
 
-  if (initialize_batch(batch, id) == -1) {
-    return NULL;
+  for (int i = 0; i < THREADBATCHCOUNT; i++) {
+    __atomic_store_n(&batch->holderJobs[i].wakeWord, HOLDERRETIRE, __ATOMIC_RELEASE);
+    futex(&batch->holderJobs[i].wakeWord, FUTEX_WAKE_PRIVATE, 1);
+  }
+  for (int i = 0; i < THREADBATCHCOUNT; i++) {
+    pthread_join(batch->threads[i], NULL);
+    merge_stats(&pool->retiredStats, &batch->holderJobs[i].stats);
+  }
+  pool->batchesRetired++;
+  __atomic_store_n(&pool->numBatches, b, __ATOMIC_RELEASE);
+  pool->batches[b] = NULL;
+  pool->atMax = 0x00;
+  free(batch);
+  __atomic_sub_fetch(&totalThreads, THREADBATCHCOUNT, __ATOMIC_RELAXED);
+  return 0;
+}
+
+/********
+ * FUNCIÓN: static void grow_spare(ThreadPool *pool)
+ * ARGS_IN: ThreadPool *pool - Pool al que se añaden lotes
+ * DESCRIPCIÓN: Crea growBatches lotes, y mas si aun asi quedan menos de spareThreads hilos
+ *              libres, sin pasar de maxBatches
+ ********/
+static void grow_spare(ThreadPool *pool) {
+  pthread_mutex_lock(&pool->growMutex);
+  int before = pool->numBatches;
+  for (int added = 0; added < pool->growBatches || __atomic_load_n(&pool->idleThreads, __ATOMIC_ACQUIRE) < pool->spareThreads;
+       added++) {
+    if (pool->numBatches >= pool->maxBatches) {
+      if (!pool->atMax && __atomic_load_n(&pool->idleThreads, __ATOMIC_ACQUIRE) < 0) {
+        pool->atMax = 0x01;
+        syslog(LOG_WARNING, "Thread pool reached its maximum of %d threads, jobs will wait",
+               pool->maxBatches * THREADBATCHCOUNT);
+      }
+      break;
+    }
+    if (add_batch(pool) == -1)
+      break;
   }
+  if (pool->numBatches != before)
+    syslog(LOG_INFO, "Thread pool grown from %d to %d threads", before * THREADBATCHCOUNT, pool->numBatches * THREADBATCHCOUNT);
+  pthread_mutex_unlock(&pool->growMutex);
+}
+
+/********
+ * FUNCIÓN: static void request_growth(ThreadPool *pool)
+ * ARGS_IN: ThreadPool *pool - Pool que debe crecer
+ * DESCRIPCIÓN: Pide al hilo de mantenimiento que cree lotes. Solo la primera peticion
+ *              hasta que los crea hace una llamada al sistema
+ ********/
+static void request_growth(ThreadPool *pool) {
+  if (__atomic_exchange_n(&pool->growRequested, 0x01, __ATOMIC_ACQ_REL))
+    return;
+  pthread_mutex_lock(&pool->maintainerMutex);
+  pthread_cond_signal(&pool->maintainerCond);
+  pthread_mutex_unlock(&pool->maintainerMutex);
+}
+
+/********
+ * FUNCIÓN: static void *maintainer_loop(void *args)
+ * ARGS_IN: void *args - Pool a mantener
+ * DESCRIPCIÓN: Crea lotes en cuanto se le pide (fuera del hilo que añade trabajos) y cada
+ *              THREADPOOLREAPERINTERVAL milisegundos retira los lotes sin trabajo
+ * ARGS_OUT: void * - No devuelve informacion util. NULL
+ ********/
+static void *maintainer_loop(void *args) {
+  ThreadPool *pool = (ThreadPool *)args;
+  long long nextReap = pool_now() + THREADPOOLREAPERINTERVAL;
+  struct timespec wakeup;
+
+  pthread_mutex_lock(&pool->maintainerMutex);
+  while (!pool->stopMaintainer) {
+    if (!__atomic_load_n(&pool->growRequested, __ATOMIC_ACQUIRE) && pool_now() < nextReap) {
+      wakeup.tv_sec = nextReap / 1000;
+      wakeup.tv_nsec = (nextReap % 1000) * 1000000;
+      pthread_cond_timedwait(&pool->maintainerCond, &pool->maintainerMutex, &wakeup);
+      continue;
+    }
+    pthread_mutex_unlock(&pool->maintainerMutex);
+
+    if (__atomic_exchange_n(&pool->growRequested, 0x00, __ATOMIC_ACQ_REL))
+      grow_spare(pool);
+    if (pool->idleTimeout > 0 && pool_now() >= nextReap) {
+      pthread_mutex_lock(&pool->growMutex);
+      int before = pool->numBatches;
+      while (retire_batch(pool) == 0)
+        ;
+      if (pool->numBatches != before)
+        syslog(LOG_INFO, "Thread pool shrunk from %d to %d threads", before * THREADBATCHCOUNT,
+               pool->numBatches * THREADBATCHCOUNT);
+      pthread_mutex_unlock(&pool->growMutex);
+    }
+    if (pool_now() >= nextReap)
+      nextReap = pool_now() + THREADPOOLREAPERINTERVAL;
 
-  return batch;
+    pthread_mutex_lock(&pool->maintainerMutex);
+  }
+  pthread_mutex_unlock(&pool->maintainerMutex);
+  return NULL;
 }
 
 /********
@@ -188,12 +847,11 @@ static ThreadBatch *create_new_batch(ThreadBatch *lastBatch) {
  *              teniendo valor 1 si está ejecutandose y 0 si esta esperando
  ********/
 /*
-static void printInfo() {
-  ThreadBatch *batch = &firstBatch;
+static void printInfo(ThreadPool *pool) {
   printf("\nPrint Info\n");
-  for (; batch != NULL; batch = batch->nextBatch) {
+  for (int b = 0; b < pool->numBatches; b++) {
     for (int i = 0; i < THREADBATCHCOUNT; i++) {
-      int val = batch->holderJobs[i].jobInfo != NULL;
+      int val = pool->batches[b]->holderJobs[i].jobInfo != NULL;
       printf("%d, ", val);
     }
     printf("\n");
@@ -202,105 +860,424 @@ static void printInfo() {
 */
 
 /********
- * FUNCIÓN: static void destroy_all_job()
+ * FUNCIÓN: static void destroy_all_job(ThreadPool *pool)
+ * ARGS_IN: ThreadPool *pool - Pool cuyos trabajos se destruyen
  * DESCRIPCIÓN: Destruye todos los trabajos que han sido creados
  ********/
-static void destroy_all_job() {
-  ThreadBatch *batch = &firstBatch;
-  for (; batch != NULL; batch = batch->nextBatch) {
-    int i = 0;
-    for (HolderJob *job = batch->holderJobs; i < THREADBATCHCOUNT; job++, i++) {
-      suicide = 0x01;
-      pthread_cancel(batch->threads[i]);
-      pthread_mutex_unlock(&batch->mutex[i]);
-    }
+static void destroy_all_job(ThreadPool *pool) {
+  // El hilo de mantenimiento no puede cambiar el array mientras se recorre
+  if (pool->maintainerRunning) {
+    pthread_mutex_lock(&pool->maintainerMutex);
+    pool->stopMaintainer = 0x01;
+    pthread_cond_signal(&pool->maintainerCond);
+    pthread_mutex_unlock(&pool->maintainerMutex);
+    pthread_join(pool->maintainerThread, NULL);
+    pool->maintainerRunning = 0x00;
+  }
+  pool->suicide = 0x01;
+  for (int b = 0; b < pool->numBatches; b++) {
+    for (int i = 0; i < THREADBATCHCOUNT; i++)
+      pthread_cancel(pool->batches[b]->threads[i]);
+  }
+  // Despierta a los hilos dormidos, que al ver suicide terminan
+  for (int i = 0; i < pool->numBatches * THREADBATCHCOUNT; i++) {
+    HolderJob *hJob = holder_job(pool, i);
+    __atomic_store_n(&hJob->wakeWord, HOLDERWAKE, __ATOMIC_RELEASE);
+    futex(&hJob->wakeWord, FUTEX_WAKE_PRIVATE, 1);
   }
 }
 
 
 /********
- * FUNCIÓN: int initialize_pool(void *(*client_fun)(void *), void (*cleanup_fun)(void *))
+ * FUNCIÓN: static int pin_caller(const cpu_set_t *cpus, cpu_set_t *previous)
+ * ARGS_IN: const cpu_set_t *cpus - CPUs a las que se mueve el hilo que llama
+ *          cpu_set_t *previous - Donde se guardan las CPUs que tenia el hilo
+ * DESCRIPCIÓN: Mueve temporalmente al hilo que llama a las CPUs del pool, de modo que la
+ *              memoria que toca por primera vez queda en el nodo NUMA de esas CPUs
+ * ARGS_OUT: int - Devuelve 0 si se ha movido el hilo, -1 en caso contrario
+ ********/
+static int pin_caller(const cpu_set_t *cpus, cpu_set_t *previous) {
+  if (pthread_getaffinity_np(pthread_self(), sizeof(*previous), previous) ||
+      pthread_setaffinity_np(pthread_self(), sizeof(*cpus), cpus))
+    return -1;
+  return 0;
+}
+
+/********
+ * FUNCIÓN: ThreadPool *initialize_pool(void *(*client_fun)(void *), void (*cleanup_fun)(void *))
  * ARGS_IN: void *(*client_fun)(void *) - Funcion que recibe un parametro void *.
  *                                        Esta es la funcion que se llamará al añadir un trabajo
  *          void *(*cleanup_fun)(void *) - Funcion que recibe un parametro void *.
  *                                         Esta es la funcion que se llamará al destruir un hilo
- * DESCRIPCIÓN: Inicializa la pool de hilos, estableciendo a su vez las funciones del cliente y limpieza
- * ARGS_OUT: int - Devuelve 0 en caso de exito, -1 en caso de error
+ * DESCRIPCIÓN: Crea e inicializa un pool de hilos, estableciendo a su vez las funciones del cliente y limpieza
+ * ARGS_OUT: ThreadPool * - Devuelve el pool en caso de exito, NULL en caso de error
+ ********/
+ThreadPool *initialize_pool(void *(*client_fun)(void *), void (*cleanup_fun)(void *)) {
+  return initialize_pool_on_cpus(client_fun, cleanup_fun, NULL);
+}
+
+/********
+ * FUNCIÓN: ThreadPool *initialize_pool_on_cpu(void *(*client_fun)(void *), void (*cleanup_fun)(void *), int cpu)
+ * ARGS_IN: void *(*client_fun)(void *) - Funcion que se llamará al añadir un trabajo
+ *          void *(*cleanup_fun)(void *) - Funcion que se llamará al destruir un hilo
+ *          int cpu - CPU a la que se fijan todos los hilos del pool (-1 para no fijarlos)
+ * DESCRIPCIÓN: Igual que initialize_pool, pero los hilos (tambien los de los lotes que se
+ *              creen despues) solo se ejecutan en la CPU indicada
+ * ARGS_OUT: ThreadPool * - Devuelve el pool en caso de exito, NULL en caso de error
  ********/
-int initialize_pool(void *(*client_fun)(void *), void (*cleanup_fun)(void *)) {
-  client_function = client_fun;
+ThreadPool *initialize_pool_on_cpu(void *(*client_fun)(void *), void (*cleanup_fun)(void *), int cpu) {
+  char cpuList[16];
+
+  if (cpu < 0)
+    return initialize_pool_on_cpus(client_fun, cleanup_fun, NULL);
+  snprintf(cpuList, sizeof(cpuList), "%d", cpu);
+  return initialize_pool_on_cpus(client_fun, cleanup_fun, cpuList);
+}
+
+/********
+ * FUNCIÓN: ThreadPool *initialize_pool_on_cpus(void *(*client_fun)(void *), void (*cleanup_fun)(void *), const char *cpuList)
+ * ARGS_IN: void *(*client_fun)(void *) - Funcion que se llamará al añadir un trabajo
+ *          void *(*cleanup_fun)(void *) - Funcion que se llamará al destruir un hilo
+ *          const char *cpuList - CPUs a las que se fijan todos los hilos del pool, con el formato
+ *                                de sysfs ("0-3,8"). NULL o "" para no fijarlos
+ * DESCRIPCIÓN: Igual que initialize_pool, pero los hilos solo se ejecutan en las CPUs indicadas
+ *              (por ejemplo, las de un nodo NUMA). El pool, sus colas y sus lotes se reservan
+ *              e inicializan desde esas CPUs, asi que su memoria queda en el nodo de los hilos
+ * ARGS_OUT: ThreadPool * - Devuelve el pool en caso de exito, NULL en caso de error
+ ********/
+ThreadPool *initialize_pool_on_cpus(void *(*client_fun)(void *), void (*cleanup_fun)(void *), const char *cpuList) {
+  cpu_set_t cpus, previous;
+  int pinned = cpuList && cpuList[0];
+
+  if (pinned && parse_cpu_list(cpuList, &cpus) <= 0) {
+    syslog(LOG_ERR, "Invalid CPU list \"%s\"", cpuList);
+    return NULL;
+  }
+  int moved = pinned && pin_caller(&cpus, &previous) == 0;
+
+  // calloc garantiza que todo el pool (y su primer lote) empieza a 0
+  ThreadPool *pool = (ThreadPool *)calloc(1, sizeof(ThreadPool));
+  if (!pool) {
+    if (moved)
+      pthread_setaffinity_np(pthread_self(), sizeof(previous), &previous);
+    return NULL;
+  }
+  pool->client_function = client_fun;
   if (!cleanup_fun)
-    cleanup_function = empty_function;
+    pool->cleanup_function = empty_function;
   else
-    cleanup_function = cleanup_fun;
-  ThreadBatch *batch = &firstBatch;
-  establece_manejador(SIGUSR1, signal_usr1_handler);
+    pool->cleanup_function = cleanup_fun;
+  if (pinned) {
+    pool->cpus = cpus;
+    pool->pinned = 0x01;
+  }
+  pool->minThreads = THREADBATCHCOUNT;
+  pool->maxBatches = THREADPOOLMAXBATCHES;
+  pool->growBatches = 1;
+  for (unsigned long i = 0; i < THREADPOOLQUEUESIZE; i++)
+    pool->jobs[i].sequence = i;
+  pthread_condattr_t condAttr;
+  pthread_condattr_init(&condAttr);
+  pthread_condattr_setclock(&condAttr, CLOCK_MONOTONIC);
+  if (pthread_mutex_init(&pool->growMutex, NULL) || pthread_mutex_init(&pool->maintainerMutex, NULL) ||
+      pthread_cond_init(&pool->maintainerCond, &condAttr)) {
+    pthread_condattr_destroy(&condAttr);
+    free(pool);
+    pool = NULL;
+  } else {
+    pthread_condattr_destroy(&condAttr);
+    establece_manejador(SIGUSR1, signal_usr1_handler);
+    if (initialize_batch(pool, &pool->firstBatch, 0) == -1) {
+      pthread_mutex_destroy(&pool->growMutex);
+      pthread_mutex_destroy(&pool->maintainerMutex);
+      pthread_cond_destroy(&pool->maintainerCond);
+      free(pool);
+      pool = NULL;
+    }
+  }
+  if (moved)
+    pthread_setaffinity_np(pthread_self(), sizeof(previous), &previous);
+  if (pool) {
+    pthread_mutex_lock(&poolsMutex);
+    pool->nextPool = allPools;
+    allPools = pool;
+    pthread_mutex_unlock(&poolsMutex);
+  }
+  return pool;
+}
 
-  return initialize_batch(batch, 0);
+/********
+ * FUNCIÓN: void set_pool_stack_size(size_t stackSize)
+ * ARGS_IN: size_t stackSize - Bytes de pila de cada hilo (0 para usar el tamaño por defecto del sistema)
+ * DESCRIPCIÓN: Fija el tamaño de pila de los hilos de los pools que se creen desde este momento
+ *              (tambien de los lotes que se añadan despues). Se llama antes de crear los pools
+ ********/
+void set_pool_stack_size(size_t stackSize) { poolStackSize = stackSize; }
+
+/********
+ * FUNCIÓN: int configure_pool(ThreadPool *pool, PoolSettings *settings)
+ * ARGS_IN: ThreadPool *pool - Pool a configurar
+ *          PoolSettings *settings - Limites y crecimiento del pool
+ * DESCRIPCIÓN: Fija los limites del pool, redondeados a lotes de THREADBATCHCOUNT hilos, crea
+ *              los hilos de prewarmThreads y arranca el hilo de mantenimiento. Desde entonces
+ *              los lotes se crean en segundo plano antes de que se agoten los hilos libres,
+ *              y se retiran (del ultimo al primero, liberando sus pilas) tras idleTimeout.
+ *              Se llama una sola vez, justo despues de crear el pool
+ * ARGS_OUT: int - Devuelve 0 en caso de exito, -1 en caso de error
+ ********/
+int configure_pool(ThreadPool *pool, PoolSettings *settings) {
+  int ret = 0;
+
+  pthread_mutex_lock(&pool->growMutex);
+  pool->maxBatches = (settings->maxThreads + THREADBATCHCOUNT - 1) / THREADBATCHCOUNT;
+  if (pool->maxBatches <= 0 || pool->maxBatches > THREADPOOLMAXBATCHES)
+    pool->maxBatches = THREADPOOLMAXBATCHES;
+  int maxThreads = pool->maxBatches * THREADBATCHCOUNT;
+  pool->minThreads = settings->minThreads < maxThreads ? settings->minThreads : maxThreads;
+  pool->spareThreads = settings->spareThreads > 0 ? settings->spareThreads : 0;
+  pool->growBatches = (settings->growThreads + THREADBATCHCOUNT - 1) / THREADBATCHCOUNT;
+  if (pool->growBatches <= 0)
+    pool->growBatches = 1;
+  pool->idleTimeout = (long long)settings->idleTimeout * 1000;
+
+  cpu_set_t previous;
+  int moved = pool->pinned && pin_caller(&pool->cpus, &previous) == 0;
+  int prewarm = settings->prewarmThreads > pool->minThreads ? settings->prewarmThreads : pool->minThreads;
+  while (ret == 0 && pool->numBatches * THREADBATCHCOUNT < prewarm && pool->numBatches < pool->maxBatches)
+    ret = add_batch(pool);
+  if (moved)
+    pthread_setaffinity_np(pthread_self(), sizeof(previous), &previous);
+  pthread_mutex_unlock(&pool->growMutex);
+  if (ret == -1)
+    return -1;
+
+  // El hilo de mantenimiento reserva los lotes nuevos, asi que tambien se fija a las CPUs del pool
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  if (pool->pinned)
+    pthread_attr_setaffinity_np(&attr, sizeof(pool->cpus), &pool->cpus);
+  ret = pthread_create(&pool->maintainerThread, &attr, maintainer_loop, pool);
+  pthread_attr_destroy(&attr);
+  if (ret) {
+    syslog(LOG_ERR, "Error creating thread pool maintainer");
+    return -1;
+  }
+  pool->maintainerRunning = 0x01;
+  return 0;
+}
+
+/********
+ * FUNCIÓN: int pool_size(ThreadPool *pool)
+ * ARGS_IN: ThreadPool *pool - Pool
+ * DESCRIPCIÓN: Numero de hilos del pool en este momento
+ * ARGS_OUT: int - Numero de hilos
+ ********/
+int pool_size(ThreadPool *pool) { return __atomic_load_n(&pool->numBatches, __ATOMIC_RELAXED) * THREADBATCHCOUNT; }
+
+/********
+ * FUNCIÓN: long pool_threads()
+ * DESCRIPCIÓN: Numero de hilos de todos los pools en este momento
+ * ARGS_OUT: long - Numero de hilos
+ ********/
+long pool_threads() { return __atomic_load_n(&totalThreads, __ATOMIC_RELAXED); }
+
+/********
+ * FUNCIÓN: void pool_stats(ThreadPool *pool, PoolStats *stats)
+ * ARGS_IN: ThreadPool *pool - Pool
+ *          PoolStats *stats - (output) Estadisticas a las que se suman las del pool
+ * DESCRIPCIÓN: Suma a stats las estadisticas del pool (se pone a 0 antes para obtener solo
+ *              las de este pool). Cada hilo cuenta las suyas sin compartirlas con nadie, y
+ *              aqui se juntan con las de los lotes ya retirados, asi que contarlas no añade
+ *              contencion a los hilos
+ ********/
+void pool_stats(ThreadPool *pool, PoolStats *stats) {
+  ThreadStats total;
+
+  // Con growMutex ningun lote se crea ni se retira mientras se recorren
+  pthread_mutex_lock(&pool->growMutex);
+  total = pool->retiredStats;
+  int threads = pool->numBatches * THREADBATCHCOUNT;
+  for (int i = 0; i < threads; i++) {
+    HolderJob *hJob = holder_job(pool, i);
+    merge_stats(&total, &hJob->stats);
+    if (__atomic_load_n(&hJob->jobInfo, __ATOMIC_RELAXED))
+      stats->busyThreads++;
+    else
+      stats->idleThreads++;
+  }
+  stats->threads += threads;
+  stats->batches += pool->numBatches;
+  stats->batchesCreated += pool->batchesCreated;
+  stats->batchesRetired += pool->batchesRetired;
+  pthread_mutex_unlock(&pool->growMutex);
+
+  int pending = __atomic_load_n(&pool->pendingJobs, __ATOMIC_RELAXED);
+  stats->queuedJobs += pending > 0 ? pending : 0;
+  stats->jobsStarted += total.jobsStarted;
+  stats->jobsCompleted += total.jobsCompleted;
+  stats->jobsStolen += total.jobsStolen;
+  stats->waitTime += total.waitTime;
+  stats->runTime += total.runTime;
+  for (int i = 0; i < POOLSTATSBUCKETS; i++) {
+    stats->waitHistogram[i] += total.waitHistogram[i];
+    stats->runHistogram[i] += total.runHistogram[i];
+  }
+}
+
+/********
+ * FUNCIÓN: void pools_stats(PoolStats *stats)
+ * ARGS_IN: PoolStats *stats - (output) Estadisticas a las que se suman las de todos los pools
+ * DESCRIPCIÓN: Suma a stats las estadisticas de todos los pools que existen en este momento
+ ********/
+void pools_stats(PoolStats *stats) {
+  pthread_mutex_lock(&poolsMutex);
+  for (ThreadPool *pool = allPools; pool; pool = pool->nextPool)
+    pool_stats(pool, stats);
+  pthread_mutex_unlock(&poolsMutex);
+}
+
+/********
+ * FUNCIÓN: static int reserve_job(ThreadPool *pool)
+ * ARGS_IN: ThreadPool *pool - Pool en el que se va a ejecutar un trabajo
+ * DESCRIPCIÓN: Reserva un hilo para un trabajo. Con hilo de mantenimiento nunca crea hilos:
+ *              si quedan menos de spareThreads libres se lo pide, y si no queda ninguno el
+ *              trabajo espera en la cola a que se creen. Sin el, crea un lote si no queda ninguno
+ * ARGS_OUT: int - Devuelve 0 en caso de exito, -1 en caso de error
+ ********/
+static int reserve_job(ThreadPool *pool) {
+  int idle = __atomic_sub_fetch(&pool->idleThreads, 1, __ATOMIC_ACQUIRE);
+
+  if (pool->maintainerRunning) {
+    if (idle < pool->spareThreads)
+      request_growth(pool);
+    return 0;
+  }
+  if (idle < 0 && grow_pool(pool) == -1) {
+    __atomic_add_fetch(&pool->idleThreads, 1, __ATOMIC_RELEASE);
+    return -1;
+  }
+  return 0;
 }
 
 /********
- * FUNCIÓN: int add_job(void *info)
- * ARGS_IN: void *info - Puntero a la informacion que se quiere delegar al trabajo
+ * FUNCIÓN: static int submit_job(ThreadPool *pool, void *info)
+ * ARGS_IN: ThreadPool *pool - Pool en el que se ejecuta el trabajo
+ *          void *info - Informacion del trabajo
+ * DESCRIPCIÓN: Reserva un hilo para el trabajo y lo encola, sin anunciarlo todavia
+ * ARGS_OUT: int - Devuelve 0 en caso de exito, -1 en caso de error (errno EAGAIN si la cola esta llena)
+ ********/
+static int submit_job(ThreadPool *pool, void *info) {
+  if (reserve_job(pool) == -1)
+    return -1;
+  // Con el pool en pool_max_threads los trabajos esperan en la cola sin hilo reservado, y si
+  // cada uno ocupa su hilo mucho tiempo (conexiones keep-alive) la cola no se vacia: no se espera
+  if (enqueue_job(pool, info) == -1) {
+    __atomic_add_fetch(&pool->idleThreads, 1, __ATOMIC_RELEASE);
+    errno = EAGAIN;
+    return -1;
+  }
+  return 0;
+}
+
+/********
+ * FUNCIÓN: int add_job(ThreadPool *pool, void *info)
+ * ARGS_IN: ThreadPool *pool - Pool en el que se ejecuta el trabajo
+ *          void *info - Puntero a la informacion que se quiere delegar al trabajo
  *                       asignado en initialize_pool
- * DESCRIPCIÓN: Inicia un trabajo
- * ARGS_OUT: int - Devuelve el id trabajo (valor no negativo), -1 en caso de error
+ * DESCRIPCIÓN: Inicia un trabajo en O(1): reserva un hilo libre (o crea un lote si no
+ *              hay), encola el trabajo y despierta a un hilo solo si hay alguno dormido
+ * ARGS_OUT: int - Devuelve 0 en caso de exito, -1 en caso de error (errno EAGAIN si la cola esta llena)
  ********/
-int add_job(void *info) {
-  ThreadBatch *batch = &firstBatch;
-  u_int8_t createBatch = 0x01;
-  do {
+int add_job(ThreadPool *pool, void *info) {
+  if (submit_job(pool, info) == -1)
+    return -1;
+  post_jobs(pool, 1);
+  return 0;
+}
 
-    for (int i = 0; i < THREADBATCHCOUNT; i++) {
-      // Asegurandonos de que no se esta suicidando
-      if (batch->holderJobs[i].jobInfo == NULL) {
-        batch->holderJobs[i].jobInfo = info;
-        pthread_mutex_unlock(&batch->mutex[i]);
-        return THREADBATCHCOUNT * batch->id + i;
-      }
-    }
+/********
+ * FUNCIÓN: int add_jobs(ThreadPool *pool, void **infos, int numInfos)
+ * ARGS_IN: ThreadPool *pool - Pool en el que se ejecutan los trabajos
+ *          void **infos - Informacion de cada trabajo a iniciar
+ *          int numInfos - Numero de trabajos
+ * DESCRIPCIÓN: Inicia varios trabajos de una vez, despertando con una sola llamada
+ *              a los hilos necesarios
+ * ARGS_OUT: int - Devuelve el numero de trabajos iniciados (menor que numInfos en caso de error,
+ *                 con errno EAGAIN si la cola esta llena)
+ ********/
+int add_jobs(ThreadPool *pool, void **infos, int numInfos) {
+  int added = 0;
 
-    if (batch->nextBatch) {
-      batch = batch->nextBatch;
-    } else if (createBatch) {
-      createBatch = 0x00;
-      batch = create_new_batch(batch);
-      if (!batch) {
-        syslog(LOG_ERR, "Error creating batch\n");
-        return -1;
-      }
-    }
+  while (added < numInfos && submit_job(pool, infos[added]) == 0)
+    added++;
+  if (added > 0)
+    post_jobs(pool, added);
+  return added;
+}
 
-  } while (batch != NULL);
+/********
+ * FUNCIÓN: int add_local_job(ThreadPool *pool, void *info)
+ * ARGS_IN: ThreadPool *pool - Pool en el que se ejecuta el trabajo
+ *          void *info - Informacion del trabajo
+ * DESCRIPCIÓN: Encola una continuacion del trabajo actual en la cola local del hilo que llama,
+ *              que la ejecutara en cuanto termine (con sus datos aun en cache) salvo que antes
+ *              la robe otro hilo libre. No despierta a ningun hilo, asi que el trabajo actual
+ *              debe terminar justo despues. Fuera de un hilo del pool equivale a add_job
+ * ARGS_OUT: int - Devuelve 0 en caso de exito, -1 en caso de error (errno EAGAIN si la cola esta llena)
+ ********/
+int add_local_job(ThreadPool *pool, void *info) {
+  HolderJob *hJob = currentHolder;
 
-  return -1;
+  if (!hJob || hJob->pool != pool)
+    return add_job(pool, info);
+  if (reserve_job(pool) == -1)
+    return -1;
+  // Con la cola local llena va a la del pool, y entonces si hay que despertar a un hilo
+  if (local_push(hJob->localQueue, info) == -1) {
+    if (enqueue_job(pool, info) == -1) {
+      __atomic_add_fetch(&pool->idleThreads, 1, __ATOMIC_RELEASE);
+      errno = EAGAIN;
+      return -1;
+    }
+    post_jobs(pool, 1);
+    return 0;
+  }
+  int index = hJob->id * THREADBATCHCOUNT + hJob->position;
+  __atomic_fetch_or(&pool->queuedMask[index / 64], 1UL << (index % 64), __ATOMIC_SEQ_CST);
+  __atomic_add_fetch(&pool->pendingJobs, 1, __ATOMIC_SEQ_CST);
+  return 0;
 }
 
 /********
- * FUNCIÓN: void terminate_pool()
+ * FUNCIÓN: void terminate_pool(ThreadPool *pool)
+ * ARGS_IN: ThreadPool *pool - Pool a destruir
  * DESCRIPCIÓN: Destruye todos los trabajos activos y libera la memoria
  ********/
-void terminate_pool() {
-  // printInfo();
-  destroy_all_job();
-  ThreadBatch *batch = &firstBatch;
-  ThreadBatch *lastBatch = batch;
-  for (; batch != NULL; batch = batch->nextBatch) {
-    for (int i = 0; i < THREADBATCHCOUNT; i++) {
-      pthread_kill(batch->threads[i], SIGUSR1);
-      pthread_join(batch->threads[i], NULL);
-      pthread_mutex_destroy(&batch->mutex[i]);
-    }
-    if (batch->nextBatch == NULL) {
-      lastBatch = batch;
+void terminate_pool(ThreadPool *pool) {
+  // printInfo(pool);
+  pthread_mutex_lock(&poolsMutex);
+  for (ThreadPool **prev = &allPools; *prev; prev = &(*prev)->nextPool) {
+    if (*prev == pool) {
+      *prev = pool->nextPool;
+      break;
     }
   }
-  batch = lastBatch;
-  // En este momento batch es el ultimo
-  for (; batch->prevBatch != NULL;) {
-    ThreadBatch *prevBatch = batch->prevBatch;
-    free(batch);
-    batch = prevBatch;
+  pthread_mutex_unlock(&poolsMutex);
+  destroy_all_job(pool);
+  for (int b = 0; b < pool->numBatches; b++) {
+    for (int i = 0; i < THREADBATCHCOUNT; i++) {
+      pthread_kill(pool->batches[b]->threads[i], SIGUSR1);
+      pthread_join(pool->batches[b]->threads[i], NULL);
+    }
   }
-  memset(&firstBatch, 0, sizeof(ThreadBatch));
+  // El primer lote esta dentro del pool
+  for (int b = 1; b < pool->numBatches; b++)
+    free(pool->batches[b]);
+  __atomic_sub_fetch(&totalThreads, pool->numBatches * THREADBATCHCOUNT, __ATOMIC_RELAXED);
+  for (int b = 0; b < THREADPOOLMAXBATCHES && pool->localQueues[b]; b++)
+    free(pool->localQueues[b]);
+  pthread_mutex_destroy(&pool->growMutex);
+  pthread_mutex_destroy(&pool->maintainerMutex);
+  pthread_cond_destroy(&pool->maintainerCond);
+  free(pool);
 }
@@ -0,0 +1,251 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                               *
+ *  timer_wheel_lib.c - Rueda jerarquica de timers para los      *
+ *                      timeouts de las conexiones               *
+ *                                                               *
+ *  Autores:                                                     *
+ *    - Bhavuk Sikka    (bhavuk.sikka@estudiante.uam.es)         *
+ *    - Samuel de Lucas (samuel.lucas@estudiante.uam.es)         *
+ *                                                               *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "../includes/timer_wheel_lib.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/syslog.h>
+#include <sys/types.h>
+#include <time.h>
+
+/* Ranuras de cada nivel. Cada ranura es una lista circular cuya cabeza es un nodo centinela.
+ * El nivel n guarda los timers que vencen dentro de [64^n, 64^(n+1)) ticks */
+static TimerNode wheel[TIMERWHEELLEVELS][TIMERWHEELSLOTS];
+/* Ultimo tick procesado */
+static unsigned long long currentTick = 0;
+/* Instante (timer_now) del tick 0 */
+static long long startTime = 0;
+/* Protege la rueda y serializa los vencimientos con timer_cancel */
+static pthread_mutex_t wheelMutex = PTHREAD_MUTEX_INITIALIZER;
+/* Funcion que se llama al vencer un timer */
+static void (*expire_function)(TimerNode *) = NULL;
+/* Hilo que hace avanzar la rueda */
+static pthread_t wheelThread;
+static volatile u_int8_t stopWheel = 0x00;
+static u_int8_t wheelRunning = 0x00;
+
+/********
+ * FUNCIÓN: static void timer_unlink(TimerNode *timer)
+ * ARGS_IN: TimerNode *timer - Timer a quitar de su ranura
+ * DESCRIPCIÓN: Quita el timer de su ranura. Se llama con wheelMutex bloqueado
+ ********/
+static void timer_unlink(TimerNode *timer) {
+  timer->prev->next = timer->next;
+  timer->next->prev = timer->prev;
+  timer->prev = timer->next = NULL;
+}
+
+/********
+ * FUNCIÓN: static void slot_add(TimerNode *head, TimerNode *timer)
+ * ARGS_IN: TimerNode *head - Centinela de la ranura
+ *          TimerNode *timer - Timer a añadir al final de la ranura
+ * DESCRIPCIÓN: Añade el timer a la ranura. Se llama con wheelMutex bloqueado
+ ********/
+static void slot_add(TimerNode *head, TimerNode *timer) {
+  timer->prev = head->prev;
+  timer->next = head;
+  head->prev->next = timer;
+  head->prev = timer;
+}
+
+/********
+ * FUNCIÓN: static void timer_insert(TimerNode *timer)
+ * ARGS_IN: TimerNode *timer - Timer con expires ya calculado
+ * DESCRIPCIÓN: Inserta el timer en la ranura que le corresponde segun lo que falta para que venza.
+ *              Se llama con wheelMutex bloqueado
+ ********/
+static void timer_insert(TimerNode *timer) {
+  unsigned long long maxDelta = (1ULL << (TIMERWHEELBITS * TIMERWHEELLEVELS)) - 1;
+  int level = 0;
+
+  // Lo que ya ha vencido se procesa en el siguiente tick
+  if (timer->expires <= currentTick)
+    timer->expires = currentTick + 1;
+  if (timer->expires - currentTick > maxDelta)
+    timer->expires = currentTick + maxDelta;
+
+  unsigned long long delta = timer->expires - currentTick;
+  while (level < TIMERWHEELLEVELS - 1 && delta >= (1ULL << (TIMERWHEELBITS * (level + 1))))
+    level++;
+  slot_add(&wheel[level][(timer->expires >> (TIMERWHEELBITS * level)) & (TIMERWHEELSLOTS - 1)], timer);
+}
+
+/********
+ * FUNCIÓN: static int cascade(int level)
+ * ARGS_IN: int level - Nivel cuya ranura actual se reparte
+ * DESCRIPCIÓN: Reparte en los niveles inferiores los timers de la ranura actual del nivel.
+ *              Los que vencen en el tick actual van a la ranura que se procesa a continuacion.
+ *              Se llama con wheelMutex bloqueado
+ * ARGS_OUT: int - Indice de la ranura repartida
+ ********/
+static int cascade(int level) {
+  int index = (currentTick >> (TIMERWHEELBITS * level)) & (TIMERWHEELSLOTS - 1);
+  TimerNode *head = &wheel[level][index];
+
+  while (head->next != head) {
+    TimerNode *timer = head->next;
+    timer_unlink(timer);
+    if (timer->expires <= currentTick)
+      slot_add(&wheel[0][currentTick & (TIMERWHEELSLOTS - 1)], timer);
+    else
+      timer_insert(timer);
+  }
+  return index;
+}
+
+/********
+ * FUNCIÓN: static void advance_wheel(unsigned long long nowTick)
+ * ARGS_IN: unsigned long long nowTick - Tick actual segun el reloj
+ * DESCRIPCIÓN: Procesa los ticks pendientes hasta nowTick, venciendo los timers de cada uno.
+ *              Se llama con wheelMutex bloqueado
+ ********/
+static void advance_wheel(unsigned long long nowTick) {
+  while (currentTick < nowTick) {
+    currentTick++;
+    int index = currentTick & (TIMERWHEELSLOTS - 1);
+
+    // Al dar la vuelta un nivel, la ranura actual del siguiente baja de nivel
+    for (int level = 1; index == 0 && level < TIMERWHEELLEVELS; level++)
+      index = cascade(level);
+
+    TimerNode *head = &wheel[0][currentTick & (TIMERWHEELSLOTS - 1)];
+    while (head->next != head) {
+      TimerNode *timer = head->next;
+      timer_unlink(timer);
+      expire_function(timer);
+    }
+  }
+}
+
+/********
+ * FUNCIÓN: static void *wheel_loop(void *args)
+ * ARGS_IN: void *args - No usado
+ * DESCRIPCIÓN: Hace avanzar la rueda cada TIMERWHEELTICK milisegundos
+ * ARGS_OUT: void * - No devuelve informacion util. NULL
+ ********/
+static void *wheel_loop(void *args) {
+  struct timespec tick = {TIMERWHEELTICK / 1000, (TIMERWHEELTICK % 1000) * 1000000};
+
+  while (!stopWheel) {
+    nanosleep(&tick, NULL);
+    pthread_mutex_lock(&wheelMutex);
+    advance_wheel((timer_now() - startTime) / TIMERWHEELTICK);
+    pthread_mutex_unlock(&wheelMutex);
+  }
+  return NULL;
+}
+
+/********
+ * FUNCIÓN: int initialize_timer_wheel(void (*expire_fun)(TimerNode *))
+ * ARGS_IN: void (*expire_fun)(TimerNode *) - Funcion que se llama con cada timer que vence.
+ *                                            Se llama con la rueda bloqueada, asi que no puede
+ *                                            armar ni cancelar timers y debe ser rapida
+ * DESCRIPCIÓN: Crea el hilo que hace avanzar la rueda cada TIMERWHEELTICK milisegundos
+ * ARGS_OUT: int - Devuelve 0 en caso de exito, -1 en caso de error
+ ********/
+int initialize_timer_wheel(void (*expire_fun)(TimerNode *)) {
+  for (int level = 0; level < TIMERWHEELLEVELS; level++) {
+    for (int i = 0; i < TIMERWHEELSLOTS; i++)
+      wheel[level][i].prev = wheel[level][i].next = &wheel[level][i];
+  }
+  expire_function = expire_fun;
+  currentTick = 0;
+  startTime = timer_now();
+
+  stopWheel = 0x00;
+  if (pthread_create(&wheelThread, NULL, wheel_loop, NULL)) {
+    syslog(LOG_ERR, "Error creating timer wheel thread");
+    return -1;
+  }
+  wheelRunning = 0x01;
+  return 0;
+}
+
+/********
+ * FUNCIÓN: long long timer_now()
+ * DESCRIPCIÓN: Reloj monotono usado por la rueda
+ * ARGS_OUT: long long - Milisegundos desde un instante arbitrario
+ ********/
+long long timer_now() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (long long)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/********
+ * FUNCIÓN: void timer_arm(TimerNode *timer, long long ms)
+ * ARGS_IN: TimerNode *timer - Timer a armar (si ya lo estaba se rearma)
+ *          long long ms - Milisegundos hasta el vencimiento
+ * DESCRIPCIÓN: Arma el timer en O(1): se inserta en la ranura de su nivel
+ ********/
+void timer_arm(TimerNode *timer, long long ms) {
+  if (!wheelRunning)
+    return;
+  // Se redondea hacia arriba: el timer nunca vence antes de tiempo
+  long long expires = (timer_now() - startTime + ms + TIMERWHEELTICK - 1) / TIMERWHEELTICK;
+
+  pthread_mutex_lock(&wheelMutex);
+  if (timer->next)
+    timer_unlink(timer);
+  timer->expires = expires > 0 ? expires : 0;
+  timer_insert(timer);
+  pthread_mutex_unlock(&wheelMutex);
+}
+
+/********
+ * FUNCIÓN: void timer_cancel(TimerNode *timer)
+ * ARGS_IN: TimerNode *timer - Timer a cancelar
+ * DESCRIPCIÓN: Desarma el timer en O(1). Al volver, su funcion de vencimiento no se esta
+ *              ejecutando ni se ejecutara. No hace nada si no estaba armado
+ ********/
+void timer_cancel(TimerNode *timer) {
+  pthread_mutex_lock(&wheelMutex);
+  if (timer->next)
+    timer_unlink(timer);
+  pthread_mutex_unlock(&wheelMutex);
+}
+
+/********
+ * FUNCIÓN: void timer_expire_matching(int (*match)(TimerNode *))
+ * ARGS_IN: int (*match)(TimerNode *) - Devuelve 1 para los timers que deben vencer ya. Se llama
+ *                                      con la rueda bloqueada, como la funcion de vencimiento
+ * DESCRIPCIÓN: Vence en este momento los timers armados que cumplen match, recorriendo todas
+ *              las ranuras. Es O(timers armados), para usos puntuales como el cierre del servidor
+ ********/
+void timer_expire_matching(int (*match)(TimerNode *)) {
+  pthread_mutex_lock(&wheelMutex);
+  for (int level = 0; level < TIMERWHEELLEVELS; level++) {
+    for (int i = 0; i < TIMERWHEELSLOTS; i++) {
+      TimerNode *head = &wheel[level][i];
+      for (TimerNode *timer = head->next, *next; timer != head; timer = next) {
+        next = timer->next;
+        if (match(timer)) {
+          timer_unlink(timer);
+          expire_function(timer);
+        }
+      }
+    }
+  }
+  pthread_mutex_unlock(&wheelMutex);
+}
+
+/********
+ * FUNCIÓN: void terminate_timer_wheel()
+ * DESCRIPCIÓN: Detiene el hilo de la rueda. Los timers que sigan armados no vencen
+ ********/
+void terminate_timer_wheel() {
+  if (!wheelRunning)
+    return;
+  stopWheel = 0x01;
+  pthread_join(wheelThread, NULL);
+  wheelRunning = 0x00;
+}
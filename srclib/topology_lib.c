@@ -0,0 +1,145 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                               *
+ *  topology_lib.c - Topologia de CPUs y nodos NUMA (sysfs)      *
+ *                                                               *
+ *  Autores:                                                     *
+ *    - Bhavuk Sikka    (bhavuk.sikka@estudiante.uam.es)         *
+ *    - Samuel de Lucas (samuel.lucas@estudiante.uam.es)         *
+ *                                                               *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#define _GNU_SOURCE
+#include "../includes/topology_lib.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/********
+ * FUNCIÓN: static int read_line(const char *path, char *line, int len)
+ * ARGS_IN: const char *path - Archivo a leer
+ *          char *line - Buffer para la primera linea, sin el salto de linea
+ *          int len - Tamaño del buffer
+ * DESCRIPCIÓN: Lee la primera linea de un archivo de sysfs
+ * ARGS_OUT: int - Devuelve 0 en caso de exito, -1 en caso de error
+ ********/
+static int read_line(const char *path, char *line, int len) {
+  FILE *file = fopen(path, "r");
+  if (!file)
+    return -1;
+  char *ret = fgets(line, len, file);
+  fclose(file);
+  if (!ret)
+    return -1;
+  line[strcspn(line, "\n")] = 0;
+  return 0;
+}
+
+/********
+ * FUNCIÓN: int parse_cpu_list(const char *cpuList, cpu_set_t *cpus)
+ * ARGS_IN: const char *cpuList - Lista de CPUs con el formato de sysfs y taskset ("0-3,8,10-11")
+ *          cpu_set_t *cpus - Conjunto que se rellena con las CPUs de la lista
+ * DESCRIPCIÓN: Interpreta una lista de CPUs. Requiere _GNU_SOURCE para cpu_set_t
+ * ARGS_OUT: int - Devuelve el numero de CPUs de la lista, -1 si la lista no es valida
+ ********/
+int parse_cpu_list(const char *cpuList, cpu_set_t *cpus) {
+  const char *p = cpuList;
+
+  CPU_ZERO(cpus);
+  while (*p) {
+    char *end;
+    long first = strtol(p, &end, 10), last;
+    if (end == p || first < 0)
+      return -1;
+    last = first;
+    p = end;
+    if (*p == '-') {
+      p++;
+      last = strtol(p, &end, 10);
+      if (end == p || last < first)
+        return -1;
+      p = end;
+    }
+    if (last >= CPU_SETSIZE)
+      return -1;
+    for (long cpu = first; cpu <= last; cpu++)
+      CPU_SET(cpu, cpus);
+    if (*p == ',')
+      p++;
+    else if (*p)
+      return -1;
+  }
+  return CPU_COUNT(cpus);
+}
+
+/********
+ * FUNCIÓN: int numa_num_nodes()
+ * DESCRIPCIÓN: Numero de nodos NUMA de la maquina (el mayor identificador mas uno)
+ * ARGS_OUT: int - Numero de nodos, 1 si el sistema no expone la topologia
+ ********/
+int numa_num_nodes() {
+  char line[CPULISTLEN];
+  cpu_set_t nodes;
+  int numNodes = 1;
+
+  // La lista de nodos tiene el mismo formato que la de CPUs
+  if (read_line("/sys/devices/system/node/possible", line, sizeof(line)) == -1 || parse_cpu_list(line, &nodes) <= 0)
+    return 1;
+  for (int node = 0; node < CPU_SETSIZE; node++) {
+    if (CPU_ISSET(node, &nodes))
+      numNodes = node + 1;
+  }
+  return numNodes;
+}
+
+/********
+ * FUNCIÓN: int format_cpu_list(const cpu_set_t *cpus, char *cpuList, int len)
+ * ARGS_IN: const cpu_set_t *cpus - Conjunto de CPUs
+ *          char *cpuList - Buffer en el que se escribe la lista, con el formato de parse_cpu_list
+ *          int len - Tamaño del buffer (CPULISTLEN basta)
+ * DESCRIPCIÓN: Escribe un conjunto de CPUs como lista, agrupando las consecutivas en rangos
+ * ARGS_OUT: int - Devuelve 0 en caso de exito, -1 si la lista no cabe en el buffer
+ ********/
+int format_cpu_list(const cpu_set_t *cpus, char *cpuList, int len) {
+  int written = 0;
+
+  cpuList[0] = 0;
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (!CPU_ISSET(cpu, cpus))
+      continue;
+    int last = cpu;
+    while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, cpus))
+      last++;
+    if (last == cpu)
+      written += snprintf(cpuList + written, len - written, "%s%d", written ? "," : "", cpu);
+    else
+      written += snprintf(cpuList + written, len - written, "%s%d-%d", written ? "," : "", cpu, last);
+    if (written >= len)
+      return -1;
+    cpu = last;
+  }
+  return 0;
+}
+
+/********
+ * FUNCIÓN: int numa_cpu_node(int cpu)
+ * ARGS_IN: int cpu - CPU
+ * DESCRIPCIÓN: Nodo NUMA al que pertenece una CPU
+ * ARGS_OUT: int - El nodo, o -1 si no se conoce
+ ********/
+int numa_cpu_node(int cpu) {
+  char path[64];
+  struct dirent *entry;
+  int node = -1;
+
+  // El directorio de cada CPU tiene un enlace nodeN a su nodo
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+  DIR *dir = opendir(path);
+  if (!dir)
+    return -1;
+  while (node < 0 && (entry = readdir(dir)))
+    sscanf(entry->d_name, "node%d", &node);
+  closedir(dir);
+  return node;
+}
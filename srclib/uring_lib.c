@@ -0,0 +1,532 @@
+/* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ *                                                               *
+ *  uring_lib.c - Backend de entrada/salida con io_uring         *
+ *                                                               *
+ *  Autores:                                                     *
+ *    - Bhavuk Sikka    (bhavuk.sikka@estudiante.uam.es)         *
+ *    - Samuel de Lucas (samuel.lucas@estudiante.uam.es)         *
+ *                                                               *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#define _GNU_SOURCE
+
+#include "../includes/uring_lib.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/syslog.h>
+#include <unistd.h>
+
+/* Identificadores de cada operacion de la cadena de envio */
+#define SENDHEADER 1
+#define SPLICEIN 2
+#define SPLICEOUT 3
+
+/* Ring y tuberia de cada hilo del pool para enviar respuestas */
+typedef struct ThreadURing {
+  URing ring;
+  int pipefds[2];
+  int pipeSize;
+} ThreadURing;
+
+/* Clave para guardar el ThreadURing de cada hilo. Se libera al terminar el hilo */
+static pthread_key_t threadRingKey;
+static pthread_once_t threadRingOnce = PTHREAD_ONCE_INIT;
+
+/********
+ * FUNCIÓN: int uring_probe()
+ * DESCRIPCIÓN: Comprueba en tiempo de ejecucion si el kernel soporta io_uring y todas
+ *              las operaciones que usa el servidor (accept, recv, send, splice, poll,
+ *              timeout y provide buffers)
+ * ARGS_OUT: int - Devuelve 1 si el backend io_uring se puede usar, 0 en caso contrario
+ ********/
+int uring_probe() {
+  const int needed[] = {IORING_OP_ACCEPT,   IORING_OP_RECV,    IORING_OP_SEND,           IORING_OP_SPLICE,
+                        IORING_OP_POLL_ADD, IORING_OP_TIMEOUT, IORING_OP_PROVIDE_BUFFERS};
+  size_t probeLen = sizeof(struct io_uring_probe) + IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe;
+  URing ring;
+  int supported = 1;
+
+  if (uring_init(&ring, 8) == -1)
+    return 0;
+
+  probe = (struct io_uring_probe *)calloc(1, probeLen);
+  if (!probe || syscall(__NR_io_uring_register, ring.ringfd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) < 0) {
+    free(probe);
+    uring_free(&ring);
+    return 0;
+  }
+
+  for (size_t i = 0; i < sizeof(needed) / sizeof(needed[0]); i++) {
+    if (needed[i] > probe->last_op || !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED)) {
+      syslog(LOG_NOTICE, "io_uring operation %d not supported", needed[i]);
+      supported = 0;
+    }
+  }
+
+  free(probe);
+  uring_free(&ring);
+  return supported;
+}
+
+/********
+ * FUNCIÓN: int uring_init(URing *ring, unsigned entries)
+ * ARGS_IN: URing *ring - (output) Ring a inicializar
+ *          unsigned entries - Numero de entradas de la cola de envio
+ * DESCRIPCIÓN: Crea un ring de io_uring y mapea sus colas
+ * ARGS_OUT: int - Devuelve 0 en caso de exito, -1 en caso de error
+ ********/
+int uring_init(URing *ring, unsigned entries) {
+  struct io_uring_params params;
+
+  memset(ring, 0, sizeof(URing));
+  memset(&params, 0, sizeof(params));
+  ring->ringfd = syscall(__NR_io_uring_setup, entries, &params);
+  if (ring->ringfd < 0)
+    return -1;
+
+  ring->sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    // Ambas colas comparten un mismo mapeo
+    if (ring->cqSize > ring->sqSize)
+      ring->sqSize = ring->cqSize;
+    ring->cqSize = 0;
+  }
+
+  ring->sqPtr = mmap(NULL, ring->sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ringfd, IORING_OFF_SQ_RING);
+  if (ring->sqPtr == MAP_FAILED) {
+    ring->sqPtr = NULL;
+    close(ring->ringfd);
+    return -1;
+  }
+  ring->cqPtr = ring->sqPtr;
+  if (ring->cqSize) {
+    ring->cqPtr = mmap(NULL, ring->cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ringfd, IORING_OFF_CQ_RING);
+    if (ring->cqPtr == MAP_FAILED) {
+      munmap(ring->sqPtr, ring->sqSize);
+      ring->sqPtr = NULL;
+      close(ring->ringfd);
+      return -1;
+    }
+  }
+
+  ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = (struct io_uring_sqe *)mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->ringfd,
+                                           IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    if (ring->cqSize)
+      munmap(ring->cqPtr, ring->cqSize);
+    munmap(ring->sqPtr, ring->sqSize);
+    ring->sqPtr = NULL;
+    close(ring->ringfd);
+    return -1;
+  }
+
+  ring->sqHead = (unsigned *)((char *)ring->sqPtr + params.sq_off.head);
+  ring->sqTail = (unsigned *)((char *)ring->sqPtr + params.sq_off.tail);
+  ring->sqMask = (unsigned *)((char *)ring->sqPtr + params.sq_off.ring_mask);
+  ring->sqArray = (unsigned *)((char *)ring->sqPtr + params.sq_off.array);
+  ring->sqEntries = params.sq_entries;
+  ring->sqLocalTail = ring->sqFlushed = *ring->sqTail;
+
+  ring->cqHead = (unsigned *)((char *)ring->cqPtr + params.cq_off.head);
+  ring->cqTail = (unsigned *)((char *)ring->cqPtr + params.cq_off.tail);
+  ring->cqMask = (unsigned *)((char *)ring->cqPtr + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)((char *)ring->cqPtr + params.cq_off.cqes);
+  return 0;
+}
+
+/********
+ * FUNCIÓN: void uring_free(URing *ring)
+ * ARGS_IN: URing *ring - Ring a liberar
+ * DESCRIPCIÓN: Desmapea las colas y cierra el ring
+ ********/
+void uring_free(URing *ring) {
+  if (!ring->sqPtr)
+    return;
+  munmap(ring->sqes, ring->sqesSize);
+  if (ring->cqSize)
+    munmap(ring->cqPtr, ring->cqSize);
+  munmap(ring->sqPtr, ring->sqSize);
+  close(ring->ringfd);
+  ring->sqPtr = NULL;
+}
+
+/********
+ * FUNCIÓN: struct io_uring_sqe *uring_get_sqe(URing *ring)
+ * ARGS_IN: URing *ring - Ring del que obtener la entrada
+ * DESCRIPCIÓN: Reserva una entrada de la cola de envio, ya inicializada a 0
+ * ARGS_OUT: struct io_uring_sqe * - La entrada, o NULL si la cola esta llena
+ ********/
+struct io_uring_sqe *uring_get_sqe(URing *ring) {
+  unsigned head = __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+  if (ring->sqLocalTail - head >= ring->sqEntries)
+    return NULL;
+
+  unsigned index = ring->sqLocalTail & *ring->sqMask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(struct io_uring_sqe));
+  ring->sqArray[index] = index;
+  ring->sqLocalTail++;
+  return sqe;
+}
+
+/********
+ * FUNCIÓN: int uring_submit(URing *ring, unsigned waitNr)
+ * ARGS_IN: URing *ring - Ring cuyas entradas se envian
+ *          unsigned waitNr - Numero de completados a esperar (0 para no esperar)
+ * DESCRIPCIÓN: Entrega al kernel las entradas preparadas con una sola llamada a io_uring_enter
+ * ARGS_OUT: int - Devuelve el numero de entradas enviadas, -1 en caso de error (errno)
+ ********/
+int uring_submit(URing *ring, unsigned waitNr) {
+  unsigned toSubmit = ring->sqLocalTail - ring->sqFlushed;
+  __atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+
+  int ret = syscall(__NR_io_uring_enter, ring->ringfd, toSubmit, waitNr, waitNr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  if (ret < 0)
+    return -1;
+  ring->sqFlushed += ret;
+  return ret;
+}
+
+/********
+ * FUNCIÓN: int uring_wait_events(URing *ring, unsigned waitNr)
+ * ARGS_IN: URing *ring - Ring en el que esperar
+ *          unsigned waitNr - Numero de completados a esperar
+ * DESCRIPCIÓN: Espera completados sin tocar la cola de envio, de modo que otros hilos
+ *              pueden seguir enviando entradas (protegidas por su propio mutex)
+ * ARGS_OUT: int - Devuelve 0 en caso de exito, -1 en caso de error o señal (errno)
+ ********/
+int uring_wait_events(URing *ring, unsigned waitNr) {
+  return syscall(__NR_io_uring_enter, ring->ringfd, 0, waitNr, IORING_ENTER_GETEVENTS, NULL, 0) < 0 ? -1 : 0;
+}
+
+/********
+ * FUNCIÓN: struct io_uring_cqe *uring_peek_cqe(URing *ring)
+ * ARGS_IN: URing *ring - Ring a consultar
+ * DESCRIPCIÓN: Devuelve el siguiente completado sin hacer ninguna llamada al sistema
+ * ARGS_OUT: struct io_uring_cqe * - El completado, o NULL si no hay ninguno
+ ********/
+struct io_uring_cqe *uring_peek_cqe(URing *ring) {
+  unsigned head = *ring->cqHead;
+  if (head == __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE))
+    return NULL;
+  return &ring->cqes[head & *ring->cqMask];
+}
+
+/********
+ * FUNCIÓN: struct io_uring_cqe *uring_wait_cqe(URing *ring)
+ * ARGS_IN: URing *ring - Ring a consultar
+ * DESCRIPCIÓN: Devuelve el siguiente completado, esperando en el kernel si no hay ninguno
+ * ARGS_OUT: struct io_uring_cqe * - El completado, o NULL en caso de error o señal (errno)
+ ********/
+struct io_uring_cqe *uring_wait_cqe(URing *ring) {
+  struct io_uring_cqe *cqe;
+  while (!(cqe = uring_peek_cqe(ring))) {
+    if (uring_submit(ring, 1) == -1)
+      return NULL;
+  }
+  return cqe;
+}
+
+/********
+ * FUNCIÓN: void uring_cqe_seen(URing *ring)
+ * ARGS_IN: URing *ring - Ring del que se ha consumido un completado
+ * DESCRIPCIÓN: Marca como consumido el completado devuelto por uring_peek_cqe/uring_wait_cqe
+ ********/
+void uring_cqe_seen(URing *ring) { __atomic_store_n(ring->cqHead, *ring->cqHead + 1, __ATOMIC_RELEASE); }
+
+/********
+ * FUNCIÓN: int uring_accept(URing *ring, int *sockvals, int numSockvals, int flags, int wait, int *index)
+ * ARGS_IN: URing *ring - Ring del hilo aceptador
+ *          int *sockvals - Sockets de escucha (como mucho 64)
+ *          int numSockvals - Numero de sockets
+ *          int flags - Flags de los sockets aceptados (SOCK_NONBLOCK, SOCK_CLOEXEC)
+ *          int wait - Si es 0 no se espera: solo se recogen conexiones ya aceptadas
+ *          int *index - (output) Posicion en sockvals del socket por el que ha llegado la conexion
+ * DESCRIPCIÓN: Acepta una conexion usando multishot accept: una sola peticion al kernel
+ *              devuelve todas las conexiones que van llegando, que se recogen de la
+ *              cola de completado sin llamadas al sistema mientras haya pendientes
+ * ARGS_OUT: int - Devuelve el descriptor del socket del cliente, -1 en caso de error
+ *                 (errno EAGAIN si no habia conexiones y wait es 0)
+ ********/
+int uring_accept(URing *ring, int *sockvals, int numSockvals, int flags, int wait, int *index) {
+  struct io_uring_cqe *cqe;
+
+  for (int i = 0; i < numSockvals && !ring->acceptStopped; i++) {
+    if (ring->acceptArmed & (1ULL << i))
+      continue;
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (!sqe) {
+      errno = EBUSY;
+      return -1;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = sockvals[i];
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = flags;
+    sqe->user_data = i;
+    ring->acceptArmed |= 1ULL << i;
+  }
+  if (!wait && ring->sqLocalTail != ring->sqFlushed)
+    uring_submit(ring, 0);
+
+  for (;;) {
+    if (ring->acceptStopped && !ring->acceptArmed) {
+      errno = ECANCELED;
+      return -1;
+    }
+    cqe = wait ? uring_wait_cqe(ring) : uring_peek_cqe(ring);
+    if (!cqe) {
+      if (!wait)
+        errno = EAGAIN;
+      return -1;
+    }
+    if (cqe->user_data != URINGCANCELDATA)
+      break;
+    uring_cqe_seen(ring);
+  }
+
+  int res = cqe->res;
+  *index = cqe->user_data;
+  // Sin IORING_CQE_F_MORE el kernel ha dado por terminado el multishot accept
+  if (!(cqe->flags & IORING_CQE_F_MORE))
+    ring->acceptArmed &= ~(1ULL << cqe->user_data);
+  uring_cqe_seen(ring);
+
+  if (res < 0) {
+    errno = -res;
+    return -1;
+  }
+  return res;
+}
+
+/********
+ * FUNCIÓN: void uring_cancel_accept(URing *ring)
+ * ARGS_IN: URing *ring - Ring del hilo aceptador
+ * DESCRIPCIÓN: Cancela los multishot accept del ring. Las conexiones que el kernel ya habia
+ *              aceptado se siguen recogiendo con uring_accept hasta que acceptArmed es 0,
+ *              momento en el que uring_accept devuelve -1 con errno ECANCELED
+ ********/
+void uring_cancel_accept(URing *ring) {
+  ring->acceptStopped = 1;
+  for (int i = 0; i < 64; i++) {
+    if (!(ring->acceptArmed & (1ULL << i)))
+      continue;
+    struct io_uring_sqe *sqe = uring_get_sqe(ring);
+    if (!sqe) {
+      uring_submit(ring, 0);
+      sqe = uring_get_sqe(ring);
+      if (!sqe)
+        break;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = i;
+    sqe->user_data = URINGCANCELDATA;
+  }
+  uring_submit(ring, 0);
+}
+
+/********
+ * FUNCIÓN: static void free_thread_ring(void *arg)
+ * ARGS_IN: void *arg - ThreadURing del hilo que termina
+ * DESCRIPCIÓN: Libera el ring y la tuberia de un hilo
+ ********/
+static void free_thread_ring(void *arg) {
+  ThreadURing *threadRing = (ThreadURing *)arg;
+  uring_free(&threadRing->ring);
+  close(threadRing->pipefds[0]);
+  close(threadRing->pipefds[1]);
+  free(threadRing);
+}
+
+/********
+ * FUNCIÓN: static void create_thread_ring_key()
+ * DESCRIPCIÓN: Crea la clave que guarda el ring de cada hilo
+ ********/
+static void create_thread_ring_key() { pthread_key_create(&threadRingKey, free_thread_ring); }
+
+/********
+ * FUNCIÓN: static ThreadURing *get_thread_ring()
+ * DESCRIPCIÓN: Devuelve el ring del hilo actual, creandolo la primera vez
+ * ARGS_OUT: ThreadURing * - El ring del hilo, NULL en caso de error
+ ********/
+static ThreadURing *get_thread_ring() {
+  pthread_once(&threadRingOnce, create_thread_ring_key);
+  ThreadURing *threadRing = (ThreadURing *)pthread_getspecific(threadRingKey);
+  if (threadRing)
+    return threadRing;
+
+  threadRing = (ThreadURing *)calloc(1, sizeof(ThreadURing));
+  if (!threadRing)
+    return NULL;
+  if (uring_init(&threadRing->ring, URINGTHREADENTRIES) == -1) {
+    free(threadRing);
+    return NULL;
+  }
+  if (pipe2(threadRing->pipefds, O_CLOEXEC) == -1) {
+    uring_free(&threadRing->ring);
+    free(threadRing);
+    return NULL;
+  }
+  // Una tuberia mas grande permite mover mas datos por cada pareja de splice
+  fcntl(threadRing->pipefds[1], F_SETPIPE_SZ, URINGPIPESIZE);
+  threadRing->pipeSize = fcntl(threadRing->pipefds[1], F_GETPIPE_SZ);
+  pthread_setspecific(threadRingKey, threadRing);
+  return threadRing;
+}
+
+/********
+ * FUNCIÓN: static int drain_pipe(ThreadURing *threadRing, int sockfd, long pipeLen)
+ * ARGS_IN: ThreadURing *threadRing - Ring del hilo con la tuberia
+ *          int sockfd - Socket al que enviar lo que quede en la tuberia
+ *          long pipeLen - Bytes que siguen en la tuberia
+ * DESCRIPCIÓN: Vacia la tuberia cuando una cadena de envio se ha cortado a medias
+ * ARGS_OUT: int - Devuelve -1 en caso de error, 0 en el resto de casos
+ ********/
+static int drain_pipe(ThreadURing *threadRing, int sockfd, long pipeLen) {
+  while (pipeLen > 0) {
+    ssize_t ret = splice(threadRing->pipefds[0], NULL, sockfd, NULL, pipeLen, SPLICE_F_MOVE);
+    if (ret <= 0) {
+      // Imposible recuperar la tuberia: se vacia descartando los datos
+      char discard[4096];
+      while (pipeLen > 0 && (ret = read(threadRing->pipefds[0], discard, sizeof(discard))) > 0)
+        pipeLen -= ret;
+      return -1;
+    }
+    pipeLen -= ret;
+  }
+  return 0;
+}
+
+/********
+ * FUNCIÓN: int uring_send_response(int sockfd, char *sendBuffer, int sendBufferLen, int filefd, long fileLen)
+ * ARGS_IN: int sockfd - Socket (bloqueante) por el que enviar los datos
+ *          char *sendBuffer - Cabeceras a enviar
+ *          int sendBufferLen - Longitud de las cabeceras
+ *          int filefd - (opcional) Descriptor del archivo a enviar
+ *          long fileLen - Bytes del archivo a enviar
+ * DESCRIPCIÓN: Envia la respuesta con una cadena enlazada send + splice(archivo -> tuberia)
+ *              + splice(tuberia -> socket) en el ring del hilo, con una sola llamada a
+ *              io_uring_enter en lugar de setsockopt/write/sendfile/setsockopt
+ * ARGS_OUT: int - Devuelve -1 en caso de error, 0 en el resto de casos
+ ********/
+int uring_send_response(int sockfd, char *sendBuffer, int sendBufferLen, int filefd, long fileLen) {
+  ThreadURing *threadRing = get_thread_ring();
+  int headerSent = 0;
+  long fileSent = 0;
+
+  if (!threadRing) {
+    syslog(LOG_ERR, "Error creating io_uring ring for thread");
+    return -1;
+  }
+  if (filefd <= 0)
+    fileLen = 0;
+
+  while (headerSent < sendBufferLen || fileSent < fileLen) {
+    URing *ring = &threadRing->ring;
+    struct io_uring_sqe *sqe;
+    unsigned queued = 0;
+    long queuedOffset = fileSent;
+
+    if (headerSent < sendBufferLen) {
+      sqe = uring_get_sqe(ring);
+      sqe->opcode = IORING_OP_SEND;
+      sqe->fd = sockfd;
+      sqe->addr = (unsigned long)(sendBuffer + headerSent);
+      sqe->len = sendBufferLen - headerSent;
+      sqe->msg_flags = MSG_WAITALL | (fileLen > 0 ? MSG_MORE : 0);
+      sqe->flags = fileLen > 0 ? IOSQE_IO_LINK : 0;
+      sqe->user_data = SENDHEADER;
+      queued++;
+    }
+
+    // Cada trozo del archivo pasa por la tuberia: archivo -> tuberia -> socket
+    while (queuedOffset < fileLen && queued + 2 <= URINGTHREADENTRIES) {
+      long chunk = fileLen - queuedOffset < threadRing->pipeSize ? fileLen - queuedOffset : threadRing->pipeSize;
+      int last = queuedOffset + chunk >= fileLen || queued + 4 > URINGTHREADENTRIES;
+
+      sqe = uring_get_sqe(ring);
+      sqe->opcode = IORING_OP_SPLICE;
+      sqe->fd = threadRing->pipefds[1];
+      sqe->off = (unsigned long long)-1;
+      sqe->splice_fd_in = filefd;
+      sqe->splice_off_in = queuedOffset;
+      sqe->len = chunk;
+      sqe->flags = IOSQE_IO_LINK;
+      sqe->user_data = SPLICEIN;
+
+      sqe = uring_get_sqe(ring);
+      sqe->opcode = IORING_OP_SPLICE;
+      sqe->fd = sockfd;
+      sqe->off = (unsigned long long)-1;
+      sqe->splice_fd_in = threadRing->pipefds[0];
+      sqe->splice_off_in = (unsigned long long)-1;
+      sqe->len = chunk;
+      sqe->splice_flags = SPLICE_F_MOVE | (last && queuedOffset + chunk >= fileLen ? 0 : SPLICE_F_MORE);
+      sqe->flags = last ? 0 : IOSQE_IO_LINK;
+      sqe->user_data = SPLICEOUT;
+
+      queuedOffset += chunk;
+      queued += 2;
+    }
+
+    if (uring_submit(ring, queued) < 0 && errno != EINTR) {
+      syslog(LOG_ERR, "Error submitting to io_uring");
+      return -1;
+    }
+
+    long pipeLen = 0, progress = 0;
+    int failed = 0;
+    for (unsigned i = 0; i < queued; i++) {
+      struct io_uring_cqe *cqe = uring_wait_cqe(ring);
+      if (!cqe) {
+        if (errno == EINTR) {
+          i--;
+          continue;
+        }
+        return -1;
+      }
+      int res = cqe->res;
+      unsigned long long op = cqe->user_data;
+      uring_cqe_seen(ring);
+
+      if (res < 0) {
+        // Los siguientes de la cadena llegan con -ECANCELED
+        if (res != -ECANCELED && res != -EINTR && res != -EAGAIN)
+          failed = 1;
+        continue;
+      }
+      progress += res;
+      if (op == SENDHEADER) {
+        headerSent += res;
+      } else if (op == SPLICEIN) {
+        pipeLen += res;
+      } else {
+        pipeLen -= res;
+        fileSent += res;
+      }
+    }
+
+    // Si la cadena se ha cortado, se reenvia lo que quedo en la tuberia antes de seguir
+    if (pipeLen > 0) {
+      if (drain_pipe(threadRing, sockfd, pipeLen) == -1)
+        return -1;
+      fileSent += pipeLen;
+    }
+    if (failed || progress == 0) {
+      syslog(LOG_ERR, "Error sending data");
+      return -1;
+    }
+  }
+  return 0;
+}